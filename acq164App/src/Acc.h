@@ -0,0 +1,85 @@
+/* ------------------------------------------------------------------------- */
+/* Acc.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#ifndef ACC_H_
+#define ACC_H_
+
+#include <string.h>
+
+/** Accumulates per channel sums over a window of a fixed number of samples.
+ *  The window is scheduled on ADC sample numbers, not host time, so every
+ *  update averages the same samples and remaining() tells the caller where
+ *  to split a frame at a window boundary.
+ */
+template <class T>
+class Acc {
+	const int nchan;
+	long long s0;		/* sample number at start of window, -1: not started */
+	long long window;	/* samples per window */
+
+public:
+	T *ch;
+	int nadd;
+
+	Acc(int _nchan): nchan(_nchan), s0(-1), window(1), nadd(0) {
+		ch = new T[nchan]();
+	}
+	void clear() {
+		memset(ch, 0, nchan*sizeof(T));
+		nadd = 0;
+		s0 = -1;
+	}
+	void setWindow(long long nsam) {
+		window = nsam < 1? 1: nsam;
+	}
+	long long getWindow() const {
+		return window;
+	}
+	/** samples to go in this window, given sample number of the next sample.
+	 *  <= 0 means the window is complete (or the stream jumped past it) */
+	long long remaining(long long sample) {
+		if (s0 < 0){
+			s0 = sample;
+		}
+		return s0 + window - sample;
+	}
+	void set(int ic, T y1){
+		ch[ic] += y1;
+		if (ic == 0) nadd += 1;
+	}
+	/* bulk set(): sum of n values. The caller counts the n once per block
+	 * with count(), so any subset of channels may be added */
+	void add(int ic, T sum){
+		ch[ic] += sum;
+	}
+	void count(int n){
+		nadd += n;
+	}
+	T get(int ic){
+		if (nadd){
+			return ch[ic]/ nadd;
+		}else{
+			return 0;
+		}
+	}
+};
+
+#endif /* ACC_H_ */
@@ -0,0 +1,109 @@
+/* ------------------------------------------------------------------------- */
+/* Arena.cpp
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "Arena.h"
+
+static size_t round_up(size_t x, size_t a)
+{
+	return (x + a - 1) / a * a;
+}
+
+void* Arena::alloc(size_t bytes)
+{
+	const size_t align = bytes >= ARENA_PAGE? ARENA_PAGE: ARENA_LINE;
+	const size_t offset = round_up(used, align);
+
+	if (base && offset + bytes > capacity){
+		fprintf(stderr, "ERROR: %s layout changed between passes\n", __FUNCTION__);
+		return 0;
+	}
+	used = offset + round_up(bytes, ARENA_LINE);
+	return base? base + offset: 0;
+}
+
+int Arena::create(bool hugepages)
+{
+	const size_t bytes = round_up(used > 0? used: ARENA_LINE, hugepages? ARENA_HUGE_PAGE: ARENA_PAGE);
+	void* p = 0;
+
+#ifdef __linux__
+#ifdef MAP_HUGETLB
+	if (hugepages){
+		p = mmap(0, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (p == MAP_FAILED){
+			p = 0;
+		}else{
+			pages = ARENA_PAGES_HUGETLB;
+		}
+	}
+#endif
+	if (p == 0){
+		p = mmap(0, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED){
+			fprintf(stderr, "ERROR: %s mmap %zu bytes failed, trying the heap\n", __FUNCTION__, bytes);
+			p = 0;
+		}
+#ifdef MADV_HUGEPAGE
+		else if (hugepages && madvise(p, bytes, MADV_HUGEPAGE) == 0){
+			pages = ARENA_PAGES_THP;
+		}
+#endif
+	}
+#endif
+	/* the heap, zeroed here: the pages land on this thread's node */
+	if (p == 0){
+		if (posix_memalign(&p, ARENA_PAGE, bytes) != 0){
+			fprintf(stderr, "ERROR: %s %zu bytes failed\n", __FUNCTION__, bytes);
+			return -1;
+		}
+		memset(p, 0, bytes);
+	}
+	base = (char*)p;
+	capacity = bytes;
+	used = 0;
+	return 0;
+}
+
+void Arena::touch()
+{
+	const size_t step = pages == ARENA_PAGES_HUGETLB? ARENA_HUGE_PAGE: ARENA_PAGE;
+
+	/* the pages are zero: writing zero faults them in without changing them */
+	for (size_t off = 0; base && off < hot; off += step){
+		((volatile char*)base)[off] = 0;
+	}
+#if defined(__linux__) && defined(SYS_getcpu)
+	unsigned cpu, nd;
+	if (syscall(SYS_getcpu, &cpu, &nd, 0) == 0){
+		node = (int)nd;
+	}
+#endif
+}
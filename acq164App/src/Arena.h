@@ -0,0 +1,83 @@
+/* ------------------------------------------------------------------------- */
+/* Arena.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_LINE		64		/* every region starts on a cache line */
+#define ARENA_PAGE		4096		/* regions of a page or more start on a page */
+#define ARENA_HUGE_PAGE		(2u<<20)
+
+/* Arena::getPages() */
+#define ARENA_PAGES_NORMAL	0
+#define ARENA_PAGES_THP		1	/* transparent hugepages, advised */
+#define ARENA_PAGES_HUGETLB	2	/* 2 MB hugepages, reserved */
+
+/** One allocation for all of a port's buffers, carved up in order and never
+ *  freed. Used in two passes: in measure mode alloc() returns 0 and only
+ *  counts, then create() maps the total and the same alloc() calls return
+ *  the regions. Pages are zero and are not touched by create(), so they land
+ *  on the NUMA node of the first thread to write them. If mmap() fails the
+ *  arena comes from the heap, zeroed, and so placed, by create(). touch() faults in
+ *  everything before markCold() from the calling thread, meant for the
+ *  streaming thread once it is placed.
+ */
+class Arena {
+	char* base;
+	size_t capacity;
+	size_t used;
+	size_t hot;		/* touch() covers [0, hot) */
+	int pages;
+	int node;		/* NUMA node touch() ran on, -1: not known */
+public:
+	Arena(): base(0), capacity(0), used(0), hot(0), pages(ARENA_PAGES_NORMAL), node(-1) {}
+
+	/** map the bytes counted so far. hugepages: try 2 MB pages, then THP.
+	 *  returns -1 on failure */
+	int create(bool hugepages);
+
+	/** next region of bytes, zero filled. 0 in measure mode */
+	void* alloc(size_t bytes);
+	template <class T> T* alloc(size_t n) {
+		return (T*)alloc(n*sizeof(T));
+	}
+	/** regions from here on are left to fault in on first use */
+	void markCold() {
+		hot = used;
+	}
+	/** calling thread: fault in the hot regions */
+	void touch();
+
+	size_t size() const {
+		return capacity? capacity: used;
+	}
+	int getPages() const {
+		return pages;
+	}
+	int getNode() const {
+		return node;
+	}
+};
+
+#endif /* ARENA_H_ */
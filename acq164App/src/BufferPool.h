@@ -0,0 +1,105 @@
+/* ------------------------------------------------------------------------- */
+/* BufferPool.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#ifndef BUFFERPOOL_H_
+#define BUFFERPOOL_H_
+
+#include <epicsAtomic.h>
+
+/** Index bookkeeping for a small pool of acquisition buffers.
+ *  One filler (the streaming thread) and one consumer (the publisher thread).
+ *  Each buffer carries a reference count: 0 is free, the filler claims a free
+ *  buffer, posts it when full, and the consumer (or anyone it shares the buffer
+ *  with) releases it. Only the filler ever moves a count from 0, so there is
+ *  no need for compare-and-swap.
+ *  Completed buffers go filler -> consumer through a single producer/single
+ *  consumer ring; it can never overflow because a buffer is in the ring at most
+ *  once until it is released.
+ */
+class BufferPool {
+	const int nbuf;
+	const int qlen;
+	int* refs;
+	int* queue;
+	int head;		/* written by filler only */
+	int tail;		/* written by consumer only */
+
+public:
+	BufferPool(int _nbuf): nbuf(_nbuf), qlen(_nbuf+1), head(0), tail(0) {
+		refs = new int[nbuf];
+		queue = new int[qlen];
+		for (int ib = 0; ib < nbuf; ++ib){
+			refs[ib] = 0;
+		}
+	}
+	~BufferPool() {
+		delete [] queue;
+		delete [] refs;
+	}
+	int size() const {
+		return nbuf;
+	}
+	/** filler: claim a free buffer, not current. returns -1 if none free */
+	int acquire(int current) {
+		for (int ib = 0; ib < nbuf; ++ib){
+			if (ib != current && epicsAtomicGetIntT(&refs[ib]) == 0){
+				epicsAtomicSetIntT(&refs[ib], 1);
+				return ib;
+			}
+		}
+		return -1;
+	}
+	/** filler: hand a full buffer to the consumer. Buffer contents must be complete */
+	void post(int ib) {
+		queue[head] = ib;
+		epicsAtomicWriteMemoryBarrier();
+		epicsAtomicSetIntT(&head, (head+1)%qlen);
+	}
+	/** consumer: returns next posted buffer or -1 if none */
+	int take() {
+		if (tail == epicsAtomicGetIntT(&head)){
+			return -1;
+		}
+		epicsAtomicReadMemoryBarrier();
+		int ib = queue[tail];
+		epicsAtomicSetIntT(&tail, (tail+1)%qlen);
+		return ib;
+	}
+	/** share a buffer that is already held */
+	void ref(int ib) {
+		epicsAtomicIncrIntT(&refs[ib]);
+	}
+	void release(int ib) {
+		epicsAtomicDecrIntT(&refs[ib]);
+	}
+	/** number of buffers held, including the one being filled */
+	int inUse() const {
+		int nused = 0;
+		for (int ib = 0; ib < nbuf; ++ib){
+			if (epicsAtomicGetIntT(&refs[ib]) != 0){
+				++nused;
+			}
+		}
+		return nused;
+	}
+};
+
+#endif /* BUFFERPOOL_H_ */
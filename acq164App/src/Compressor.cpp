@@ -0,0 +1,141 @@
+/* ------------------------------------------------------------------------- */
+/* Compressor.cpp
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <epicsThread.h>
+#include <epicsAtomic.h>
+#include <epicsStdio.h>
+
+#include "Compressor.h"
+
+static void compressor_runner(void *pvt)
+{
+	((Compressor *)pvt)->compressor();
+}
+
+Compressor::Compressor(const char* name, int _nchan, int _maxPoints,
+		void (*_onResult)(void* pvt), void* _pvt):
+	nchan(_nchan), maxPoints(_maxPoints),
+	pool(COMP_NBUF),
+	codec(COMP_OFF), level(1),
+	out_len(0), out_ib(0), ratio(0), encode_us(0),
+	onResult(_onResult), pvt(_pvt), overruns(0)
+{
+	blocks = new epicsInt32[(size_t)pool.size()*nchan*maxPoints];
+	block_nw = new int[pool.size()]();
+	block_mask = new int[pool.size()]();
+	block_sample = new long long[pool.size()]();
+	block_ts = new epicsTimeStamp[pool.size()]();
+	out = new epicsInt8[4*(COMP_HEADER_WORDS + nchan*(1 + (comp_bound(maxPoints)+3)/4))];
+
+	wake = epicsEventMustCreate(epicsEventEmpty);
+
+	/* below the streaming and publisher threads, as the spectra are */
+	char tname[32];
+	epicsSnprintf(tname, sizeof(tname), "%s.comp", name);
+	if (epicsThreadCreate(tname, epicsThreadPriorityLow,
+			epicsThreadGetStackSize(epicsThreadStackMedium),
+			(EPICSTHREADFUNC)::compressor_runner, this) == 0){
+		fprintf(stderr, "ERROR: Compressor: epicsThreadCreate failure\n");
+	}
+}
+
+void Compressor::configure(int _codec, int _level)
+{
+	epicsAtomicSetIntT(&codec, _codec);
+	epicsAtomicSetIntT(&level, _level);
+}
+
+bool Compressor::feed(const epicsInt32* raw, int nw, int mask, long long sample, const epicsTimeStamp& ts)
+{
+	if (epicsAtomicGetIntT(&codec) == COMP_OFF){
+		return true;
+	}
+	int ib = pool.acquire(-1);
+	if (ib < 0){
+		epicsAtomicIncrIntT(&overruns);
+		return false;
+	}
+	memcpy(block(ib), raw, (size_t)nw*maxPoints*sizeof(epicsInt32));
+	block_nw[ib] = nw;
+	block_mask[ib] = mask;
+	block_sample[ib] = sample;
+	block_ts[ib] = ts;
+	pool.post(ib);
+	epicsEventSignal(wake);
+	return true;
+}
+
+/** encode block ib into out. A codec that is not built in leaves out as it was */
+void Compressor::run(int ib)
+{
+	const int cc = epicsAtomicGetIntT(&codec);
+	const int cl = epicsAtomicGetIntT(&level);
+	const int nw = block_nw[ib];
+
+	if (!comp_have_codec(cc)){
+		return;
+	}
+	const epicsUInt64 t0 = epicsMonotonicGet();
+	epicsInt32* hdr = (epicsInt32 *)out;
+	hdr[0] = COMP_MAGIC;
+	hdr[1] = cc;
+	hdr[2] = cl;
+	hdr[3] = nw;
+	hdr[4] = maxPoints;
+	hdr[5] = block_mask[ib];
+	hdr[6] = (epicsInt32)(block_sample[ib] & 0xffffffff);
+	hdr[7] = (epicsInt32)(block_sample[ib] >> 32);
+
+	size_t pos = COMP_HEADER_WORDS*4;
+	for (int k = 0; k < nw; ++k){
+		unsigned char* p = (unsigned char *)out + pos;
+		long nbytes = comp_encode(p + 4, block(ib) + (size_t)k*maxPoints, maxPoints, cc, cl);
+		if (nbytes < 0){
+			return;
+		}
+		epicsInt32 n32 = nbytes;
+		memcpy(p, &n32, 4);
+		/* pad to a whole word, zeroed so the block compares equal run to run */
+		memset(p + 4 + nbytes, 0, ((nbytes + 3) & ~3) - nbytes);
+		pos += 4 + ((nbytes + 3) & ~3);
+	}
+	out_len = pos;
+	out_ib = ib;
+	ratio = (double)nw*maxPoints*sizeof(epicsInt32)/out_len;
+	encode_us = (epicsMonotonicGet() - t0)*1e-3;
+	onResult(pvt);
+}
+
+void Compressor::compressor()
+{
+	while(1){
+		epicsEventWaitWithTimeout(wake, 1.0);
+		int ib;
+		while ((ib = pool.take()) >= 0){
+			run(ib);
+			pool.release(ib);
+		}
+	}
+}
@@ -0,0 +1,109 @@
+/* ------------------------------------------------------------------------- */
+/* Compressor.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#ifndef COMPRESSOR_H_
+#define COMPRESSOR_H_
+
+#include <epicsTypes.h>
+#include <epicsTime.h>
+#include <epicsEvent.h>
+
+#include "BufferPool.h"
+#include "acq164Codec.h"
+
+#define COMP_NBUF		2	/* input blocks: encode, waiting */
+
+/** Compressed copy of each published raw block, off the publisher thread.
+ *  feed() copies the block, BufferPool style, to the compressor thread,
+ *  which encodes each channel with the codec and level from configure() into
+ *  one COMP_WAVEFORM block, layout in acq164Codec.h. onResult(pvt) is then
+ *  called from the compressor thread, and data() is valid until it returns.
+ *  If the compressor falls behind, blocks are dropped and counted: the
+ *  uncompressed outputs never wait for it.
+ */
+class Compressor {
+	const int nchan;
+	const int maxPoints;
+
+	/* input, publisher fills */
+	BufferPool pool;
+	epicsInt32* blocks;		/* [COMP_NBUF][nchan][maxPoints] */
+	int* block_nw;
+	int* block_mask;
+	long long* block_sample;
+	epicsTimeStamp* block_ts;
+
+	/* settings, any thread, applied at the next block */
+	int codec;
+	int level;
+
+	/* compressor thread */
+	epicsEventId wake;
+	epicsInt8* out;			/* COMP_HEADER_WORDS + nchan*(1 + comp_bound(maxPoints)/4) words */
+	size_t out_len;
+	int out_ib;
+	double ratio;
+	double encode_us;
+
+	void (*onResult)(void* pvt);
+	void* pvt;
+
+	epicsInt32* block(int ib) {
+		return blocks + (size_t)ib*nchan*maxPoints;
+	}
+	void run(int ib);
+
+public:
+	int overruns;
+
+	/** Thread is named name.comp */
+	Compressor(const char* name, int nchan, int maxPoints,
+			void (*onResult)(void* pvt), void* pvt);
+
+	/** publisher: nw channels of maxPoints raw codes, packed, identified by
+	 *  mask. returns false if dropped: the compressor is still busy */
+	bool feed(const epicsInt32* raw, int nw, int mask, long long sample, const epicsTimeStamp& ts);
+
+	/** any thread: COMP_CODEC and COMP_LEVEL. COMP_OFF: feed() does nothing */
+	void configure(int codec, int level);
+
+	/* results, valid in onResult() */
+	const epicsInt8* data() const {
+		return out;
+	}
+	size_t length() const {
+		return out_len;
+	}
+	/** raw bytes over compressed bytes, header included */
+	double getRatio() const {
+		return ratio;
+	}
+	double getEncodeUs() const {
+		return encode_us;
+	}
+	const epicsTimeStamp& timeStamp() const {
+		return block_ts[out_ib];
+	}
+
+	void compressor();
+};
+
+#endif /* COMPRESSOR_H_ */
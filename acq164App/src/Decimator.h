@@ -0,0 +1,217 @@
+/* ------------------------------------------------------------------------- */
+/* Decimator.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#ifndef DECIMATOR_H_
+#define DECIMATOR_H_
+
+#include <stdlib.h>
+
+#include "BufferPool.h"
+
+#define DEC_MODE_PICK	0	/* first sample of each group */
+#define DEC_MODE_MEAN	1	/* boxcar mean */
+#define DEC_MODE_MINMAX	2	/* min in lo(), max in hi() */
+
+/** Per channel decimation by factor, like Acc<T> but one output point per
+ *  factor input samples. Output goes to a pool of buffers, npoints per channel,
+ *  channel-major, posted to the consumer as each fills.
+ *  Filler usage, per block of n samples: decimate(ic, y, n) for every channel,
+ *  then commit(n, sample, tag) once. A block may complete at most one output
+ *  buffer. tag is kept with the buffer for the consumer, eg the channel mask,
+ *  and so is the input sample of its first point.
+ *  Buffers are allocated when decimation is first enabled.
+ */
+template <class T>
+class Decimator {
+	const int nchan;
+	const int npoints;
+	BufferPool pool;
+	T* lo_pool;
+	T* hi_pool;
+	int* pool_mode;
+	int* pool_tag;
+	long long* pool_first;
+	long long fill_first;	/* input sample of the fill buffer's first point, -1: not yet */
+	T* acc_lo;
+	T* acc_hi;
+	int phase;		/* input samples in the current group */
+	int cursor;		/* output points in the fill buffer */
+	int fill_ib;
+	int next_ib;		/* claimed ahead, so a buffer can wrap mid-block */
+	int factor;
+	int mode;
+
+	T* point(T* base, int ic, int k) {
+		if (k < npoints){
+			return base + ((size_t)fill_ib*nchan + ic)*npoints + k;
+		}else{
+			int ib = next_ib >= 0? next_ib: fill_ib;
+			return base + ((size_t)ib*nchan + ic)*npoints + k - npoints;
+		}
+	}
+public:
+	int overruns;
+
+	Decimator(int _nchan, int _npoints, int nbuf):
+		nchan(_nchan), npoints(_npoints), pool(nbuf),
+		lo_pool(0), hi_pool(0), pool_mode(0), pool_tag(0), pool_first(0), fill_first(-1),
+		acc_lo(0), acc_hi(0),
+		phase(0), cursor(0), fill_ib(-1), next_ib(-1),
+		factor(1), mode(DEC_MODE_PICK), overruns(0)
+	{}
+
+	bool enabled() const {
+		return factor > 1 && lo_pool != 0;
+	}
+	int getFactor() const {
+		return factor;
+	}
+	int getMode() const {
+		return mode;
+	}
+	/** filler: change settings, restarts the output buffer */
+	void configure(int _factor, int _mode) {
+		if (_factor > 1 && lo_pool == 0){
+			lo_pool = (T*)calloc((size_t)pool.size()*nchan*npoints, sizeof(T));
+			hi_pool = (T*)calloc((size_t)pool.size()*nchan*npoints, sizeof(T));
+			pool_mode = new int[pool.size()];
+			pool_tag = new int[pool.size()]();
+			pool_first = new long long[pool.size()]();
+			acc_lo = new T[nchan];
+			acc_hi = new T[nchan];
+			fill_ib = pool.acquire(-1);
+			next_ib = pool.acquire(fill_ib);
+		}
+		factor = _factor < 1? 1: _factor;
+		mode = _mode;
+		phase = 0;
+		cursor = 0;
+		fill_first = -1;
+	}
+	void decimate(int ic, const T* y, int n) {
+		int ph = phase;
+		int k = cursor;
+		T a = acc_lo[ic];
+		T b = acc_hi[ic];
+
+		switch(mode){
+		case DEC_MODE_MEAN:
+			for (int id = 0; id < n; ++id){
+				a = ph == 0? y[id]: a + y[id];
+				if (++ph == factor){
+					*point(lo_pool, ic, k++) = a/factor;
+					ph = 0;
+				}
+			}
+			break;
+		case DEC_MODE_MINMAX:
+			for (int id = 0; id < n; ++id){
+				T yy = y[id];
+				if (ph == 0){
+					a = b = yy;
+				}else{
+					if (yy < a) a = yy;
+					if (yy > b) b = yy;
+				}
+				if (++ph == factor){
+					*point(lo_pool, ic, k) = a;
+					*point(hi_pool, ic, k) = b;
+					++k;
+					ph = 0;
+				}
+			}
+			break;
+		default: {
+			/* a holds the first sample of a pending group */
+			int id = ph == 0? 0: factor - ph;
+			if (ph > 0 && id <= n){
+				*point(lo_pool, ic, k++) = a;
+			}
+			for (; id + factor <= n; id += factor){
+				*point(lo_pool, ic, k++) = y[id];
+			}
+			if (id < n){
+				a = y[id];
+			}
+		}
+		}
+		acc_lo[ic] = a;
+		acc_hi[ic] = b;
+	}
+	/** filler: all channels done for this block of n samples from sample.
+	 *  returns true if a buffer was posted */
+	bool commit(int n, long long sample, int tag = 0) {
+		if (fill_first < 0){
+			fill_first = sample - (long long)cursor*factor - phase;
+		}
+		int ph = phase + n;
+		cursor += ph/factor;
+		phase = ph%factor;
+
+		if (next_ib < 0){
+			next_ib = pool.acquire(fill_ib);
+		}
+		if (cursor < npoints){
+			return false;
+		}
+		cursor -= npoints;
+		const long long first = fill_first;
+		fill_first += (long long)npoints*factor;
+		if (next_ib < 0){
+			++overruns;		/* block dropped, refilled in place */
+			return false;
+		}
+		pool_mode[fill_ib] = mode;
+		pool_tag[fill_ib] = tag;
+		pool_first[fill_ib] = first;
+		pool.post(fill_ib);
+		fill_ib = next_ib;
+		next_ib = pool.acquire(fill_ib);
+		return true;
+	}
+
+	/* consumer interface */
+	int take() {
+		return pool.take();
+	}
+	void release(int ib) {
+		pool.release(ib);
+	}
+	T* lo(int ib, int ic) {
+		return lo_pool + ((size_t)ib*nchan + ic)*npoints;
+	}
+	/** max envelope, NULL unless the buffer was filled in DEC_MODE_MINMAX */
+	T* hi(int ib, int ic) {
+		return pool_mode[ib] == DEC_MODE_MINMAX? hi_pool + ((size_t)ib*nchan + ic)*npoints: 0;
+	}
+	int tag(int ib) const {
+		return pool_tag[ib];
+	}
+	/** input sample of the first point */
+	long long first(int ib) const {
+		return pool_first[ib];
+	}
+	int size() const {
+		return npoints;
+	}
+};
+
+#endif /* DECIMATOR_H_ */
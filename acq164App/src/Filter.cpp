@@ -0,0 +1,213 @@
+/* ------------------------------------------------------------------------- */
+/* Filter.cpp
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <epicsAtomic.h>
+
+#include "acq164Kernels.h"
+#include "Filter.h"
+
+Filter::Filter(int _nchan):
+	nchan(_nchan), new_type(FILTER_OFF), new_ncoef(0), pending(0),
+	type(FILTER_OFF), nsect(0), ntaps(0), lanes(0), lane_mask(0)
+{
+	mutex = epicsMutexMustCreate();
+	z = new double[FILTER_MAX_SECTIONS*2*nchan]();
+	x = new double[(FILTER_MAX_TAPS-1 + FILTER_BLOCK)*nchan]();
+	y = new double[FILTER_BLOCK*nchan]();
+}
+
+static bool valid(int type, const double* c, int n)
+{
+	switch(type){
+	case FILTER_OFF:
+		return true;
+	case FILTER_BIQUAD:
+		if (n < 6 || n%6 != 0 || n/6 > FILTER_MAX_SECTIONS){
+			return false;
+		}
+		for (int is = 0; is < n/6; ++is){
+			if (c[is*6+3] == 0){
+				return false;
+			}
+		}
+		return true;
+	case FILTER_FIR:
+		return n >= 1 && n <= FILTER_MAX_TAPS;
+	default:
+		return false;
+	}
+}
+
+int Filter::set(int _type, const double* c, int n)
+{
+	int rc = 0;
+
+	epicsMutexMustLock(mutex);
+	if (c == 0){
+		c = new_coef;
+		n = new_ncoef;
+	}
+	if (n > FILTER_MAX_TAPS || !valid(_type, c, n)){
+		fprintf(stderr, "ERROR: Filter: invalid type %d with %d coefficients\n", _type, n);
+		rc = -1;
+	}else{
+		if (c != new_coef){
+			memcpy(new_coef, c, n*sizeof(double));
+			new_ncoef = n;
+		}
+		new_type = _type;
+		epicsAtomicSetIntT(&pending, 1);
+	}
+	epicsMutexUnlock(mutex);
+	return rc;
+}
+
+int Filter::load(const char* fname)
+{
+	FILE* fp = fopen(fname, "r");
+	if (fp == 0){
+		fprintf(stderr, "ERROR: Filter: failed to open \"%s\"\n", fname);
+		return -1;
+	}
+	double* c = new double[FILTER_MAX_TAPS+1];
+	int _type = -1;
+	int n = 0;
+	char line[256];
+
+	while (fgets(line, sizeof(line), fp)){
+		char* save;
+		char* hash = strchr(line, '#');
+		if (hash){
+			*hash = '\0';
+		}
+		for (char* tok = strtok_r(line, " \t,\r\n", &save); tok; tok = strtok_r(0, " \t,\r\n", &save)){
+			if (_type < 0){
+				_type = strcmp(tok, "biquad") == 0? FILTER_BIQUAD:
+					strcmp(tok, "fir") == 0? FILTER_FIR: -1;
+				if (_type < 0){
+					fprintf(stderr, "ERROR: Filter: \"%s\" must start biquad or fir\n", fname);
+					n = -1;
+					break;
+				}
+			}else if (n < FILTER_MAX_TAPS+1){
+				c[n++] = strtod(tok, 0);
+			}
+		}
+		if (n < 0){
+			break;
+		}
+	}
+	fclose(fp);
+
+	int rc = n > 0 && set(_type, c, n) == 0? _type: -1;
+	delete [] c;
+	return rc;
+}
+
+int Filter::getType()
+{
+	epicsMutexMustLock(mutex);
+	int t = new_type;
+	epicsMutexUnlock(mutex);
+	return t;
+}
+
+int Filter::getNcoef()
+{
+	epicsMutexMustLock(mutex);
+	int n = new_ncoef;
+	epicsMutexUnlock(mutex);
+	return n;
+}
+
+/** streaming thread: take the new setting */
+void Filter::update()
+{
+	epicsMutexMustLock(mutex);
+	type = new_type;
+	nsect = 0;
+	ntaps = 0;
+	if (type == FILTER_BIQUAD){
+		nsect = new_ncoef/6;
+		for (int is = 0; is < nsect; ++is){
+			const double* c = new_coef + is*6;
+			const double a0 = c[3];
+			sos[is][0] = c[0]/a0;
+			sos[is][1] = c[1]/a0;
+			sos[is][2] = c[2]/a0;
+			sos[is][3] = c[4]/a0;
+			sos[is][4] = c[5]/a0;
+		}
+	}else if (type == FILTER_FIR){
+		ntaps = new_ncoef;
+		memcpy(taps, new_coef, ntaps*sizeof(double));
+	}
+	epicsAtomicSetIntT(&pending, 0);
+	epicsMutexUnlock(mutex);
+	reset(lanes, lane_mask);
+}
+
+void Filter::reset(int nl, int mask)
+{
+	lanes = nl;
+	lane_mask = mask;
+	memset(z, 0, FILTER_MAX_SECTIONS*2*nchan*sizeof(double));
+	memset(x, 0, (FILTER_MAX_TAPS-1)*nchan*sizeof(double));
+}
+
+void Filter::process(double* out, const double* in, int stride, int nsam, int nl, int mask)
+{
+	if (epicsAtomicGetIntT(&pending)){
+		update();
+	}
+	/* lane k is another channel when the mask changes, even at the same count */
+	if (nl != lanes || mask != lane_mask){
+		reset(nl, mask);
+	}
+	if (type == FILTER_OFF){
+		for (int k = 0; k < nl; ++k){
+			memcpy(out + (size_t)k*stride, in + (size_t)k*stride, nsam*sizeof(double));
+		}
+		return;
+	}
+
+	for (int id0 = 0; id0 < nsam; id0 += FILTER_BLOCK){
+		const int m = nsam - id0 < FILTER_BLOCK? nsam - id0: FILTER_BLOCK;
+
+		if (type == FILTER_BIQUAD){
+			to_lanes(y, in + id0, stride, m, nl);
+			for (int is = 0; is < nsect; ++is){
+				biquad_lanes(y, m, nl, sos[is], z + (2*is)*nchan, z + (2*is+1)*nchan);
+			}
+		}else{
+			const int nh = ntaps-1;
+			to_lanes(x + nh*nl, in + id0, stride, m, nl);
+			fir_lanes(y, x, m, nl, taps, ntaps);
+			memmove(x, x + m*nl, (size_t)nh*nl*sizeof(double));
+		}
+		from_lanes(out + id0, stride, y, m, nl);
+	}
+}
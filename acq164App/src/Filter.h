@@ -0,0 +1,86 @@
+/* ------------------------------------------------------------------------- */
+/* Filter.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <epicsMutex.h>
+
+/* FILTER_TYPE */
+#define FILTER_OFF		0	/* filtered output is a copy of volts */
+#define FILTER_BIQUAD		1	/* IIR cascade, 6 coefficients per section: b0 b1 b2 a0 a1 a2 (scipy sos) */
+#define FILTER_FIR		2	/* FIR, one coefficient per tap */
+
+#define FILTER_MAX_SECTIONS	16
+#define FILTER_MAX_TAPS		256
+#define FILTER_BLOCK		256	/* samples per pass through the lanes */
+
+/** Per channel filter between calibration and publishing, the same
+ *  coefficients for every channel. Each block is transposed to sample-major
+ *  lanes, one per channel, so the filter runs across channels in SIMD.
+ *  Filter state is kept from block to block, and is reset when the
+ *  coefficients or the channel mask change.
+ *  set() and load() may be called from any thread, the new filter is
+ *  picked up by the streaming thread at the next process().
+ */
+class Filter {
+	const int nchan;
+
+	/* last setting, guarded by mutex */
+	epicsMutexId mutex;
+	int new_type;
+	int new_ncoef;
+	double new_coef[FILTER_MAX_TAPS];
+	int pending;
+
+	/* streaming thread */
+	int type;
+	int nsect;
+	double sos[FILTER_MAX_SECTIONS][5];	/* normalised: b0 b1 b2 a1 a2 */
+	int ntaps;
+	double taps[FILTER_MAX_TAPS];
+	int lanes;		/* lanes the state is for */
+	int lane_mask;		/* channel mask the lanes are for */
+	double* z;		/* biquad [nsect][2][nchan] */
+	double* x;		/* FIR: ntaps-1 rows of history + FILTER_BLOCK rows */
+	double* y;		/* FILTER_BLOCK rows */
+
+	void update();
+	void reset(int nl, int mask);
+public:
+	Filter(int nchan);
+
+	/** type FILTER_OFF, BIQUAD or FIR with n coefficients. c NULL: keep the
+	 *  current coefficients, change the type. returns 0, or -1 if invalid */
+	int set(int type, const double* c, int n);
+	/** text file: "biquad" or "fir", then the coefficients; # comments.
+	 *  returns the type, or -1 on error */
+	int load(const char* fname);
+	int getType();
+	int getNcoef();
+
+	/** streaming thread: nsam samples of nl channels, channel k at in + k*stride,
+	 *  the channels in mask. out has the same layout, and must not overlap in */
+	void process(double* out, const double* in, int stride, int nsam, int nl, int mask);
+};
+
+#endif /* FILTER_H_ */
@@ -0,0 +1,236 @@
+/* ------------------------------------------------------------------------- */
+/* Instrument.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#ifndef INSTRUMENT_H_
+#define INSTRUMENT_H_
+
+#include <string.h>
+
+#include <epicsTypes.h>
+#include <epicsTime.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "BufferPool.h"
+
+/* onFrame() phases, timed separately */
+enum { INST_CONV, INST_ACC, INST_CB, INST_INTEG, INST_TRIG, INST_TAPS, INST_PHASES };
+
+#define INST_HIST_BINS	24	/* time between frames, bin k: [2^k, 2^(k+1)) us, first and last open ended */
+
+/** cheap timestamp: TSC where there is one, else monotonic ns */
+static inline unsigned long long inst_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return epicsMonotonicGet();
+#endif
+}
+
+/** one interval of results */
+struct InstResult {
+	double frame_rate;		/* frames/s */
+	double sample_rate;		/* samples/s per channel */
+	double phase_us[INST_PHASES];	/* mean per frame */
+	double frame_us;		/* mean onFrame() per frame */
+	double frame_max_us;
+	double gap_max_us;
+	double fast_us;			/* mean frame start to fast path callbacks done, 0: none */
+	double fast_max_us;
+	epicsInt32 gap_hist[INST_HIST_BINS];
+	int missed;			/* samples skipped, since start */
+	int duplicated;			/* frames repeated or going back, since start */
+	long long sample;		/* start sample of the last frame */
+};
+
+/** Per frame timing in the streaming thread, aggregated over an interval and
+ *  handed to the publisher as an InstResult through a BufferPool.
+ *  Costs one monotonic clock read plus a few TSC reads per frame, cheap enough
+ *  to leave on. TSC ticks are scaled by the monotonic clock over the same
+ *  interval, so there is no calibration and no constant-rate assumption.
+ *  Filler usage, per frame: t = frameStart(); t = add(phase, t) after each
+ *  phase; frameEnd().
+ */
+class Instrument {
+	BufferPool pool;
+	InstResult* results;
+	int fill_ib;
+
+	/* current interval */
+	epicsUInt64 ns0;		/* monotonic at interval start, 0: not started */
+	unsigned long long tick0;
+	epicsUInt64 ns_last;		/* monotonic at start of the current frame */
+	unsigned long long frame_t0;
+	int frames;
+	long long samples;
+	unsigned long long phase[INST_PHASES];
+	unsigned long long total;
+	unsigned long long total_max;
+	epicsUInt64 gap_max;
+	epicsInt32 hist[INST_HIST_BINS];
+	unsigned long long fast;
+	unsigned long long fast_max;
+	int fast_frames;
+
+	/* whole run */
+	long long next_sample;		/* -1: no frame yet */
+	long long last_sample;
+	int missed;
+	int duplicated;
+
+	void clear() {
+		frames = 0;
+		samples = 0;
+		memset(phase, 0, sizeof(phase));
+		total = 0;
+		total_max = 0;
+		gap_max = 0;
+		memset(hist, 0, sizeof(hist));
+		fast = 0;
+		fast_max = 0;
+		fast_frames = 0;
+	}
+	static int bin(epicsUInt64 us) {
+		int k = 0;
+		for (; us > 1 && k < INST_HIST_BINS-1; us >>= 1){
+			++k;
+		}
+		return k;
+	}
+	bool complete() {
+		InstResult& r = results[fill_ib];
+		const double span = (ns_last - ns0)*1e-9;
+		const double us_per_tick = frame_t0 > tick0? span*1e6/(frame_t0 - tick0): 0;
+
+		r.frame_rate = frames/span;
+		r.sample_rate = samples/span;
+		for (int ph = 0; ph < INST_PHASES; ++ph){
+			r.phase_us[ph] = phase[ph]*us_per_tick/frames;
+		}
+		r.frame_us = total*us_per_tick/frames;
+		r.frame_max_us = total_max*us_per_tick;
+		r.gap_max_us = gap_max*1e-3;
+		r.fast_us = fast_frames? fast*us_per_tick/fast_frames: 0;
+		r.fast_max_us = fast_max*us_per_tick;
+		memcpy(r.gap_hist, hist, sizeof(hist));
+		r.missed = missed;
+		r.duplicated = duplicated;
+		r.sample = last_sample;
+
+		ns0 = ns_last;
+		tick0 = frame_t0;
+		clear();
+
+		int next = pool.acquire(fill_ib);
+		if (next < 0){
+			++overruns;
+			return false;
+		}
+		pool.post(fill_ib);
+		fill_ib = next;
+		return true;
+	}
+public:
+	int overruns;
+
+	Instrument(int nbuf):
+		pool(nbuf), ns0(0), tick0(0), ns_last(0), frame_t0(0),
+		next_sample(-1), last_sample(0), missed(0), duplicated(0), overruns(0)
+	{
+		results = new InstResult[pool.size()]();
+		fill_ib = pool.acquire(-1);
+		clear();
+	}
+
+	/** filler: start of a frame of nsam samples. returns ticks for add() */
+	unsigned long long frameStart(long long sample, int nsam) {
+		epicsUInt64 ns = epicsMonotonicGet();
+		if (ns0 == 0){
+			ns0 = ns;
+			tick0 = inst_ticks();
+		}else{
+			epicsUInt64 gap = ns - ns_last;
+			++hist[bin(gap/1000)];
+			if (gap > gap_max){
+				gap_max = gap;
+			}
+		}
+		ns_last = ns;
+
+		if (next_sample >= 0){
+			if (sample > next_sample){
+				missed += sample - next_sample;
+			}else if (sample < next_sample){
+				++duplicated;
+			}
+		}
+		if (sample + nsam > next_sample){
+			next_sample = sample + nsam;
+		}
+		last_sample = sample;
+		++frames;
+		samples += nsam;
+		return frame_t0 = inst_ticks();
+	}
+	/** filler: charge ticks since t0 to phase ph. returns now, for the next phase */
+	unsigned long long add(int ph, unsigned long long t0) {
+		unsigned long long t1 = inst_ticks();
+		phase[ph] += t1 - t0;
+		return t1;
+	}
+	/** filler: the fast path has made its callbacks, latency from frameStart() */
+	void fastDone() {
+		unsigned long long dt = inst_ticks() - frame_t0;
+		fast += dt;
+		if (dt > fast_max){
+			fast_max = dt;
+		}
+		++fast_frames;
+	}
+	/** filler: end of frame. returns true if an interval of at least seconds was posted */
+	bool frameEnd(double seconds) {
+		unsigned long long dt = inst_ticks() - frame_t0;
+		total += dt;
+		if (dt > total_max){
+			total_max = dt;
+		}
+		if (ns_last - ns0 < seconds*1e9 || ns_last == ns0){
+			return false;
+		}
+		return complete();
+	}
+
+	/* consumer interface */
+	int take() {
+		return pool.take();
+	}
+	void release(int ib) {
+		pool.release(ib);
+	}
+	const InstResult& result(int ib) const {
+		return results[ib];
+	}
+};
+
+#endif /* INSTRUMENT_H_ */
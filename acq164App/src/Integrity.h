@@ -0,0 +1,141 @@
+/* ------------------------------------------------------------------------- */
+/* Integrity.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+
+#ifndef INTEGRITY_H_
+#define INTEGRITY_H_
+
+#include <epicsAtomic.h>
+
+#include "RawFrame.h"
+#include "acq164Kernels.h"
+
+/* INTEG_ALARM, INTEG_CHAN bits */
+#define INTEG_ZERO		0x1	/* a run of more than INTEG_ZERO_RUN zeros */
+#define INTEG_SAT		0x2	/* codes at full scale */
+#define INTEG_GAP		0x4	/* samples missing or repeated */
+
+#define ACQ164_CODE_MIN		(-(1<<23))
+#define ACQ164_CODE_MAX		((1<<23)-1)
+
+/** Data integrity checks on the streaming thread, in place of exit(1).
+ *  Sample numbers are checked every frame. Sample data every every'th frame,
+ *  active channels only: the zero run test is strided, the full scale count
+ *  is branch free. Alarm bits collect over a window of frames, about a
+ *  second, then are handed over as alarm, chan_alarm[] for the publisher.
+ *  Counters run from the start. check() asks for a restart after
+ *  restart_frames checked frames in a row with a zero run, 0: never.
+ */
+class Integrity {
+	const int nchan;
+	int* chan_acc;			/* [nchan] bits, this window */
+	int acc;
+	int frames;			/* into this window */
+	int countdown;			/* frames to the next data check */
+	int zero_run;			/* consecutive checked frames with a zero run */
+	long long next_sample;		/* -1: no frame yet */
+public:
+	/* settings, streaming thread */
+	int every;
+	int zero_limit;
+	int restart_frames;
+	int window;
+
+	/* results, read by the publisher */
+	int alarm;			/* bits, last window */
+	int* chan_alarm;		/* [nchan] */
+	int zero_frames;
+	int sat_frames;
+	int gaps;
+	int gap_samples;
+
+	Integrity(int _nchan):
+		nchan(_nchan), acc(0), frames(0), countdown(0), zero_run(0), next_sample(-1),
+		every(1), zero_limit(60), restart_frames(0), window(20),
+		alarm(0), zero_frames(0), sat_frames(0), gaps(0), gap_samples(0)
+	{
+		chan_acc = new int[nchan]();
+		chan_alarm = new int[nchan]();
+	}
+
+	/** new stream, sample numbers start again */
+	void reset() {
+		next_sample = -1;
+		zero_run = 0;
+	}
+
+	/** streaming thread, every frame. returns true if the stream should restart */
+	bool check(const RawFrame *cf, long long sample, const int* active, int nactive) {
+		bool restart = false;
+
+		if (next_sample >= 0 && sample != next_sample){
+			acc |= INTEG_GAP;
+			epicsAtomicIncrIntT(&gaps);
+			if (sample > next_sample){
+				epicsAtomicAddIntT(&gap_samples, (int)(sample - next_sample));
+			}
+		}
+		next_sample = sample + FRAME_SAMPLES;
+
+		if (--countdown <= 0){
+			int bits = 0;
+			countdown = every;
+			for (int k = 0; k < nactive; ++k){
+				const int* raw = cf->getChannel(active[k]+1);
+				int cbits = 0;
+				if (zero_run_exceeds(raw, FRAME_SAMPLES, zero_limit)){
+					cbits |= INTEG_ZERO;
+				}
+				if (full_scale_count(raw, FRAME_SAMPLES, ACQ164_CODE_MIN, ACQ164_CODE_MAX)){
+					cbits |= INTEG_SAT;
+				}
+				chan_acc[active[k]] |= cbits;
+				bits |= cbits;
+			}
+			if (bits&INTEG_ZERO){
+				epicsAtomicIncrIntT(&zero_frames);
+				restart = restart_frames > 0 && ++zero_run >= restart_frames;
+			}else{
+				zero_run = 0;
+			}
+			if (bits&INTEG_SAT){
+				epicsAtomicIncrIntT(&sat_frames);
+			}
+			acc |= bits;
+		}
+
+		if (++frames >= window){
+			for (int ic = 0; ic < nchan; ++ic){
+				epicsAtomicSetIntT(&chan_alarm[ic], chan_acc[ic]);
+				chan_acc[ic] = 0;
+			}
+			epicsAtomicSetIntT(&alarm, acc);
+			acc = 0;
+			frames = 0;
+		}
+		if (restart){
+			zero_run = 0;
+		}
+		return restart;
+	}
+};
+
+#endif /* INTEGRITY_H_ */
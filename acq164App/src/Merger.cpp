@@ -0,0 +1,345 @@
+/* ------------------------------------------------------------------------- */
+/* Merger.cpp
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <epicsTypes.h>
+#include <epicsThread.h>
+#include <epicsString.h>
+#include <epicsAtomic.h>
+#include <epicsMath.h>
+#include <iocsh.h>
+
+#include "acq164AsynPortDriver.h"
+#include "acq164Kernels.h"
+#include "Merger.h"
+#include <epicsExport.h>
+
+static const char *driverName="acq164MergeDriver";
+
+static void merger_runner(void *drvPvt)
+{
+	((acq164MergeDriver *)drvPvt)->merger();
+}
+
+MergeTap::MergeTap(int _nchan, int depth, epicsEventId _wake):
+	nchan(_nchan), pool(depth), wake(_wake), dropped(0)
+{
+	frames = new int[(size_t)pool.size()*nchan*FRAME_SAMPLES];
+	frame_sample = new long long[pool.size()]();
+}
+
+/** card streaming thread: queue a copy of the frame for the merger */
+void MergeTap::onFrame(const RawFrame& frame)
+{
+	int ib = pool.acquire(-1);
+	if (ib < 0){
+		epicsAtomicIncrIntT(&dropped);
+		return;
+	}
+	for (int ic = 0; ic < nchan; ++ic){
+		memcpy(frames + ((size_t)ib*nchan + ic)*FRAME_SAMPLES, frame.getChannel(ic+1), FRAME_SAMPLES*sizeof(int));
+	}
+	frame_sample[ib] = frame.getStartSampleNumber();
+	pool.post(ib);
+	epicsEventSignal(wake);
+}
+
+/** \param[in] portName merge port, addr card*nchan+ic
+  * \param[in] _cards ports to merge, all with nchan channels
+  * \param[in] _maxPoints samples per published block
+  * \param[in] _skew frames a card may lag before it is marked late */
+acq164MergeDriver::acq164MergeDriver(const char* portName, int _ncards, acq164AsynPortDriver** _cards,
+		int _nchan, int _maxPoints, int _skew)
+   : asynPortDriver(portName,
+                    _ncards*_nchan, /* maxAddr */
+                    asynInt32Mask | asynFloat64Mask | asynFloat64ArrayMask | asynDrvUserMask, /* Interface mask */
+                    asynInt32Mask | asynFloat64Mask | asynFloat64ArrayMask,  /* Interrupt mask */
+                    0, /* asynFlags */
+                    1, /* Autoconnect */
+                    0, /* Default priority */
+                    0) /* Default stack size*/,
+	ncards(_ncards), nchan(_nchan), maxPoints(_maxPoints), skew(_skew),
+	cursor(0), block_sample(0), next_sample(-1), block_late(0), blocks(0)
+{
+	createParam(PS_MERGE_WAVEFORM,          asynParamFloat64Array,  &P_Waveform);
+	createParam(PS_MERGE_SAMPLE,            asynParamFloat64,       &P_Sample);
+	createParam(PS_MERGE_LATE,              asynParamInt32,         &P_Late);
+	createParam(PS_MERGE_LATE_FRAMES,       asynParamInt32,         &P_LateFrames);
+	createParam(PS_MERGE_DROPPED,           asynParamInt32,         &P_Dropped);
+	createParam(PS_MERGE_REALIGNS,          asynParamInt32,         &P_Realigns);
+	createParam(PS_MERGE_SKEW,              asynParamInt32,         &P_Skew);
+	createParam(PS_MERGE_BLOCKS,            asynParamInt32,         &P_Blocks);
+
+	setDoubleParam (P_Sample,            0.0);
+	setIntegerParam(P_Late,              0);
+	setIntegerParam(P_Skew,              skew);
+	setIntegerParam(P_Blocks,            0);
+
+	const size_t nwave = (size_t)ncards*nchan;
+	block = (epicsFloat64 *)calloc(nwave*maxPoints, sizeof(epicsFloat64));
+	eslo = new double[nwave]();
+	eoff = new double[nwave]();
+	wake = epicsEventMustCreate(epicsEventEmpty);
+
+	for (int c = 0; c < ncards; ++c){
+		setIntegerParam(c, P_LateFrames, 0);
+		setIntegerParam(c, P_Dropped,    0);
+		setIntegerParam(c, P_Realigns,   0);
+		late_frames[c] = 0;
+		offset[c] = 0;
+		realigns[c] = 0;
+		head[c] = -1;
+		cards[c] = _cards[c];
+		/* room for the head, skew frames behind it and one being filled */
+		taps[c] = new MergeTap(nchan, skew+2, wake);
+	}
+	for (int c = 0; c < ncards; ++c){
+		cards[c]->addFrameTap(taps[c]);
+	}
+
+	char tname[32];
+	epicsSnprintf(tname, sizeof(tname), "%s.merge", portName);
+	if (epicsThreadCreate(tname,
+			epicsThreadPriorityMedium,
+			epicsThreadGetStackSize(epicsThreadStackMedium),
+			(EPICSTHREADFUNC)::merger_runner, this) == NULL){
+		printf("%s:%s: epicsThreadCreate failure\n", driverName, __FUNCTION__);
+	}
+}
+
+/** each card publishes its calibration as CAL_ESLO, CAL_EOFF per channel */
+void acq164MergeDriver::getCalibration()
+{
+	for (int c = 0; c < ncards; ++c){
+		int p_eslo, p_eoff;
+		cards[c]->lock();
+		if (cards[c]->findParam(PS_CAL_ESLO, &p_eslo) == asynSuccess &&
+		    cards[c]->findParam(PS_CAL_EOFF, &p_eoff) == asynSuccess){
+			for (int ic = 0; ic < nchan; ++ic){
+				cards[c]->getDoubleParam(ic, p_eslo, &eslo[c*nchan+ic]);
+				cards[c]->getDoubleParam(ic, p_eoff, &eoff[c*nchan+ic]);
+			}
+		}
+		cards[c]->unlock();
+	}
+}
+
+void acq164MergeDriver::publish()
+{
+	/* the cards share sample numbers: any card's clock will do */
+	epicsTimeStamp ts;
+	cards[0]->timeOfSample(block_sample - offset[0], &ts);
+
+	lock();
+	setTimeStamp(&ts);
+	setDoubleParam(P_Sample, block_sample);
+	setIntegerParam(P_Late, block_late);
+	setIntegerParam(P_Blocks, ++blocks);
+	for (int c = ncards-1; c >= 0; --c){
+		setIntegerParam(c, P_LateFrames, late_frames[c]);
+		setIntegerParam(c, P_Dropped, epicsAtomicGetIntT(&taps[c]->dropped));
+		setIntegerParam(c, P_Realigns, realigns[c]);
+		callParamCallbacks(c);
+	}
+	for (int iw = 0; iw < ncards*nchan; ++iw){
+		doCallbacksFloat64Array(block + (size_t)iw*maxPoints, maxPoints, P_Waveform, iw);
+	}
+	unlock();
+}
+
+/** merge the oldest frame on offer. returns false if it must wait for a card */
+bool acq164MergeDriver::step()
+{
+	/* further back than a queue can hold: the card started again */
+	const long long restart_span = (long long)(skew+2)*FRAME_SAMPLES;
+	long long S = 0;
+	bool any = false;
+	bool waiting = false;
+	bool give_up = false;
+
+	for (int c = 0; c < ncards; ++c){
+		if (head[c] < 0){
+			head[c] = taps[c]->take();
+		}
+		while (head[c] >= 0 && next_sample >= 0){
+			const long long s = taps[c]->sample(head[c]) + offset[c];
+			if (s < next_sample - restart_span){
+				offset[c] = next_sample - taps[c]->sample(head[c]);
+				++realigns[c];
+				printf("%s card %d restarted at %lld, re-aligned to %lld\n",
+						driverName, c, taps[c]->sample(head[c]), next_sample);
+			}else if (s < next_sample){
+				/* a late frame for a block already published goes */
+				taps[c]->release(head[c]);
+				epicsAtomicIncrIntT(&taps[c]->dropped);
+				head[c] = taps[c]->take();
+			}else{
+				break;
+			}
+		}
+		if (head[c] < 0){
+			waiting = true;
+			continue;
+		}
+		long long s = taps[c]->sample(head[c]) + offset[c];
+		if (!any || s < S){
+			S = s;
+		}
+		any = true;
+		if (taps[c]->queued() > skew){
+			give_up = true;
+		}
+	}
+	if (!any || (waiting && !give_up)){
+		return false;
+	}
+
+	bool present[MAX_MERGE_CARDS];
+	for (int c = 0; c < ncards; ++c){
+		present[c] = head[c] >= 0 && taps[c]->sample(head[c]) + offset[c] == S;
+		/* a card ahead of S skipped it: missing, but not late */
+		if (head[c] < 0){
+			++late_frames[c];
+		}
+	}
+
+	for (int r0 = 0; r0 < FRAME_SAMPLES; ){
+		int n = FRAME_SAMPLES - r0;
+		if (n > maxPoints - cursor){
+			n = maxPoints - cursor;
+		}
+		if (cursor == 0){
+			getCalibration();
+			block_sample = S + r0;
+			block_late = 0;
+		}
+		for (int c = 0; c < ncards; ++c){
+			if (!present[c]){
+				block_late |= 1 << c;
+			}
+			for (int ic = 0; ic < nchan; ++ic){
+				const int iw = c*nchan + ic;
+				epicsFloat64* dst = block + (size_t)iw*maxPoints + cursor;
+				if (present[c]){
+					calibrate_channel(dst, taps[c]->frame(head[c], ic) + r0, n, eslo[iw], eoff[iw]);
+				}else{
+					for (int id = 0; id < n; ++id){
+						dst[id] = epicsNAN;
+					}
+				}
+			}
+		}
+		cursor += n;
+		r0 += n;
+		if (cursor >= maxPoints){
+			publish();
+			cursor = 0;
+		}
+	}
+
+	for (int c = 0; c < ncards; ++c){
+		if (present[c]){
+			taps[c]->release(head[c]);
+			head[c] = -1;
+		}
+	}
+	next_sample = S + FRAME_SAMPLES;
+	return true;
+}
+
+void acq164MergeDriver::merger()
+{
+	while(1){
+		epicsEventWaitWithTimeout(wake, 1.0);
+		while (step()){
+			;
+		}
+	}
+}
+
+/* Configuration routine.  Called directly, or from the iocsh function below */
+
+extern "C" {
+
+/** EPICS iocsh callable function to merge several card ports into one.
+  * \param[in] portName merge port to create
+  * \param[in] cardPorts card ports, space or comma separated, all with the same nchan
+  * \param[in] maxPoints samples per merged block, default FRAME_SAMPLES
+  * \param[in] skew frames a card may lag before it is marked late, default 4 */
+int acq164MergeConfigure(const char *portName, const char *cardPorts, int maxPoints, int skew)
+{
+	acq164AsynPortDriver* cards[MAX_MERGE_CARDS];
+	int ncards = 0;
+	char* list = epicsStrDup(cardPorts? cardPorts: "");
+	char* save;
+
+	for (char* name = strtok_r(list, " ,", &save); name; name = strtok_r(0, " ,", &save)){
+		acq164AsynPortDriver *drv = dynamic_cast<acq164AsynPortDriver *>(
+				(asynPortDriver *)findAsynPortDriver(name));
+		if (drv == 0){
+			fprintf(stderr, "ERROR: %s: port %s not found\n", __FUNCTION__, name);
+			free(list);
+			return asynError;
+		}
+		if (ncards == MAX_MERGE_CARDS){
+			fprintf(stderr, "ERROR: %s: more than %d cards\n", __FUNCTION__, MAX_MERGE_CARDS);
+			free(list);
+			return asynError;
+		}
+		if (ncards && drv->getNchan() != cards[0]->getNchan()){
+			fprintf(stderr, "ERROR: %s: port %s nchan differs\n", __FUNCTION__, name);
+			free(list);
+			return asynError;
+		}
+		cards[ncards++] = drv;
+	}
+	free(list);
+	if (ncards == 0){
+		fprintf(stderr, "ERROR: %s: no cards\n", __FUNCTION__);
+		return asynError;
+	}
+	new acq164MergeDriver(portName, ncards, cards, cards[0]->getNchan(),
+			maxPoints > 0? maxPoints: FRAME_SAMPLES, skew > 0? skew: 4);
+	return asynSuccess;
+}
+
+static const iocshArg mergeArg0 = { "portName",iocshArgString};
+static const iocshArg mergeArg1 = { "card ports",iocshArgString};
+static const iocshArg mergeArg2 = { "max points",iocshArgInt};
+static const iocshArg mergeArg3 = { "skew frames",iocshArgInt};
+static const iocshArg * const mergeArgs[] = {&mergeArg0, &mergeArg1, &mergeArg2, &mergeArg3};
+static const iocshFuncDef mergeFuncDef = {"acq164MergeConfigure",4,mergeArgs};
+static void mergeCallFunc(const iocshArgBuf *args)
+{
+	acq164MergeConfigure(args[0].sval, args[1].sval, args[2].ival, args[3].ival);
+}
+
+void acq164MergeRegister(void)
+{
+    iocshRegister(&mergeFuncDef,mergeCallFunc);
+}
+
+epicsExportRegistrar(acq164MergeRegister);
+
+}
@@ -0,0 +1,131 @@
+/* ------------------------------------------------------------------------- */
+/* Merger.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#ifndef MERGER_H_
+#define MERGER_H_
+
+#include <epicsEvent.h>
+
+#include "asynPortDriver.h"
+#include "RawFrame.h"
+#include "BufferPool.h"
+
+class acq164AsynPortDriver;
+
+#define MAX_MERGE_CARDS		8
+
+/* drvInfo strings for the merge port */
+#define PS_MERGE_WAVEFORM          "SCOPE_WAVEFORM"             /* asynFloat64Array,  r/o addr card*nchan+ic, NaN for a late card */
+#define PS_MERGE_SAMPLE            "MERGE_SAMPLE"               /* asynFloat64,  r/o start sample of the published block */
+#define PS_MERGE_LATE              "MERGE_LATE"                 /* asynInt32,  r/o bit per card missing from the last block */
+#define PS_MERGE_LATE_FRAMES       "MERGE_LATE_FRAMES"          /* asynInt32,  r/o addr card: frames the card missed the window */
+#define PS_MERGE_DROPPED           "MERGE_DROPPED"              /* asynInt32,  r/o addr card: frames dropped, queue full */
+#define PS_MERGE_REALIGNS          "MERGE_REALIGNS"             /* asynInt32,  r/o addr card: restarts the card was re-aligned after */
+#define PS_MERGE_SKEW              "MERGE_SKEW"                 /* asynInt32,  r/o skew window, frames */
+#define PS_MERGE_BLOCKS            "MERGE_BLOCKS"               /* asynInt32,  r/o blocks published */
+
+/** One card's contribution: a FrameTap on the card's tap list that
+ *  copies raw frames into a bounded queue, BufferPool style, for the merger.
+ *  A full queue drops the new frame and counts it.
+ */
+class MergeTap: public FrameTap {
+	const int nchan;
+	BufferPool pool;
+	int* frames;
+	long long* frame_sample;
+	epicsEventId wake;
+public:
+	int dropped;
+
+	MergeTap(int nchan, int depth, epicsEventId wake);
+	virtual void onFrame(const RawFrame& frame);
+
+	/* consumer interface */
+	int take() {
+		return pool.take();
+	}
+	void release(int ib) {
+		pool.release(ib);
+	}
+	int queued() const {
+		return pool.inUse();
+	}
+	const int* frame(int ib, int ic) const {
+		return frames + ((size_t)ib*nchan + ic)*FRAME_SAMPLES;
+	}
+	long long sample(int ib) const {
+		return frame_sample[ib];
+	}
+};
+
+/** Joins frames from several card ports by sample number into one block of
+ *  ncards*nchan channels, published on its own asyn port.
+ *  A block is published when every card has contributed, or, for a card that
+ *  is behind, when another card has queued skew frames beyond it: the late
+ *  card's channels are NaN for that frame and it is flagged in MERGE_LATE.
+ *  A card that skipped a frame is missing from that frame only, and the frame,
+ *  if it turns up later, is dropped and counted.
+ *  A card whose sample numbers go back further than its queue could hold
+ *  has restarted, eg on reconnect: it is re-aligned, its next frame joins
+ *  the next merged frame, and the realign is counted.
+ *  All the work is on the merger thread, the card threads only copy.
+ */
+class acq164MergeDriver: public asynPortDriver {
+	const int ncards;
+	const int nchan;
+	const int maxPoints;
+	const int skew;
+	acq164AsynPortDriver* cards[MAX_MERGE_CARDS];
+	MergeTap* taps[MAX_MERGE_CARDS];
+	int head[MAX_MERGE_CARDS];	/* frame taken from each tap, -1: none */
+	double* eslo;			/* [ncards*nchan], from the card CAL_ params */
+	double* eoff;
+	epicsFloat64* block;
+	int cursor;
+	long long block_sample;
+	long long next_sample;		/* after the last merged frame, -1: none yet */
+	int block_late;
+	int blocks;
+	int late_frames[MAX_MERGE_CARDS];
+	long long offset[MAX_MERGE_CARDS];	/* card sample + offset = merged sample */
+	int realigns[MAX_MERGE_CARDS];
+
+	int P_Waveform;
+	int P_Sample;
+	int P_Late;
+	int P_LateFrames;
+	int P_Dropped;
+	int P_Realigns;
+	int P_Skew;
+	int P_Blocks;
+
+	epicsEventId wake;
+
+	void getCalibration();
+	bool step();
+	void publish();
+public:
+	acq164MergeDriver(const char* portName, int ncards, acq164AsynPortDriver** cards,
+			int nchan, int maxPoints, int skew);
+	void merger();
+};
+
+#endif /* MERGER_H_ */
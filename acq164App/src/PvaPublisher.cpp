@@ -0,0 +1,171 @@
+/* ------------------------------------------------------------------------- */
+/* PvaPublisher.cpp
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#include <stdio.h>
+
+#include "PvaPublisher.h"
+#include "acq164Kernels.h"
+
+#ifdef ACQ164_PVA
+
+#include <pv/pvData.h>
+#include <pv/sharedVector.h>
+#include <pv/ntndarray.h>
+#include <pva/server.h>
+#include <pva/sharedstate.h>
+
+namespace pvd = epics::pvData;
+namespace pva = epics::pvAccess;
+
+/* shared_vector deleter: hands the buffer back to the pool */
+struct PoolRelease {
+	BufferPool* pool;
+	int ib;
+	PoolRelease(BufferPool* _pool, int _ib): pool(_pool), ib(_ib) {}
+	template <class E>
+	void operator()(E*) {
+		pool->release(ib);
+	}
+};
+
+#define PVA_PAYLOAD_BUFFERS	3	/* PVA_LAYOUT_SAMPLE: posted, held by a slow client, spare */
+
+class NTNDArrayPublisher: public PvaPublisher {
+	const int nchan;
+	const int maxPoints;
+	int nwave;			/* channels in the last block */
+	int layout;			/* of the last block */
+	/* PVA_LAYOUT_SAMPLE payloads, allocated on first use */
+	BufferPool tpool;
+	epicsFloat64* tvolts;
+	epicsInt32* traw;
+	pvas::StaticProvider provider;
+	pvas::SharedPV::shared_pointer pv;
+	pvd::PVStructurePtr value;
+	pvd::BitSet changed;
+	pvd::int32 uniqueId;
+
+	template <class PVA, class E>
+	void setValue(const char* field, BufferPool& pool, int ib, const E* data) {
+		pvd::shared_vector<const E> vec(data, PoolRelease(&pool, ib), 0, (size_t)nwave*maxPoints);
+		pvd::PVUnionPtr pvu = value->getSubFieldT<pvd::PVUnion>("value");
+		pvu->select<PVA>(field)->replace(vec);
+		changed.set(pvu->getFieldOffset());
+	}
+	void setDimensions() {
+		pvd::PVStructureArrayPtr dims = value->getSubFieldT<pvd::PVStructureArray>("dimension");
+		pvd::PVStructureArray::svector dv(2);
+		/* NDArray dimension 0 varies fastest */
+		const int sizes[2] = {
+			layout == PVA_LAYOUT_SAMPLE? nwave: maxPoints,
+			layout == PVA_LAYOUT_SAMPLE? maxPoints: nwave
+		};
+
+		for (int id = 0; id < 2; ++id){
+			dv[id] = pvd::getPVDataCreate()->createPVStructure(dims->getStructureArray()->getStructure());
+			dv[id]->getSubFieldT<pvd::PVInt>("size")->put(sizes[id]);
+			dv[id]->getSubFieldT<pvd::PVInt>("fullSize")->put(sizes[id]);
+			dv[id]->getSubFieldT<pvd::PVInt>("binning")->put(1);
+		}
+		dims->replace(pvd::freeze(dv));
+	}
+	/** transpose the block into payload buffer it, the clients' reference */
+	template <class E>
+	E* transpose(E*& payload, int it, const E* data) {
+		if (payload == 0){
+			payload = new E[(size_t)tpool.size()*nchan*maxPoints];
+		}
+		E* dst = payload + (size_t)it*nchan*maxPoints;
+		transpose_block(dst, nwave, data, maxPoints, nwave, maxPoints);
+		return dst;
+	}
+public:
+	NTNDArrayPublisher(const char* pvname, int _nchan, int _maxPoints):
+		nchan(_nchan), maxPoints(_maxPoints), nwave(_nchan), layout(PVA_LAYOUT_CHANNEL),
+		tpool(PVA_PAYLOAD_BUFFERS), tvolts(0), traw(0),
+		provider(PVA_PROVIDER_NAME),
+		pv(pvas::SharedPV::buildReadOnly()),
+		uniqueId(0)
+	{
+		value = epics::nt::NTNDArray::createBuilder()->addTimeStamp()->addAlarm()->createPVStructure();
+		setDimensions();
+		pv->open(*value);
+		provider.add(pvname, pv);
+		pva::ChannelProviderRegistry::servers()->addSingleton(provider.provider());
+	}
+	virtual bool publish(BufferPool& pool, int ib, int _nwave,
+			const epicsFloat64* volts, const epicsInt32* raw,
+			long long sample, const epicsTimeStamp& ts, int _layout)
+	{
+		int it = -1;
+		if (_layout == PVA_LAYOUT_SAMPLE && (it = tpool.acquire(-1)) < 0){
+			return false;
+		}
+		changed.clear();
+		if (_nwave != nwave || _layout != layout){
+			nwave = _nwave;
+			layout = _layout;
+			setDimensions();
+			changed.set(value->getSubFieldT<pvd::PVStructureArray>("dimension")->getFieldOffset());
+		}
+		if (it >= 0){
+			if (volts){
+				setValue<pvd::PVDoubleArray>("doubleValue", tpool, it, transpose(tvolts, it, volts));
+			}else{
+				setValue<pvd::PVIntArray>("intValue", tpool, it, transpose(traw, it, raw));
+			}
+		}else{
+			pool.ref(ib);
+			if (volts){
+				setValue<pvd::PVDoubleArray>("doubleValue", pool, ib, volts);
+			}else{
+				setValue<pvd::PVIntArray>("intValue", pool, ib, raw);
+			}
+		}
+		pvd::PVIntPtr id = value->getSubFieldT<pvd::PVInt>("uniqueId");
+		id->put(++uniqueId);
+		changed.set(id->getFieldOffset());
+
+		pvd::PVStructurePtr pts = value->getSubFieldT<pvd::PVStructure>("timeStamp");
+		pts->getSubFieldT<pvd::PVLong>("secondsPastEpoch")->put(ts.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH);
+		pts->getSubFieldT<pvd::PVInt>("nanoseconds")->put(ts.nsec);
+		pts->getSubFieldT<pvd::PVInt>("userTag")->put((pvd::int32)sample);
+		changed.set(pts->getFieldOffset());
+
+		pv->post(*value, changed);
+		return true;
+	}
+};
+
+PvaPublisher* PvaPublisher::create(const char* pvname, int nchan, int maxPoints)
+{
+	return new NTNDArrayPublisher(pvname, nchan, maxPoints);
+}
+
+#else
+
+PvaPublisher* PvaPublisher::create(const char* pvname, int nchan, int maxPoints)
+{
+	fprintf(stderr, "ERROR: %s built without QSRV, no PVA output\n", pvname);
+	return 0;
+}
+
+#endif /* ACQ164_PVA */
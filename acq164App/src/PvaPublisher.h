@@ -0,0 +1,59 @@
+/* ------------------------------------------------------------------------- */
+/* PvaPublisher.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#ifndef PVAPUBLISHER_H_
+#define PVAPUBLISHER_H_
+
+#include <epicsTypes.h>
+#include <epicsTime.h>
+
+#include "BufferPool.h"
+
+/** Optional pvAccess output: the whole nchan x maxPoints block as one NTNDArray.
+ *  The NTNDArray value shares the pool buffer, no copy: publish() takes a
+ *  reference on buffer ib, dropped when the last PVA client lets go.
+ *  Built only when QSRV is available (ACQ164_PVA), else create() returns NULL.
+ *  The PV is served by provider PVA_PROVIDER_NAME, which must be listed in
+ *  EPICS_PVAS_PROVIDER_NAMES.
+ */
+#define PVA_PROVIDER_NAME	"acq164"
+
+/* PVA_LAYOUT: order of the NTNDArray value. The pool buffer is always
+ * channel-major, as the per channel CA arrays need. Sample-major costs one
+ * cache-blocked transpose, straight into a payload buffer the clients share */
+#define PVA_LAYOUT_CHANNEL	0	/* [nwave][maxPoints], shares the pool buffer */
+#define PVA_LAYOUT_SAMPLE	1	/* [maxPoints][nwave], interleaved, as stored on the card */
+
+class PvaPublisher {
+public:
+	virtual ~PvaPublisher() {}
+
+	/** volts or raw may be NULL, volts is preferred if both are given.
+	 *  The buffer holds nwave channels, packed, nwave <= nchan.
+	 *  \return false if the block was dropped: no free payload buffer */
+	virtual bool publish(BufferPool& pool, int ib, int nwave,
+			const epicsFloat64* volts, const epicsInt32* raw,
+			long long sample, const epicsTimeStamp& ts, int layout) = 0;
+
+	static PvaPublisher* create(const char* pvname, int nchan, int maxPoints);
+};
+
+#endif /* PVAPUBLISHER_H_ */
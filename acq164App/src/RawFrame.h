@@ -0,0 +1,54 @@
+/* ------------------------------------------------------------------------- */
+/* RawFrame.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#ifndef RAWFRAME_H_
+#define RAWFRAME_H_
+
+#include "Frame.h"
+
+/** One frame of raw codes, FRAME_SAMPLES per channel: what the pipeline
+ *  works on. Built per frame from a live ConcreteFrame<int>, or by Replay,
+ *  so the pipeline runs the same with or without a card.
+ *  Channel pointers are borrowed, valid for the frame only. */
+class RawFrame {
+	const int* const* chan;
+	long long sample;
+public:
+	RawFrame(): chan(0), sample(0) {}
+	RawFrame(const int* const* _chan, long long _sample): chan(_chan), sample(_sample) {}
+
+	/** ch counts from 1, as ConcreteFrame<int>::getChannel() */
+	const int* getChannel(int ch) const {
+		return chan[ch-1];
+	}
+	long long getStartSampleNumber() const {
+		return sample;
+	}
+};
+
+/** extra consumer, run after the driver on each frame, see addFrameTap() */
+class FrameTap {
+public:
+	virtual ~FrameTap() {}
+	virtual void onFrame(const RawFrame& frame) = 0;
+};
+
+#endif /* RAWFRAME_H_ */
@@ -0,0 +1,479 @@
+/* ------------------------------------------------------------------------- */
+/* Recorder.cpp
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <epicsAtomic.h>
+
+#include "Frame.h"
+#include "Recorder.h"
+
+#define BLK_FIRST	0x1	/* first block of a recording: open a new fileset */
+#define BLK_LAST	0x2	/* last block of a recording: close the fileset after it */
+
+#define MB		1000000LL
+
+static void writer_runner(void *pvt)
+{
+	((Recorder *)pvt)->writer();
+}
+
+Recorder::Recorder(int _nchan, void (*_onStatus)(void* pvt), void* _pvt):
+	nchan(_nchan), pool(REC_NBUF), blocks(0),
+	fill_ib(-1), cursor(0), active(false), frame_checked(false), next_sample(0),
+	enabled(0), overruns(0),
+	format(REC_FORMAT_DIRFILE), rotate_bytes(0), odirect(false), cal_set(false),
+	wake(0), nfds(0), set_format(REC_FORMAT_DIRFILE), set_rotate(0), set_seq(0),
+	set_bytes(0), set_samples(0), set_start(0), set_next(0), set_gaps(0),
+	bytes_total(0), bytes_mark(0),
+	onStatus(_onStatus), pvt(_pvt)
+{
+	root[0] = '\0';
+	name[0] = '\0';
+	set_path[0] = '\0';
+	memset(&status, 0, sizeof(status));
+	block_n = new int[pool.size()]();
+	block_flags = new int[pool.size()]();
+	block_sample = new long long[pool.size()]();
+	fds = new int[nchan];
+	eslo = new double[nchan]();
+	eoff = new double[nchan]();
+	set_eslo = new double[nchan]();
+	set_eoff = new double[nchan]();
+	mutex = epicsMutexMustCreate();
+}
+
+void Recorder::setCalibration(const double* _eslo, const double* _eoff)
+{
+	epicsMutexMustLock(mutex);
+	memcpy(eslo, _eslo, nchan*sizeof(double));
+	memcpy(eoff, _eoff, nchan*sizeof(double));
+	cal_set = true;
+	epicsMutexUnlock(mutex);
+}
+
+int Recorder::start(const char* _root, int _format, int rotate_mb, bool _odirect)
+{
+	if (_root == 0 || _root[0] == '\0'){
+		fprintf(stderr, "ERROR: Recorder: no root directory\n");
+		return -1;
+	}
+	/* blocks and writer on first use: an IOC that never records pays nothing */
+	if (blocks == 0){
+		void* mem;
+		if (posix_memalign(&mem, REC_ALIGN, (size_t)pool.size()*nchan*REC_BLOCK_SAMPLES*sizeof(int)) != 0){
+			fprintf(stderr, "ERROR: Recorder: failed to allocate blocks\n");
+			return -1;
+		}
+		blocks = (int *)mem;
+		wake = epicsEventMustCreate(epicsEventEmpty);
+		fill_ib = pool.acquire(-1);
+		epicsTimeGetCurrent(&mark);
+
+		/* below the streaming and publisher threads: disk waits are absorbed by REC_NBUF */
+		if (epicsThreadCreate("acq164Recorder",
+				epicsThreadPriorityLow,
+				epicsThreadGetStackSize(epicsThreadStackMedium),
+				(EPICSTHREADFUNC)::writer_runner, this) == 0){
+			fprintf(stderr, "ERROR: Recorder: epicsThreadCreate failure\n");
+			return -1;
+		}
+	}
+
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+
+	epicsMutexMustLock(mutex);
+	strncpy(root, _root, sizeof(root)-1);
+	root[sizeof(root)-1] = '\0';
+	epicsTimeToStrftime(name, sizeof(name), "%Y%m%d-%H%M%S", &now);
+	format = _format == REC_FORMAT_RAW? REC_FORMAT_RAW: REC_FORMAT_DIRFILE;
+	rotate_bytes = rotate_mb > 0? rotate_mb*MB: 0;
+	odirect = _odirect;
+	epicsMutexUnlock(mutex);
+
+	epicsAtomicWriteMemoryBarrier();
+	epicsAtomicSetIntT(&enabled, 1);
+	return 0;
+}
+
+void Recorder::stop()
+{
+	epicsAtomicSetIntT(&enabled, 0);
+}
+
+void Recorder::getStatus(RecorderStatus& st)
+{
+	epicsMutexMustLock(mutex);
+	st = status;
+	epicsMutexUnlock(mutex);
+	st.backlog = blocks? pool.inUse()-1: 0;
+	st.overruns = epicsAtomicGetIntT(&overruns);
+}
+
+/** streaming thread: hand the fill block to the writer.
+ *  With no free block, the data is dropped and the block refilled in place,
+ *  keeping its flags. returns true if posted */
+bool Recorder::postBlock(int flags)
+{
+	int next = pool.acquire(fill_ib);
+	if (next < 0){
+		if (cursor){
+			epicsAtomicIncrIntT(&overruns);
+		}
+		cursor = 0;
+		return false;
+	}
+	block_n[fill_ib] = cursor;
+	block_flags[fill_ib] |= flags;
+	pool.post(fill_ib);
+	epicsEventSignal(wake);
+
+	fill_ib = next;
+	block_flags[fill_ib] = 0;
+	cursor = 0;
+	return true;
+}
+
+void Recorder::onFrame(Acq2xx& card, const AcqType& acqType, const Frame* frame)
+{
+	const int want = epicsAtomicGetIntT(&enabled);
+
+	if (!active){
+		if (!want){
+			return;
+		}
+		epicsAtomicReadMemoryBarrier();
+		active = true;
+		cursor = 0;
+		block_flags[fill_ib] = BLK_FIRST;
+	}else if (!want){
+		/* retried each frame until the writer has room for the close */
+		if (postBlock(BLK_LAST)){
+			active = false;
+		}
+		return;
+	}
+
+	/* the frame type is fixed by the card: check it once */
+	if (!frame_checked){
+		if (dynamic_cast<const ConcreteFrame<int> *>(frame) == 0){
+			fprintf(stderr, "ERROR: Recorder: frame is not ConcreteFrame<int>\n");
+			return;
+		}
+		frame_checked = true;
+	}
+	const ConcreteFrame<int> *cf = static_cast<const ConcreteFrame<int> *>(frame);
+	const long long sample = cf->getStartSampleNumber();
+
+	/* a block holds consecutive samples: close it at a break */
+	if (cursor && sample != next_sample){
+		postBlock(0);
+	}
+	next_sample = sample + FRAME_SAMPLES;
+
+	for (int r0 = 0; r0 < FRAME_SAMPLES; ){
+		int n = FRAME_SAMPLES - r0;
+		if (n > REC_BLOCK_SAMPLES - cursor){
+			n = REC_BLOCK_SAMPLES - cursor;
+		}
+		if (cursor == 0){
+			block_sample[fill_ib] = sample + r0;
+		}
+		int* bb = block(fill_ib);
+		for (int ic = 0; ic < nchan; ++ic){
+			memcpy(bb + (size_t)ic*REC_BLOCK_SAMPLES + cursor, cf->getChannel(ic+1) + r0, n*sizeof(int));
+		}
+		cursor += n;
+		r0 += n;
+		if (cursor == REC_BLOCK_SAMPLES){
+			postBlock(0);
+		}
+	}
+}
+
+void Recorder::fail(const char* what, const char* path)
+{
+	fprintf(stderr, "ERROR: Recorder: %s %s: %s\n", what, path, strerror(errno));
+	epicsMutexMustLock(mutex);
+	++status.errors;
+	epicsMutexUnlock(mutex);
+}
+
+bool Recorder::writeAll(int fd, const void* buf, size_t len)
+{
+	const char* cp = (const char *)buf;
+	while (len){
+		ssize_t nw = write(fd, cp, len);
+		if (nw < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			return false;
+		}
+		cp += nw;
+		len -= nw;
+	}
+	return true;
+}
+
+/** O_DIRECT if asked for and the filesystem supports it, else buffered */
+static int openData(const char* fname, bool direct)
+{
+	const int flags = O_WRONLY|O_CREAT|O_TRUNC;
+#ifdef O_DIRECT
+	if (direct){
+		int fd = open(fname, flags|O_DIRECT, 0664);
+		if (fd >= 0 || errno != EINVAL){
+			return fd;
+		}
+	}
+#endif
+	return open(fname, flags, 0664);
+}
+
+/** the fileset description, rewritten at close with the final sample count.
+ *  dirfile: the dirfile format file; raw: a key=value .hdr alongside */
+void Recorder::writeHeader(const char* path)
+{
+	char fname[300];
+	const int one = 1;
+	const bool little = *(const char *)&one == 1;
+
+	epicsMutexMustLock(mutex);
+	const bool have_cal = cal_set;
+	memcpy(set_eslo, eslo, nchan*sizeof(double));
+	memcpy(set_eoff, eoff, nchan*sizeof(double));
+	epicsMutexUnlock(mutex);
+	const double* m = set_eslo;
+	const double* c = set_eoff;
+
+	if (set_format == REC_FORMAT_RAW){
+		snprintf(fname, sizeof(fname), "%s.hdr", path);
+	}else{
+		snprintf(fname, sizeof(fname), "%s/format", path);
+	}
+	FILE* fp = fopen(fname, "w");
+	if (fp == 0){
+		fail("open", fname);
+		return;
+	}
+	if (set_format == REC_FORMAT_RAW){
+		fprintf(fp, "format=acq164-raw\n");
+		fprintf(fp, "endian=%s\n", little? "little": "big");
+		fprintf(fp, "nchan=%d\n", nchan);
+		fprintf(fp, "block_samples=%d\n", REC_BLOCK_SAMPLES);
+		fprintf(fp, "# blocks of int32 [nchan][block_samples], the last may be short\n");
+		fprintf(fp, "start_sample=%lld\n", set_start);
+		fprintf(fp, "samples=%lld\n", set_samples);
+		fprintf(fp, "# breaks in the recording up to this fileset, each starts a new one\n");
+		fprintf(fp, "gaps=%d\n", set_gaps);
+		if (have_cal){
+			fprintf(fp, "eslo=");
+			for (int ic = 0; ic < nchan; ++ic){
+				fprintf(fp, "%s%.9g", ic? " ": "", m[ic]);
+			}
+			fprintf(fp, "\neoff=");
+			for (int ic = 0; ic < nchan; ++ic){
+				fprintf(fp, "%s%.9g", ic? " ": "", c[ic]);
+			}
+			fprintf(fp, "\n");
+		}
+	}else{
+		fprintf(fp, "/VERSION 9\n");
+		fprintf(fp, "/ENDIAN %s\n", little? "little": "big");
+		fprintf(fp, "/ENCODING none\n");
+		fprintf(fp, "# acq164 start_sample %lld samples %lld gaps %d\n", set_start, set_samples, set_gaps);
+		for (int ic = 0; ic < nchan; ++ic){
+			fprintf(fp, "CH%02d RAW INT32 1\n", ic+1);
+			if (have_cal){
+				fprintf(fp, "V%02d LINCOM 1 CH%02d %.9g %.9g\n", ic+1, ic+1, m[ic], c[ic]);
+			}
+		}
+	}
+	fclose(fp);
+}
+
+/** writer: open fileset set_seq of the current recording */
+void Recorder::openFileset()
+{
+	char fname[300];
+
+	epicsMutexMustLock(mutex);
+	set_format = format;
+	set_rotate = rotate_bytes;
+	const bool direct = odirect;
+	snprintf(set_path, sizeof(set_path), "%s/%s.%03d", root, name, set_seq);
+	epicsMutexUnlock(mutex);
+
+	set_bytes = 0;
+	set_samples = 0;
+	set_start = 0;
+
+	if (set_format == REC_FORMAT_RAW){
+		snprintf(fname, sizeof(fname), "%s.raw", set_path);
+		if ((fds[0] = openData(fname, direct)) < 0){
+			fail("open", fname);
+			return;
+		}
+		nfds = 1;
+	}else{
+		if (mkdir(set_path, 0775) != 0 && errno != EEXIST){
+			fail("mkdir", set_path);
+			return;
+		}
+		for (nfds = 0; nfds < nchan; ++nfds){
+			snprintf(fname, sizeof(fname), "%s/CH%02d", set_path, nfds+1);
+			if ((fds[nfds] = openData(fname, direct)) < 0){
+				fail("open", fname);
+				closeFileset();
+				return;
+			}
+		}
+	}
+	writeHeader(set_path);
+
+	epicsMutexMustLock(mutex);
+	++status.filesets;
+	strncpy(status.file, set_path, sizeof(status.file)-1);
+	status.file[sizeof(status.file)-1] = '\0';
+	epicsMutexUnlock(mutex);
+}
+
+void Recorder::closeFileset()
+{
+	if (nfds == 0){
+		return;
+	}
+	writeHeader(set_path);
+	for (int ii = 0; ii < nfds; ++ii){
+		close(fds[ii]);
+	}
+	nfds = 0;
+
+	epicsMutexMustLock(mutex);
+	status.file[0] = '\0';
+	epicsMutexUnlock(mutex);
+}
+
+void Recorder::writeBlock(int ib)
+{
+	const int n = block_n[ib];
+	const int* bb = block(ib);
+	bool ok = true;
+
+	if (n == 0){
+		return;
+	}
+	if (set_samples == 0){
+		set_start = block_sample[ib];
+	}
+	set_next = block_sample[ib] + n;
+
+#ifdef O_DIRECT
+	/* only the short last block breaks alignment: finish it buffered */
+	if (n < REC_BLOCK_SAMPLES){
+		for (int ii = 0; ii < nfds; ++ii){
+			fcntl(fds[ii], F_SETFL, fcntl(fds[ii], F_GETFL) & ~O_DIRECT);
+		}
+	}
+#endif
+	if (nfds == 1 && n == REC_BLOCK_SAMPLES){
+		ok = writeAll(fds[0], bb, (size_t)nchan*n*sizeof(int));
+	}else{
+		for (int ic = 0; ok && ic < nchan; ++ic){
+			ok = writeAll(fds[nfds == 1? 0: ic], bb + (size_t)ic*REC_BLOCK_SAMPLES, n*sizeof(int));
+		}
+	}
+	if (!ok){
+		fail("write", set_path);
+		closeFileset();
+		return;
+	}
+	set_bytes += (long long)nchan*n*sizeof(int);
+	set_samples += n;
+	bytes_total += (long long)nchan*n*sizeof(int);
+}
+
+/** writer: refresh MB/s once a second, then tell the owner */
+void Recorder::updateStatus()
+{
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+	double dt = epicsTimeDiffInSeconds(&now, &mark);
+	if (dt < 1.0){
+		return;
+	}
+	epicsMutexMustLock(mutex);
+	status.mbps = (bytes_total - bytes_mark)/dt/MB;
+	epicsMutexUnlock(mutex);
+	bytes_mark = bytes_total;
+	mark = now;
+
+	if (onStatus){
+		onStatus(pvt);
+	}
+}
+
+void Recorder::writer()
+{
+	while(1){
+		epicsEventWaitWithTimeout(wake, 1.0);
+
+		int ib;
+		while ((ib = pool.take()) >= 0){
+			if (block_flags[ib]&BLK_FIRST){
+				closeFileset();		/* previous recording lost its close on overrun */
+				set_seq = 0;
+				set_gaps = 0;
+				openFileset();
+			}else if (nfds && set_samples && block_sample[ib] != set_next){
+				/* overrun or a break in the stream: the next fileset starts at the gap */
+				closeFileset();
+				++set_gaps;
+				++set_seq;
+				openFileset();
+			}else if (nfds && set_rotate && set_bytes >= set_rotate){
+				closeFileset();
+				++set_seq;
+				openFileset();
+			}
+			if (nfds){
+				writeBlock(ib);
+			}
+			if (block_flags[ib]&BLK_LAST){
+				closeFileset();
+			}
+			pool.release(ib);
+			updateStatus();
+		}
+		updateStatus();
+	}
+}
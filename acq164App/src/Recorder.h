@@ -0,0 +1,141 @@
+/* ------------------------------------------------------------------------- */
+/* Recorder.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+
+#include "DataStreamer.h"
+#include "BufferPool.h"
+
+/* filesets are root/<start time>.NNN, NNN counts rotations */
+#define REC_FORMAT_DIRFILE	0	/* directory: dirfile format file + raw INT32 file per channel */
+#define REC_FORMAT_RAW		1	/* .raw: blocks of [nchan][block] INT32, .hdr describes it */
+
+#define REC_BLOCK_SAMPLES	16384	/* per channel, 64kB: keeps every write O_DIRECT aligned */
+#define REC_NBUF		8	/* blocks queued to the writer before the recorder drops data */
+#define REC_ALIGN		4096
+
+struct RecorderStatus {
+	double mbps;		/* written, averaged over ~1s */
+	int backlog;		/* blocks waiting for the writer */
+	int overruns;		/* blocks dropped, writer too slow */
+	int filesets;		/* filesets opened, new one on each start and rotation */
+	int errors;		/* open/write failures */
+	char file[256];		/* current fileset, "" if none */
+};
+
+/** Full rate raw recording to disk, alongside the EPICS path.
+ *  A FrameHandler: onFrame() copies raw codes into large aligned blocks,
+ *  REC_BLOCK_SAMPLES per channel, and posts each full block to a writer
+ *  thread that owns all file io, so the streaming thread never waits on disk.
+ *  If the writer falls REC_NBUF blocks behind, blocks are dropped and counted.
+ *  A fileset holds consecutive samples: a break in the sample numbers, or
+ *  blocks dropped on overrun, closes it and starts the next, so only the
+ *  last block of a fileset is ever short.
+ *  start() and stop() may be called from any thread: they take effect on the
+ *  next frame, settings from the next fileset.
+ *  Filesets rotate after rotate_mb MB, 0: never.
+ */
+class Recorder: public FrameHandler {
+	const int nchan;
+	BufferPool pool;
+	int* blocks;
+	int* block_n;		/* samples per channel in block */
+	int* block_flags;
+	long long* block_sample;
+
+	/* streaming thread */
+	int fill_ib;
+	int cursor;
+	bool active;
+	bool frame_checked;	/* the stream delivers ConcreteFrame<int> */
+	long long next_sample;	/* after the last frame copied */
+	int enabled;		/* set by start(), stop() */
+	int overruns;
+
+	/* settings, picked up by the writer at each fileset */
+	epicsMutexId mutex;
+	char root[200];
+	char name[32];		/* recording start time */
+	int format;
+	long long rotate_bytes;
+	bool odirect;
+	bool cal_set;
+	double* eslo;		/* [nchan], copied in by setCalibration() */
+	double* eoff;
+
+	/* writer thread */
+	epicsEventId wake;
+	int* fds;
+	int nfds;
+	char set_path[256];
+	int set_format;
+	long long set_rotate;
+	int set_seq;
+	long long set_bytes;
+	long long set_samples;
+	long long set_start;
+	long long set_next;
+	int set_gaps;		/* breaks in this recording, so far */
+	double* set_eslo;	/* this header's copy of eslo, eoff */
+	double* set_eoff;
+	long long bytes_total;
+	long long bytes_mark;
+	epicsTimeStamp mark;
+	RecorderStatus status;	/* guarded by mutex */
+
+	void (*onStatus)(void* pvt);
+	void* pvt;
+
+	int* block(int ib) {
+		return blocks + (size_t)ib*nchan*REC_BLOCK_SAMPLES;
+	}
+	bool postBlock(int flags);
+	void openFileset();
+	void closeFileset();
+	void writeHeader(const char* path);
+	void writeBlock(int ib);
+	bool writeAll(int fd, const void* buf, size_t len);
+	void fail(const char* what, const char* path);
+	void updateStatus();
+
+public:
+	/** onStatus(pvt) is called from the writer thread about once a second */
+	Recorder(int nchan, void (*onStatus)(void* pvt), void* pvt);
+
+	virtual void onFrame(Acq2xx& card, const AcqType& acqType, const Frame* frame);
+
+	/** start a new fileset under root. returns 0 on success */
+	int start(const char* root, int format, int rotate_mb, bool odirect);
+	void stop();
+	/** per channel volts = raw*eslo + eoff, documented in each fileset. The values are copied */
+	void setCalibration(const double* eslo, const double* eoff);
+
+	void getStatus(RecorderStatus& st);
+
+	void writer();
+};
+
+#endif /* RECORDER_H_ */
@@ -0,0 +1,303 @@
+/* ------------------------------------------------------------------------- */
+/* Replay.cpp
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "acq164Kernels.h"
+#include "Replay.h"
+
+Replay::Replay(int _nchan, bool _loop):
+	nchan(_nchan), loop(_loop), format(REPLAY_PLAIN), fnchan(_nchan),
+	block(REPLAY_BLOCK_SAMPLES), fps(0), nfps(0), buf(0), tmp(0), zeros(0),
+	stride(0), have(0), pos(0), sample(0), raw_samples(0), raw_left(0),
+	cal(0), has_cal(false), loops(0)
+{
+	chan = new const int*[nchan];
+}
+
+Replay::~Replay()
+{
+	for (int ii = 0; ii < nfps; ++ii){
+		fclose(fps[ii]);
+	}
+	delete [] fps;
+	delete [] buf;
+	delete [] tmp;
+	delete [] zeros;
+	delete [] chan;
+	delete [] cal;
+}
+
+void Replay::allocate()
+{
+	buf = new int[(size_t)fnchan*block];
+	zeros = new int[FRAME_SAMPLES]();
+	cal = new double[2*fnchan];
+	if (format == REPLAY_PLAIN){
+		tmp = new int[(size_t)fnchan*block];
+	}
+}
+
+/** .raw data, .hdr key=value description alongside, see Recorder::writeHeader() */
+int Replay::openRaw(const char* path)
+{
+	char fname[300];
+	char line[4096];
+	const size_t len = strlen(path) - strlen(".raw");
+
+	snprintf(fname, sizeof(fname), "%.*s.hdr", (int)len, path);
+	FILE* fp = fopen(fname, "r");
+	if (fp == 0){
+		fprintf(stderr, "ERROR: Replay: open %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	fnchan = 0;
+	block = 0;
+	long fpos = 0;
+	long cal_pos[2] = { -1, -1 };
+	for (; fgets(line, sizeof(line), fp); fpos = ftell(fp)){
+		sscanf(line, "nchan=%d", &fnchan);
+		sscanf(line, "block_samples=%d", &block);
+		sscanf(line, "start_sample=%lld", &sample);
+		sscanf(line, "samples=%lld", &raw_samples);
+		if (strncmp(line, "eslo=", 5) == 0){
+			cal_pos[0] = fpos + 5;
+		}else if (strncmp(line, "eoff=", 5) == 0){
+			cal_pos[1] = fpos + 5;
+		}
+	}
+	if (fnchan <= 0 || block < FRAME_SAMPLES){
+		fprintf(stderr, "ERROR: Replay: %s: bad nchan %d or block_samples %d\n", fname, fnchan, block);
+		fclose(fp);
+		return -1;
+	}
+	allocate();
+
+	has_cal = cal_pos[0] >= 0 && cal_pos[1] >= 0;
+	for (int ik = 0; has_cal && ik < 2; ++ik){
+		fseek(fp, cal_pos[ik], SEEK_SET);
+		for (int ic = 0; ic < fnchan; ++ic){
+			if (fscanf(fp, "%lf", &cal[ik*fnchan+ic]) != 1){
+				has_cal = false;
+				break;
+			}
+		}
+	}
+	fclose(fp);
+
+	/* full blocks, then the last [fnchan][n]: the size must say the same.
+	 * samples=0, a fileset never closed: full blocks only */
+	struct stat sb;
+	if (stat(path, &sb) != 0){
+		fprintf(stderr, "ERROR: Replay: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	const long long row = (long long)fnchan*sizeof(int);
+	if (raw_samples == 0 && sb.st_size % (row*block) == 0){
+		raw_samples = sb.st_size/row;
+	}
+	if (raw_samples*row != sb.st_size){
+		fprintf(stderr, "ERROR: Replay: %s: %lld bytes, not %lld samples of %d channels\n",
+				path, (long long)sb.st_size, raw_samples, fnchan);
+		return -1;
+	}
+	raw_left = raw_samples;
+
+	fps = new FILE*[1];
+	if ((fps[0] = fopen(path, "rb")) == 0){
+		fprintf(stderr, "ERROR: Replay: open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	nfps = 1;
+	return 0;
+}
+
+/** dirfile directory: CHnn per channel, LINCOM Vnn lines carry the calibration */
+int Replay::openDirfile(const char* path)
+{
+	char fname[300];
+	char line[256];
+
+	snprintf(fname, sizeof(fname), "%s/format", path);
+	FILE* fp = fopen(fname, "r");
+	if (fp == 0){
+		fprintf(stderr, "ERROR: Replay: open %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	fnchan = 0;
+	while (fgets(line, sizeof(line), fp)){
+		int ch;
+		if (sscanf(line, "CH%d RAW", &ch) == 1 && ch > fnchan){
+			fnchan = ch;
+		}
+		sscanf(line, "# acq164 start_sample %lld", &sample);
+	}
+	if (fnchan == 0){
+		fprintf(stderr, "ERROR: Replay: %s: no channels\n", fname);
+		fclose(fp);
+		return -1;
+	}
+	allocate();
+
+	int ncal = 0;
+	rewind(fp);
+	while (fgets(line, sizeof(line), fp)){
+		int ch, ch2;
+		double m, c;
+		if (sscanf(line, "V%d LINCOM 1 CH%d %lf %lf", &ch, &ch2, &m, &c) == 4 &&
+		    ch >= 1 && ch <= fnchan){
+			cal[ch-1] = m;
+			cal[fnchan+ch-1] = c;
+			++ncal;
+		}
+	}
+	fclose(fp);
+	has_cal = ncal == fnchan;
+
+	fps = new FILE*[fnchan];
+	for (nfps = 0; nfps < fnchan; ++nfps){
+		snprintf(fname, sizeof(fname), "%s/CH%02d", path, nfps+1);
+		if ((fps[nfps] = fopen(fname, "rb")) == 0){
+			fprintf(stderr, "ERROR: Replay: open %s: %s\n", fname, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int Replay::openPlain(const char* path)
+{
+	allocate();
+	fps = new FILE*[1];
+	if ((fps[0] = fopen(path, "rb")) == 0){
+		fprintf(stderr, "ERROR: Replay: open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	nfps = 1;
+	return 0;
+}
+
+Replay* Replay::create(const char* path, int nchan, bool loop)
+{
+	struct stat sb;
+	if (path == 0 || stat(path, &sb) != 0){
+		fprintf(stderr, "ERROR: Replay: %s: %s\n", path? path: "no file", strerror(errno));
+		return 0;
+	}
+	Replay* rp = new Replay(nchan, loop);
+	const size_t len = strlen(path);
+	int rc;
+
+	if (S_ISDIR(sb.st_mode)){
+		rp->format = REPLAY_DIRFILE;
+		rc = rp->openDirfile(path);
+	}else if (len > 4 && strcmp(path+len-4, ".raw") == 0){
+		rp->format = REPLAY_RAW;
+		rc = rp->openRaw(path);
+	}else{
+		rp->format = REPLAY_PLAIN;
+		rc = rp->openPlain(path);
+	}
+	if (rc != 0){
+		delete rp;
+		return 0;
+	}
+	return rp;
+}
+
+/** read the next block into buf. false at the end */
+bool Replay::fill()
+{
+	size_t nr;
+
+	pos = 0;
+	have = 0;
+	switch(format){
+	case REPLAY_RAW:
+		/* blocks are [fnchan][block], the last one [fnchan][n] */
+		stride = raw_left < block? (int)raw_left: block;
+		nr = fread(buf, sizeof(int), (size_t)fnchan*stride, fps[0]);
+		if (nr != (size_t)fnchan*stride){
+			return false;
+		}
+		have = stride;
+		raw_left -= stride;
+		break;
+	case REPLAY_DIRFILE:
+		stride = block;
+		have = block;
+		for (int ic = 0; ic < fnchan; ++ic){
+			nr = fread(buf + (size_t)ic*block, sizeof(int), block, fps[ic]);
+			if ((int)nr < have){
+				have = nr;
+			}
+		}
+		break;
+	default:
+		nr = fread(tmp, sizeof(int), (size_t)fnchan*block, fps[0]);
+		have = nr/fnchan;
+		stride = block;
+		transpose_block(buf, stride, tmp, fnchan, have, fnchan);
+		break;
+	}
+	return have >= FRAME_SAMPLES;
+}
+
+bool Replay::next(RawFrame& frame)
+{
+	if (pos + FRAME_SAMPLES > have && !fill()){
+		if (!loop){
+			return false;
+		}
+		for (int ii = 0; ii < nfps; ++ii){
+			rewind(fps[ii]);
+		}
+		raw_left = raw_samples;
+		++loops;
+		if (!fill()){
+			return false;
+		}
+	}
+	for (int ic = 0; ic < nchan; ++ic){
+		chan[ic] = ic < fnchan? buf + (size_t)ic*stride + pos: zeros;
+	}
+	frame = RawFrame(chan, sample);
+	pos += FRAME_SAMPLES;
+	sample += FRAME_SAMPLES;
+	return true;
+}
+
+bool Replay::getCalibration(double* eslo, double* eoff) const
+{
+	if (!has_cal){
+		return false;
+	}
+	for (int ic = 0; ic < nchan; ++ic){
+		eslo[ic] = ic < fnchan? cal[ic]: cal[0];
+		eoff[ic] = ic < fnchan? cal[fnchan+ic]: cal[fnchan];
+	}
+	return true;
+}
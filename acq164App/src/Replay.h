@@ -0,0 +1,90 @@
+/* ------------------------------------------------------------------------- */
+/* Replay.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <stdio.h>
+
+#include "RawFrame.h"
+
+/* source formats, picked from the path */
+#define REPLAY_RAW		0	/* Recorder .raw, described by the .hdr alongside */
+#define REPLAY_DIRFILE		1	/* Recorder dirfile: directory with format and CHnn files */
+#define REPLAY_PLAIN		2	/* anything else: int32 interleaved [sample][nchan] */
+
+#define REPLAY_BLOCK_SAMPLES	16384	/* per channel per read, dirfile and plain */
+
+/** Recorded raw frames in place of a card, see acq164ReplayConfigure.
+ *  Reads the Recorder formats or a plain int32 file in blocks, and hands
+ *  them out a frame at a time. Sample numbers run on from the recording's
+ *  start sample, and keep counting when the file loops. Data is native
+ *  endian. Channels the file doesn't have read as zero; a partial frame at
+ *  the end of the file is dropped. A .raw whose size does not match its
+ *  .hdr cannot be framed, and is rejected.
+ */
+class Replay {
+	const int nchan;
+	const bool loop;
+	int format;
+	int fnchan;		/* channels in the file */
+	int block;		/* samples per channel per read */
+	FILE** fps;		/* one, or one per channel for dirfile */
+	int nfps;
+	int* buf;		/* [fnchan][stride] */
+	int* tmp;		/* plain: one interleaved block */
+	int* zeros;
+	const int** chan;
+	int stride;
+	int have;		/* samples per channel in buf */
+	int pos;		/* next frame in buf */
+	long long sample;
+	long long raw_samples;	/* .raw: per channel in the file */
+	long long raw_left;	/* .raw: per channel not yet read */
+	double* cal;		/* [2][fnchan] eslo, eoff, if the file has them */
+	bool has_cal;
+
+	Replay(int nchan, bool loop);
+	int openRaw(const char* path);
+	int openDirfile(const char* path);
+	int openPlain(const char* path);
+	void allocate();
+	bool fill();
+public:
+	~Replay();
+
+	/** open path for a port of nchan channels. returns NULL on error */
+	static Replay* create(const char* path, int nchan, bool loop);
+
+	/** the next frame, valid until the next call. false at the end of the file,
+	 *  or on a read error */
+	bool next(RawFrame& frame);
+
+	/** volts = raw*eslo + eoff from the recording. false if it has none */
+	bool getCalibration(double* eslo, double* eoff) const;
+
+	int getFormat() const {
+		return format;
+	}
+	int loops;		/* times round the file */
+};
+
+#endif /* REPLAY_H_ */
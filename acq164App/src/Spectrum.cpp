@@ -0,0 +1,325 @@
+/* ------------------------------------------------------------------------- */
+/* Spectrum.cpp
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <epicsThread.h>
+#include <epicsAtomic.h>
+#include <epicsStdio.h>
+
+#include "Spectrum.h"
+
+struct SpectrumWorker {
+	Spectrum* spec;
+	int iw;
+};
+
+static void spectrum_runner(void *pvt)
+{
+	((Spectrum *)pvt)->spectrum();
+}
+
+static void worker_runner(void *pvt)
+{
+	SpectrumWorker* sw = (SpectrumWorker *)pvt;
+	sw->spec->worker(sw->iw);
+}
+
+Spectrum::Spectrum(const char* name, int _nchan, int _nfft, int _nworkers,
+		void (*_onResult)(void* pvt), void* _pvt):
+	nchan(_nchan), nfft(_nfft),
+	nworkers(_nworkers < 1? 1: _nworkers > SPEC_MAX_WORKERS? SPEC_MAX_WORKERS: _nworkers),
+	pool(SPEC_NBUF), cursor(0),
+	window(SPEC_WINDOW_HANN), avg_mode(SPEC_AVG_EXP), navg(8), generation(1),
+	cur_generation(0), cur_window(-1), cur_mode(SPEC_AVG_EXP), cur_mask(0), cur_lanes(0),
+	count(0), averages(0), out_mask(0), out_lanes(0), out_sample(0),
+	job_ib(-1), job_alpha(1), job_publish(false), busy(0),
+	onResult(_onResult), pvt(_pvt), overruns(0)
+{
+	const int half = nfft/2;
+
+	blocks = (double *)calloc((size_t)pool.size()*nchan*nfft, sizeof(double));
+	block_mask = new int[pool.size()]();
+	block_lanes = new int[pool.size()]();
+	block_sample = new long long[pool.size()]();
+	win = new double[nfft];
+	twiddle = new double[2*half];
+	bitrev = new int[half];
+	acc = new double[(size_t)nchan*bins()]();
+	result = new double[(size_t)nchan*bins()]();
+
+	for (int k = 0; k < half; ++k){
+		twiddle[2*k] = cos(2*M_PI*k/nfft);
+		twiddle[2*k+1] = -sin(2*M_PI*k/nfft);
+	}
+	int lg = 0;
+	while ((1 << lg) < half){
+		++lg;
+	}
+	for (int i = 0; i < half; ++i){
+		int r = 0;
+		for (int b = 0; b < lg; ++b){
+			r |= ((i >> b) & 1) << (lg-1-b);
+		}
+		bitrev[i] = r;
+	}
+	fill_ib = pool.acquire(-1);
+
+	wake = epicsEventMustCreate(epicsEventEmpty);
+	done = epicsEventMustCreate(epicsEventEmpty);
+
+	/* below the streaming and publisher threads: spectra can wait, samples can't */
+	char tname[32];
+	for (int iw = 0; iw < nworkers; ++iw){
+		SpectrumWorker* sw = new SpectrumWorker;
+		sw->spec = this;
+		sw->iw = iw;
+		scratch[iw] = new double[nfft];
+		go[iw] = epicsEventMustCreate(epicsEventEmpty);
+		epicsSnprintf(tname, sizeof(tname), "%s.spec%d", name, iw);
+		if (epicsThreadCreate(tname, epicsThreadPriorityLow,
+				epicsThreadGetStackSize(epicsThreadStackMedium),
+				(EPICSTHREADFUNC)::worker_runner, sw) == 0){
+			fprintf(stderr, "ERROR: Spectrum: epicsThreadCreate failure\n");
+		}
+	}
+	epicsSnprintf(tname, sizeof(tname), "%s.spec", name);
+	if (epicsThreadCreate(tname, epicsThreadPriorityLow,
+			epicsThreadGetStackSize(epicsThreadStackMedium),
+			(EPICSTHREADFUNC)::spectrum_runner, this) == 0){
+		fprintf(stderr, "ERROR: Spectrum: epicsThreadCreate failure\n");
+	}
+}
+
+void Spectrum::configure(int _window, int _avg_mode, int _navg)
+{
+	epicsAtomicSetIntT(&window, _window);
+	epicsAtomicSetIntT(&avg_mode, _avg_mode);
+	epicsAtomicSetIntT(&navg, _navg < 1? 1: _navg);
+	epicsAtomicIncrIntT(&generation);
+}
+
+void Spectrum::feed(const double* data, int stride, int nsam, int nl, int mask, long long sample)
+{
+	if (mask != block_mask[fill_ib] || nl != block_lanes[fill_ib]){
+		block_mask[fill_ib] = mask;
+		block_lanes[fill_ib] = nl;
+		cursor = 0;
+	}
+	for (int id0 = 0; id0 < nsam; ){
+		int m = nsam - id0;
+		if (m > nfft - cursor){
+			m = nfft - cursor;
+		}
+		if (cursor == 0){
+			block_sample[fill_ib] = sample + id0;
+		}
+		for (int k = 0; k < nl; ++k){
+			memcpy(block(fill_ib, k) + cursor, data + (size_t)k*stride + id0, m*sizeof(double));
+		}
+		cursor += m;
+		id0 += m;
+
+		if (cursor == nfft){
+			cursor = 0;
+			int next = pool.acquire(fill_ib);
+			if (next < 0){
+				++overruns;		/* refilled in place */
+				continue;
+			}
+			pool.post(fill_ib);
+			epicsEventSignal(wake);
+			fill_ib = next;
+			block_mask[fill_ib] = mask;
+			block_lanes[fill_ib] = nl;
+		}
+	}
+}
+
+void Spectrum::makeWindow(int type)
+{
+	/* flat top: a0..a4, periodic */
+	static const double ft[5] = { 0.21557895, 0.41663158, 0.277263158, 0.083578947, 0.006947368 };
+	double sum = 0;
+
+	for (int n = 0; n < nfft; ++n){
+		const double ph = 2*M_PI*n/nfft;
+		if (type == SPEC_WINDOW_FLATTOP){
+			win[n] = ft[0] - ft[1]*cos(ph) + ft[2]*cos(2*ph) - ft[3]*cos(3*ph) + ft[4]*cos(4*ph);
+		}else{
+			win[n] = 0.5*(1 - cos(ph));
+		}
+		sum += win[n];
+	}
+	scale = 1/(sum*sum);
+	cur_window = type;
+}
+
+/** in place radix 2 complex FFT of nfft/2 points, z interleaved re, im */
+void Spectrum::fft(double* z)
+{
+	const int half = nfft/2;
+
+	for (int i = 0; i < half; ++i){
+		int j = bitrev[i];
+		if (i < j){
+			double tr = z[2*i], ti = z[2*i+1];
+			z[2*i] = z[2*j];
+			z[2*i+1] = z[2*j+1];
+			z[2*j] = tr;
+			z[2*j+1] = ti;
+		}
+	}
+	for (int len = 2; len <= half; len <<= 1){
+		const int step = nfft/len;
+		for (int i = 0; i < half; i += len){
+			for (int j = 0; j < len/2; ++j){
+				const double wr = twiddle[2*j*step], wi = twiddle[2*j*step+1];
+				double* u = z + 2*(i+j);
+				double* v = z + 2*(i+j+len/2);
+				const double vr = v[0]*wr - v[1]*wi;
+				const double vi = v[0]*wi + v[1]*wr;
+				v[0] = u[0] - vr;
+				v[1] = u[1] - vi;
+				u[0] += vr;
+				u[1] += vi;
+			}
+		}
+	}
+}
+
+/** window, real FFT as nfft/2 complex, fold the power into lane k's average */
+void Spectrum::channel(int k, double* z)
+{
+	const int half = nfft/2;
+	const double* x = block(job_ib, k);
+	double* out = result + (size_t)k*bins();
+	double* sum = acc + (size_t)k*bins();
+
+	for (int n = 0; n < nfft; ++n){
+		z[n] = x[n]*win[n];
+	}
+	fft(z);
+
+	for (int m = 0; m <= half; ++m){
+		const int i1 = m%half;
+		const int i2 = (half - m)%half;
+		/* even and odd sample spectra */
+		const double er = 0.5*(z[2*i1] + z[2*i2]);
+		const double ei = 0.5*(z[2*i1+1] - z[2*i2+1]);
+		const double or_ = 0.5*(z[2*i1+1] + z[2*i2+1]);
+		const double oi = -0.5*(z[2*i1] - z[2*i2]);
+		const double wr = m < half? twiddle[2*m]: -1;
+		const double wi = m < half? twiddle[2*m+1]: 0;
+		const double xr = er + or_*wr - oi*wi;
+		const double xi = ei + or_*wi + oi*wr;
+		const double p = (xr*xr + xi*xi)*scale*(m == 0 || m == half? 1: 2);
+
+		if (cur_mode == SPEC_AVG_EXP){
+			out[m] += job_alpha*(p - out[m]);
+		}else{
+			sum[m] += p;
+			if (job_publish){
+				out[m] = sum[m]*job_alpha;
+				sum[m] = 0;
+			}
+		}
+	}
+}
+
+void Spectrum::worker(int iw)
+{
+	while(1){
+		epicsEventWait(go[iw]);
+		for (int k = iw; k < cur_lanes; k += nworkers){
+			channel(k, scratch[iw]);
+		}
+		if (epicsAtomicDecrIntT(&busy) == 0){
+			epicsEventSignal(done);
+		}
+	}
+}
+
+/** one block through the workers */
+void Spectrum::run(int ib)
+{
+	const int gen = epicsAtomicGetIntT(&generation);
+	const int n = epicsAtomicGetIntT(&navg);
+
+	if (gen != cur_generation || block_mask[ib] != cur_mask || block_lanes[ib] != cur_lanes){
+		int w = epicsAtomicGetIntT(&window);
+		if (w != cur_window){
+			makeWindow(w);
+		}
+		cur_mode = epicsAtomicGetIntT(&avg_mode);
+		cur_generation = gen;
+		cur_mask = block_mask[ib];
+		cur_lanes = block_lanes[ib];
+		count = 0;
+		memset(acc, 0, (size_t)nchan*bins()*sizeof(double));
+	}
+	++count;
+	if (cur_mode == SPEC_AVG_EXP){
+		job_alpha = 1.0/(count < n? count: n);
+		job_publish = true;
+	}else{
+		job_alpha = 1.0/count;
+		job_publish = count >= n;
+	}
+	job_ib = ib;
+
+	epicsAtomicSetIntT(&busy, nworkers);
+	epicsAtomicWriteMemoryBarrier();
+	for (int iw = 0; iw < nworkers; ++iw){
+		epicsEventSignal(go[iw]);
+	}
+	while (epicsAtomicGetIntT(&busy) > 0){
+		epicsEventWaitWithTimeout(done, 1.0);
+	}
+	epicsAtomicReadMemoryBarrier();
+
+	if (job_publish){
+		averages = cur_mode == SPEC_AVG_EXP && count > n? n: count;
+		out_mask = cur_mask;
+		out_lanes = cur_lanes;
+		out_sample = block_sample[ib];
+		if (cur_mode == SPEC_AVG_LINEAR){
+			count = 0;
+		}
+		onResult(pvt);
+	}
+}
+
+void Spectrum::spectrum()
+{
+	while(1){
+		epicsEventWaitWithTimeout(wake, 1.0);
+		int ib;
+		while ((ib = pool.take()) >= 0){
+			run(ib);
+			pool.release(ib);
+		}
+	}
+}
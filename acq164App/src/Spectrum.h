@@ -0,0 +1,150 @@
+/* ------------------------------------------------------------------------- */
+/* Spectrum.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+
+#ifndef SPECTRUM_H_
+#define SPECTRUM_H_
+
+#include <epicsEvent.h>
+
+#include "BufferPool.h"
+
+/* SPEC_WINDOW */
+#define SPEC_WINDOW_HANN	0
+#define SPEC_WINDOW_FLATTOP	1	/* 5 term flat top: amplitude accurate to ~0.01dB */
+
+/* SPEC_AVG_MODE */
+#define SPEC_AVG_EXP		0	/* exponential, time constant SPEC_AVG_N spectra, publishes every spectrum */
+#define SPEC_AVG_LINEAR		1	/* mean of SPEC_AVG_N spectra, publishes each mean */
+
+#define SPEC_MAX_WORKERS	8
+#define SPEC_NBUF		3	/* input blocks: fill, compute, spare */
+
+/** Power spectrum per channel, off the streaming thread.
+ *  feed() copies calibrated volts into blocks of nfft samples per channel and
+ *  posts each full block, BufferPool style, to the spectrum thread. It splits
+ *  the channels over nworkers worker threads, each applies the window, runs a
+ *  real FFT and folds the result into the channel's average. When an average
+ *  is ready onResult(pvt) is called from the spectrum thread, and power()
+ *  is valid until it returns.
+ *  Power is one sided, V^2 per bin: a sine of amplitude A reads A^2/2.
+ *  If the spectrum thread falls behind, blocks are dropped and counted.
+ */
+class Spectrum {
+	const int nchan;
+	const int nfft;
+	const int nworkers;
+
+	/* input, streaming thread fills */
+	BufferPool pool;
+	double* blocks;			/* [SPEC_NBUF][nchan][nfft] */
+	int* block_mask;
+	int* block_lanes;
+	long long* block_sample;	/* first sample of the block */
+	int fill_ib;
+	int cursor;
+
+	/* settings, any thread, applied at the next block */
+	int window;
+	int avg_mode;
+	int navg;
+	int generation;			/* incremented by configure(), restarts the average */
+
+	/* spectrum thread and workers */
+	int cur_generation;
+	int cur_window;
+	int cur_mode;
+	int cur_mask;
+	int cur_lanes;
+	double* win;			/* [nfft] */
+	double scale;			/* 1/sum(win)^2 */
+	double* twiddle;		/* [nfft/2] complex exp(-2 pi i k/nfft) */
+	int* bitrev;			/* [nfft/2] */
+	double* acc;			/* [nchan][bins], linear mode sums */
+	double* result;			/* [nchan][bins] */
+	int count;
+	int averages;
+	int out_mask;
+	int out_lanes;
+	long long out_sample;
+
+	/* one job: this block, this average weight */
+	int job_ib;
+	double job_alpha;		/* exp: weight of the new spectrum */
+	bool job_publish;		/* linear: last of the navg */
+	epicsEventId wake;
+	epicsEventId go[SPEC_MAX_WORKERS];
+	epicsEventId done;
+	int busy;
+	double* scratch[SPEC_MAX_WORKERS];	/* nfft doubles each */
+
+	void (*onResult)(void* pvt);
+	void* pvt;
+
+	double* block(int ib, int k) {
+		return blocks + ((size_t)ib*nchan + k)*nfft;
+	}
+	void makeWindow(int type);
+	void fft(double* z);
+	void channel(int k, double* work);
+	void run(int ib);
+
+public:
+	int overruns;
+
+	/** nfft: power of 2. Threads are named name.spec, name.specN */
+	Spectrum(const char* name, int nchan, int nfft, int nworkers,
+			void (*onResult)(void* pvt), void* pvt);
+
+	/** streaming thread: nsam samples of nl channels, lane k at data + k*stride,
+	 *  the first at sample. mask identifies the channels, a change starts a new block */
+	void feed(const double* data, int stride, int nsam, int nl, int mask, long long sample);
+
+	/** any thread: window, averaging, restarts the average */
+	void configure(int window, int avg_mode, int navg);
+
+	int bins() const {
+		return nfft/2 + 1;
+	}
+	int size() const {
+		return nfft;
+	}
+
+	/* results, valid in onResult() */
+	const double* power(int k) const {
+		return result + (size_t)k*bins();
+	}
+	int mask() const {
+		return out_mask;
+	}
+	/** first sample of the last block in the average */
+	long long sample() const {
+		return out_sample;
+	}
+	int getAverages() const {
+		return averages;
+	}
+
+	void spectrum();
+	void worker(int iw);
+};
+
+#endif /* SPECTRUM_H_ */
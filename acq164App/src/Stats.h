@@ -0,0 +1,160 @@
+/* ------------------------------------------------------------------------- */
+/* Stats.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <math.h>
+
+#include <epicsMath.h>
+
+#include "Acc.h"
+#include "BufferPool.h"
+
+/* order of results in a StatsBank result array, each nchan long */
+enum { STATS_MEAN, STATS_RMS, STATS_MIN, STATS_MAX, STATS_STD, STATS_NUM };
+
+/** Acc<T> plus sum of squares, min and max, one array per quantity (SoA) */
+template <class T>
+class Stats: public Acc<T> {
+	const int nchan;
+public:
+	T* sumsq;
+	T* vmin;
+	T* vmax;
+
+	Stats(int _nchan): Acc<T>(_nchan), nchan(_nchan) {
+		sumsq = new T[nchan];
+		vmin = new T[nchan];
+		vmax = new T[nchan];
+		clear();
+	}
+	void clear() {
+		Acc<T>::clear();
+		memset(sumsq, 0, nchan*sizeof(T));
+		for (int ic = 0; ic < nchan; ++ic){
+			vmin[ic] = HUGE_VAL;
+			vmax[ic] = -HUGE_VAL;
+		}
+	}
+	void add(int ic, T sum, T sum2, T mn, T mx) {
+		Acc<T>::add(ic, sum);
+		sumsq[ic] += sum2;
+		if (mn < vmin[ic]) vmin[ic] = mn;
+		if (mx > vmax[ic]) vmax[ic] = mx;
+	}
+	/** add raw_stats() results for a block of n codes, scaled by volts = eslo*raw + eoff.
+	 *  count(n) once the block is added for every channel */
+	void add_raw(int ic, double eslo, double eoff, int n,
+			long long rsum, double rsumsq, int rmin, int rmax) {
+		T sum = eslo*rsum + eoff*n;
+		T sum2 = eslo*eslo*rsumsq + 2*eslo*eoff*rsum + eoff*eoff*n;
+		T mn = eslo*rmin + eoff;
+		T mx = eslo*rmax + eoff;
+		if (eslo < 0){
+			T tmp = mn; mn = mx; mx = tmp;
+		}
+		add(ic, sum, sum2, mn, mx);
+	}
+	T rms(int ic) {
+		return this->nadd? sqrt(sumsq[ic]/this->nadd): 0;
+	}
+	T std(int ic) {
+		if (this->nadd == 0){
+			return 0;
+		}
+		T mean = this->get(ic);
+		T var = sumsq[ic]/this->nadd - mean*mean;
+		return var > 0? sqrt(var): 0;
+	}
+};
+
+/** One reporting rate: a Stats window and a pool of result arrays for the
+ *  publisher thread. complete() snapshots the window, STATS_NUM*nchan results,
+ *  and starts the next one. Channels outside the mask read NaN.
+ */
+template <class T>
+class StatsBank {
+	const int nchan;
+	BufferPool pool;
+	T* results;
+	long long* result_sample;
+	int fill_ib;
+public:
+	Stats<T> stats;
+	int overruns;
+
+	StatsBank(int _nchan, int nbuf):
+		nchan(_nchan), pool(nbuf), stats(_nchan), overruns(0)
+	{
+		results = new T[(size_t)pool.size()*STATS_NUM*nchan]();
+		result_sample = new long long[pool.size()]();
+		fill_ib = pool.acquire(-1);
+	}
+	/** filler: window done at sample, over the channels in mask, 0: all.
+	 *  returns true if posted */
+	bool complete(long long sample, int mask) {
+		T* rr = results + (size_t)fill_ib*STATS_NUM*nchan;
+		for (int ic = 0; ic < nchan; ++ic){
+			if (mask && !(ic < 32 && (mask & (1u << ic)))){
+				for (int iq = 0; iq < STATS_NUM; ++iq){
+					rr[iq*nchan+ic] = epicsNAN;
+				}
+				continue;
+			}
+			rr[STATS_MEAN*nchan+ic] = stats.get(ic);
+			rr[STATS_RMS*nchan+ic] = stats.rms(ic);
+			rr[STATS_MIN*nchan+ic] = stats.vmin[ic];
+			rr[STATS_MAX*nchan+ic] = stats.vmax[ic];
+			rr[STATS_STD*nchan+ic] = stats.std(ic);
+		}
+		stats.clear();
+
+		int next = pool.acquire(fill_ib);
+		if (next < 0){
+			++overruns;
+			return false;
+		}
+		result_sample[fill_ib] = sample;
+		pool.post(fill_ib);
+		fill_ib = next;
+		return true;
+	}
+
+	/* consumer interface */
+	int take() {
+		return pool.take();
+	}
+	void release(int ib) {
+		pool.release(ib);
+	}
+	T* result(int ib) {
+		return results + (size_t)ib*STATS_NUM*nchan;
+	}
+	long long sample(int ib) {
+		return result_sample[ib];
+	}
+	int length() const {
+		return STATS_NUM*nchan;
+	}
+};
+
+#endif /* STATS_H_ */
@@ -0,0 +1,183 @@
+/* ------------------------------------------------------------------------- */
+/* Trigger.cpp
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+
+#include <string.h>
+
+#include <epicsAtomic.h>
+#include <epicsMath.h>
+
+#include "acq164Kernels.h"
+#include "Trigger.h"
+
+Trigger::Trigger(int _nchan, int _max_samples, int nevents):
+	nchan(_nchan), max_samples(_max_samples),
+	hist_first(0), hist_next(-1), hist_mask(-1), hist_lanes(0),
+	pool(nevents), armed(false), pending(-1),
+	events_total(0), dropped(0)
+{
+	/* a power of 2, so sample & (hlen-1) is the ring index */
+	for (hlen = 1; hlen < max_samples + FRAME_SAMPLES; hlen <<= 1){
+		;
+	}
+	hist = new int[(size_t)nchan*hlen];
+	events = new double[(size_t)pool.size()*nchan*max_samples];
+	event_sample = new long long[pool.size()]();
+	event_mask = new int[pool.size()]();
+	event_pre = new int[pool.size()]();
+	event_len = new int[pool.size()]();
+	memset(&last, 0, sizeof(last));
+	memset(&set, 0, sizeof(set));
+}
+
+void Trigger::configure(const TriggerSettings& s)
+{
+	/* compare unclamped: a clamped value would differ on every frame */
+	if (s != last){
+		last = s;
+		set = s;
+		if (set.pre < 0){
+			set.pre = 0;
+		}
+		if (set.pre > max_samples - 1){
+			set.pre = max_samples - 1;
+		}
+		if (set.post < 1){
+			set.post = 1;
+		}
+		if (set.pre + set.post > max_samples){
+			set.post = max_samples - set.pre;
+		}
+		if (set.hyst < 0){
+			set.hyst = -set.hyst;
+		}
+		armed = false;
+		pending = -1;
+	}
+}
+
+/** copy [tsample-pre, tsample+post) out of the history to a free event */
+bool Trigger::capture(long long tsample, const int* active, int nactive,
+		const double* eslo, const double* eoff)
+{
+	int ib = pool.acquire(-1);
+	if (ib < 0){
+		epicsAtomicIncrIntT(&dropped);
+		return false;
+	}
+	const int len = set.pre + set.post;
+	const long long s0 = tsample - set.pre;
+	int nan = s0 < hist_first? (int)(hist_first - s0): 0;
+
+	for (int k = 0; k < nactive; ++k){
+		const int ic = active[k];
+		double* dst = events + ((size_t)ib*nchan + k)*max_samples;
+		const int* src = ring(k);
+
+		for (int id = 0; id < nan; ++id){
+			dst[id] = epicsNAN;
+		}
+		for (int id = nan; id < len; ){
+			int ir = (int)((s0 + id) & (hlen-1));
+			int n = len - id;
+			if (n > hlen - ir){
+				n = hlen - ir;
+			}
+			calibrate_channel(dst+id, src+ir, n, eslo[ic], eoff[ic]);
+			id += n;
+		}
+	}
+	event_sample[ib] = tsample;
+	event_mask[ib] = hist_mask;
+	event_pre[ib] = set.pre;
+	event_len[ib] = len;
+	pool.post(ib);
+	epicsAtomicIncrIntT(&events_total);
+	return true;
+}
+
+bool Trigger::onFrame(const RawFrame *cf, long long sample,
+		const int* active, int nactive, int mask,
+		const double* eslo, const double* eoff)
+{
+	if (set.mode == TRIG_OFF || set.channel < 0 || set.channel >= nchan){
+		hist_next = -1;
+		return false;
+	}
+	if (sample != hist_next || mask != hist_mask || nactive != hist_lanes){
+		/* gap, startup or new channel set: history starts again here */
+		hist_first = sample;
+		hist_mask = mask;
+		hist_lanes = nactive;
+		pending = -1;
+	}
+	/* the frame may start anywhere in the ring: split it at the end */
+	const int ir0 = (int)(sample & (hlen-1));
+	const int n0 = FRAME_SAMPLES < hlen - ir0? FRAME_SAMPLES: hlen - ir0;
+	for (int k = 0; k < nactive; ++k){
+		const int* src = cf->getChannel(active[k]+1);
+		memcpy(ring(k) + ir0, src, n0*sizeof(int));
+		memcpy(ring(k), src + n0, (FRAME_SAMPLES - n0)*sizeof(int));
+	}
+	hist_next = sample + FRAME_SAMPLES;
+	if (hist_first < hist_next - hlen){
+		hist_first = hist_next - hlen;
+	}
+
+	/* state machine in volts, sign flipped for falling so one compare serves */
+	const double sgn = set.slope == TRIG_FALLING? -1: 1;
+	const double level = sgn*set.level;
+	const double rearm = level - set.hyst;
+	const double m = sgn*eslo[set.channel];
+	const double c = sgn*eoff[set.channel];
+	const int* tr = cf->getChannel(set.channel+1);
+	bool posted = false;
+
+	for (int id = 0; id < FRAME_SAMPLES; ++id){
+		const long long s = sample + id;
+		const double v = m*tr[id] + c;
+		if (pending >= 0){
+			if (s < pending + set.post){
+				if (set.mode == TRIG_EDGE && !armed){
+					armed = v < rearm;
+				}
+				continue;
+			}
+			posted |= capture(pending, active, nactive, eslo, eoff);
+			pending = -1;
+		}
+		if (set.mode == TRIG_EDGE){
+			if (!armed){
+				armed = v < rearm;
+			}else if (v >= level){
+				armed = false;
+				pending = s;
+			}
+		}else if (v >= level){
+			pending = s;
+		}
+	}
+	if (pending >= 0 && hist_next >= pending + set.post){
+		posted |= capture(pending, active, nactive, eslo, eoff);
+		pending = -1;
+	}
+	return posted;
+}
@@ -0,0 +1,131 @@
+/* ------------------------------------------------------------------------- */
+/* Trigger.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+
+#ifndef TRIGGER_H_
+#define TRIGGER_H_
+
+#include "RawFrame.h"
+#include "BufferPool.h"
+
+/* TRIG_MODE */
+#define TRIG_OFF		0
+#define TRIG_LEVEL		1	/* fires whenever idle and past the level */
+#define TRIG_EDGE		2	/* fires on crossing the level, re-arms beyond level -/+ hysteresis */
+
+/* TRIG_SLOPE */
+#define TRIG_RISING		0
+#define TRIG_FALLING		1
+
+struct TriggerSettings {
+	int mode;
+	int channel;		/* 0..nchan-1 */
+	int slope;
+	double level;		/* volts */
+	double hyst;		/* volts */
+	int pre;		/* samples before the trigger sample */
+	int post;		/* samples from the trigger sample on */
+
+	bool operator!=(const TriggerSettings& b) const {
+		return mode != b.mode || channel != b.channel || slope != b.slope ||
+			level != b.level || hyst != b.hyst || pre != b.pre || post != b.post;
+	}
+};
+
+/** Software trigger on one channel, run from onFrame().
+ *  Raw codes of the active channels are kept in a history ring that covers
+ *  the longest pre + post window and a frame. When the post window of a
+ *  trigger is in the ring, the event is calibrated into a buffer from a
+ *  pool allocated up front, and posted BufferPool style to the publisher.
+ *  Nothing is allocated per event. With no free event buffer the event is
+ *  dropped and counted. One capture at a time: triggers in the post window
+ *  of the one pending are ignored. Samples before the history starts, at
+ *  startup or after a gap, are NaN.
+ */
+class Trigger {
+	const int nchan;
+	const int max_samples;		/* pre + post */
+	int hlen;			/* history ring, power of 2 */
+	int* hist;			/* [nchan][hlen] raw */
+	long long hist_first;		/* oldest valid sample in the ring */
+	long long hist_next;		/* next sample expected, -1: empty */
+	int hist_mask;			/* channel mask the ring holds */
+	int hist_lanes;
+
+	BufferPool pool;
+	double* events;			/* [nevents][nchan][max_samples] */
+	long long* event_sample;
+	int* event_mask;
+	int* event_pre;
+	int* event_len;
+
+	TriggerSettings last;		/* as passed to configure(), for the change test */
+	TriggerSettings set;		/* last, clamped to the ring */
+	bool armed;
+	long long pending;		/* trigger sample being captured, -1: idle */
+
+	int* ring(int k) {
+		return hist + (size_t)k*hlen;
+	}
+	bool capture(long long tsample, const int* active, int nactive,
+			const double* eslo, const double* eoff);
+public:
+	int events_total;
+	int dropped;
+
+	Trigger(int nchan, int max_samples, int nevents);
+
+	/** streaming thread, every frame, before onFrame(). A change re-arms */
+	void configure(const TriggerSettings& s);
+	/** streaming thread. returns true if an event was posted */
+	bool onFrame(const RawFrame *cf, long long sample,
+			const int* active, int nactive, int mask,
+			const double* eslo, const double* eoff);
+
+	int maxSamples() const {
+		return max_samples;
+	}
+
+	/* consumer interface */
+	int take() {
+		return pool.take();
+	}
+	void release(int ib) {
+		pool.release(ib);
+	}
+	const double* wave(int ib, int k) const {
+		return events + ((size_t)ib*nchan + k)*max_samples;
+	}
+	long long sample(int ib) const {
+		return event_sample[ib];
+	}
+	int mask(int ib) const {
+		return event_mask[ib];
+	}
+	int pre(int ib) const {
+		return event_pre[ib];
+	}
+	int length(int ib) const {
+		return event_len[ib];
+	}
+};
+
+#endif /* TRIGGER_H_ */
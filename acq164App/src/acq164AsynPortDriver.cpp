@@ -42,6 +42,9 @@
 #include <stdio.h>
 #include <errno.h>
 #include <math.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #include <epicsTypes.h>
 #include <epicsTime.h>
@@ -50,20 +53,25 @@
 #include <epicsTimer.h>
 #include <epicsMutex.h>
 #include <epicsEvent.h>
+#include <epicsAtomic.h>
+#include <epicsMath.h>
 #include <iocsh.h>
+#include <dbAccess.h>
 
 #include "acq164AsynPortDriver.h"
+#include "acq164Kernels.h"
 #include <epicsExport.h>
 
 #define FREQUENCY 1000       /* Frequency in Hz */
 #define AMPLITUDE 1.0        /* Plus and minus peaks of sin wave */
-#define NUM_DIVISIONS 10     /* Number of scope divisions in X and Y */
 #define MIN_UPDATE_TIME 0.02 /* Minimum update time, to prevent CPU saturation */
 
 #define MAX_ENUM_STRING_SIZE 20
 
 static const char *driverName="acq164AsynPortDriver";
 
+int acq200_debug;
+
 void task_runner(void *drvPvt)
 {
     acq164AsynPortDriver *pPvt = (acq164AsynPortDriver *)drvPvt;
@@ -71,49 +79,264 @@ void task_runner(void *drvPvt)
     pPvt->task();
 }
 
+void publisher_runner(void *drvPvt)
+{
+    acq164AsynPortDriver *pPvt = (acq164AsynPortDriver *)drvPvt;
+
+    pPvt->publisher();
+}
+
+static void spectrum_result(void *drvPvt)
+{
+    acq164AsynPortDriver *pPvt = (acq164AsynPortDriver *)drvPvt;
+
+    pPvt->spectrumResult();
+}
+
+static void compress_result(void *drvPvt)
+{
+    acq164AsynPortDriver *pPvt = (acq164AsynPortDriver *)drvPvt;
+
+    pPvt->compressResult();
+}
+
+static void recorder_status(void *drvPvt)
+{
+    acq164AsynPortDriver *pPvt = (acq164AsynPortDriver *)drvPvt;
+
+    pPvt->recorderStatus();
+}
+
 /** Constructor for the testAsynPortDriver class.
   * Calls constructor for the asynPortDriver base class.
   * \param[in] portName The name of the asyn port driver to be created.
-  * \param[in] maxPoints The maximum  number of points in the volt and time arrays */
-acq164AsynPortDriver::acq164AsynPortDriver(const char *portName, int maxPoints, int _nchan)
+  * \param[in] maxPoints The maximum  number of points in the volt and time arrays
+  * \param[in] _outputs OUTPUT_VOLTS | OUTPUT_RAW | OUTPUT_FILTERED, 0 for OUTPUT_VOLTS
+  * \param[in] _cpumask cpus for the streaming thread, 0: any
+  * \param[in] _priority EPICS priority of the streaming thread, 0: epicsThreadPriorityMedium
+  * \param[in] hugepages 1: put the buffer arena on 2 MB pages if there are any */
+acq164AsynPortDriver::acq164AsynPortDriver(const char *portName, int maxPoints, int _nchan, int _outputs,
+                                           int _cpumask, int _priority, int hugepages)
    : asynPortDriver(portName,
                     _nchan, /* maxAddr */
-                    asynInt32Mask | asynFloat64Mask | asynFloat64ArrayMask | asynEnumMask | asynDrvUserMask, /* Interface mask */
-                    asynInt32Mask | asynFloat64Mask | asynFloat64ArrayMask | asynEnumMask,  /* Interrupt mask */
+                    asynInt32Mask | asynFloat64Mask | asynOctetMask | asynInt32ArrayMask | asynFloat64ArrayMask | asynInt8ArrayMask | asynEnumMask | asynDrvUserMask, /* Interface mask */
+                    asynInt32Mask | asynFloat64Mask | asynOctetMask | asynInt32ArrayMask | asynFloat64ArrayMask | asynInt8ArrayMask | asynEnumMask,  /* Interrupt mask */
                     0, /* asynFlags.  This driver does not block and it is not multi-device, so flag is 0 */
                     1, /* Autoconnect */
                     0, /* Default priority */
                     0) /* Default stack size*/,
+					param_gen(1),
 					nchan(_nchan),
-					acc(_nchan)
+					maxPoints_(maxPoints < 1? 100: maxPoints),
+					acc(_nchan),
+					outputs(_outputs&OUTPUT_FILTERED? _outputs|OUTPUT_VOLTS: _outputs? _outputs: OUTPUT_VOLTS),
+					pool(NUM_WAVEFORM_BUFFERS),
+					publish_overruns(0),
+					snap_ib(-1),
+					pva(0),
+					recorder(_nchan, recorder_status, this),
+					ntaps(0),
+					cpumask(_cpumask),
+					priority(_priority > 0? _priority: epicsThreadPriorityMedium),
+					card_state(CARD_IDLE), card_frames(0), card_cpu(-1),
+					card_priority(0), card_rt(0),
+					card_reconnects(0), downtime_ms(0), downtime_total_ms(0),
+					health_frames(0), health_seen(0), health_published(0),
+					integ(_nchan), integ_restarts(0), restart_pending(0),
+					inst(NUM_PUBLISH_BUFFERS),
+					filter(_nchan),
+					spec(0), pSpecFreq_(0), spec_rate(0), spec_list(0),
+					trig(0), pTrigTime_(0), trig_time_rate(0), trig_time_pre(0), trig_time_len(0),
+					comp(0),
+					dec(_nchan, maxPoints < 1? 100: maxPoints, NUM_PUBLISH_BUFFERS),
+					scalarPool(NUM_PUBLISH_BUFFERS)
 {
     asynStatus status;
-    int i;
 
     /* Make sure maxPoints is positive */
     if (maxPoints < 1) maxPoints = 100;
 
-    /* Allocate the waveform array */
-    pData_ = (epicsFloat64 *)calloc(maxPoints*nchan, sizeof(epicsFloat64));
-
-    /* Allocate the time base array */
-    pTimeBase_ = (epicsFloat64 *)calloc(maxPoints, sizeof(epicsFloat64));
-
-    /* Set the time base array */
-    for (i=0; i<maxPoints; i++) pTimeBase_[i] = (double)i / (maxPoints-1) * NUM_DIVISIONS;
+    /* Lay out the buffers once to size the arena, then again to place them */
+    layoutBuffers(maxPoints);
+    if (arena.create(hugepages != 0) != 0){
+        /* no params, no threads: the port's records fail to connect */
+        printf("%s:%s: %s no memory for the buffer arena, port disabled\n", driverName, __FUNCTION__, portName);
+        pCal_ = 0;
+        return;
+    }
+    layoutBuffers(maxPoints);
+
+    const size_t bufferPoints = (size_t)maxPoints*nchan;
+    chan_mask = 0;
+    nactive = maskChannels(chan_mask, nchan, active);
+    fill_ib = pool.acquire(-1);
+    pData_ = pDataPool_? pDataPool_ + fill_ib*bufferPoints: 0;
+    pRaw_ = pRawPool_? pRawPool_ + fill_ib*bufferPoints: 0;
+    pFilt_ = pFiltPool_? pFiltPool_ + fill_ib*bufferPoints: 0;
+    scalar_ib = scalarPool.acquire(-1);
+
+    timebase_rate = 0;
+    clockMutex_ = epicsMutexMustCreate();
+    sample_clock = ACQ164_DEFAULT_SAMPLE_RATE;
+    clock_sample = -1;
+    updateTimeBase(maxPoints);
+
+    /* nominal +/-10 V until the card's own arrives: streaming need not wait.
+     * active and pCal_ share a page with the pool bookkeeping, faulted in
+     * here on the iocsh thread: only the page aligned buffers follow the
+     * streaming thread's node in touch() */
+    for (int ii = 0; ii < nchan; ++ii){
+        pCal_[ii] = 20.0/(1<<24);
+        pCal_[nchan+ii] = 0;
+    }
+    cal_live = pCal_;
+    cal_seen = 0;
+    cal_updates = 0;
+    recorder.setCalibration(pCal_, pCal_+nchan);
 
     eventId_ = epicsEventCreate(epicsEventEmpty);
+    publishEventId_ = epicsEventCreate(epicsEventEmpty);
+    calEventId_ = epicsEventCreate(epicsEventEmpty);
     createParam(P_RunString,                asynParamInt32,         &P_Run);
     createParam(P_MaxPointsString,          asynParamInt32,         &P_MaxPoints);
     createParam(P_NoiseAmplitudeString,     asynParamFloat64,       &P_NoiseAmplitude);
     createParam(P_UpdateTimeString,         asynParamFloat64,       &P_UpdateTime);
     createParam(P_WaveformString,           asynParamFloat64Array,  &P_Waveform);
+    createParam(P_WaveformDecString,        asynParamFloat64Array,  &P_WaveformDec);
+    createParam(P_WaveformDecMaxString,     asynParamFloat64Array,  &P_WaveformDecMax);
+    createParam(P_WaveformRawString,        asynParamInt32Array,    &P_WaveformRaw);
+    createParam(P_WaveformFiltString,       asynParamFloat64Array,  &P_WaveformFilt);
+    createParam(PS_WAVEFORM_ALL,            asynParamFloat64Array,  &P_WaveformAll);
     createParam(P_ScalarString,				asynParamFloat64,		&P_Scalar);
     createParam(P_TimeBaseString,           asynParamFloat64Array,  &P_TimeBase);
     createParam(P_MinValueString,           asynParamFloat64,       &P_MinValue);
     createParam(P_MaxValueString,           asynParamFloat64,       &P_MaxValue);
     createParam(P_MeanValueString,          asynParamFloat64,       &P_MeanValue);
+    createParam(PS_SCALAR_ARRAY,            asynParamFloat64Array,  &P_ScalarArray);
+    createParam(PS_SCALAR_PER_CHANNEL,      asynParamInt32,         &P_ScalarPerChannel);
     createParam(PS_SCAN_FREQ,          		asynParamInt32,       	&P_ScanFreq);
+    createParam(PS_SCAN_PERIOD,             asynParamFloat64,       &P_ScanPeriod);
+    createParam(PS_SAMPLE_RATE,             asynParamInt32,         &P_SampleRate);
+    createParam(PS_CAL_ESLO,                asynParamFloat64,       &P_CalEslo);
+    createParam(PS_CAL_EOFF,                asynParamFloat64,       &P_CalEoff);
+    createParam(PS_CAL_REFRESH,             asynParamInt32,         &P_CalRefresh);
+    createParam(PS_CAL_VALID,               asynParamInt32,         &P_CalValid);
+    createParam(PS_CAL_UPDATES,             asynParamInt32,         &P_CalUpdates);
+    createParam(PS_FAST_MASK,               asynParamInt32,         &P_FastMask);
+    createParam(PS_FAST_MODE,               asynParamInt32,         &P_FastMode);
+    createParam(PS_FAST_VALUE,              asynParamFloat64,       &P_FastValue);
+    createParam(PS_FAST_LATENCY_US,         asynParamFloat64,       &P_FastLatencyUs);
+    createParam(PS_FAST_LATENCY_MAX_US,     asynParamFloat64,       &P_FastLatencyMaxUs);
+    createParam(PS_WF_MODE,                 asynParamInt32,         &P_WfMode);
+    createParam(PS_PVA_LAYOUT,              asynParamInt32,         &P_PvaLayout);
+    createParam(PS_WF_SLIDE_FRAMES,         asynParamInt32,         &P_WfSlideFrames);
+    createParam(PS_DEC_FACTOR,              asynParamInt32,         &P_DecFactor);
+    createParam(PS_DEC_MODE,                asynParamInt32,         &P_DecMode);
+    createParam(PS_DEC_OVERRUNS,            asynParamInt32,         &P_DecOverruns);
+    createParam(PS_PUB_IN_FLIGHT,           asynParamInt32,         &P_PubInFlight);
+    createParam(PS_PUB_OVERRUNS,            asynParamInt32,         &P_PubOverruns);
+    createParam(PS_SAMPLE_NUMBER,           asynParamFloat64,       &P_SampleNumber);
+    createParam(PS_INST_INTERVAL,           asynParamFloat64,       &P_InstInterval);
+    createParam(PS_INST_FRAME_RATE,         asynParamFloat64,       &P_InstFrameRate);
+    createParam(PS_INST_SAMPLE_RATE,        asynParamFloat64,       &P_InstSampleRate);
+    createParam(PS_INST_CONV_US,            asynParamFloat64,       &P_InstPhaseUs[INST_CONV]);
+    createParam(PS_INST_ACC_US,             asynParamFloat64,       &P_InstPhaseUs[INST_ACC]);
+    createParam(PS_INST_CB_US,              asynParamFloat64,       &P_InstPhaseUs[INST_CB]);
+    createParam(PS_INST_INTEG_US,           asynParamFloat64,       &P_InstPhaseUs[INST_INTEG]);
+    createParam(PS_INST_TRIG_US,            asynParamFloat64,       &P_InstPhaseUs[INST_TRIG]);
+    createParam(PS_INST_TAPS_US,            asynParamFloat64,       &P_InstPhaseUs[INST_TAPS]);
+    createParam(PS_INST_FRAME_US,           asynParamFloat64,       &P_InstFrameUs);
+    createParam(PS_INST_FRAME_MAX_US,       asynParamFloat64,       &P_InstFrameMaxUs);
+    createParam(PS_INST_GAP_MAX_US,         asynParamFloat64,       &P_InstGapMaxUs);
+    createParam(PS_INST_GAP_HIST,           asynParamInt32Array,    &P_InstGapHist);
+    createParam(PS_INST_MISSED,             asynParamInt32,         &P_InstMissed);
+    createParam(PS_INST_DUPLICATED,         asynParamInt32,         &P_InstDuplicated);
+    createParam(PS_CARD_STATE,              asynParamInt32,         &P_CardState);
+    createParam(PS_CARD_FRAMES,             asynParamInt32,         &P_CardFrames);
+    createParam(PS_CARD_FRAME_AGE,          asynParamFloat64,       &P_CardFrameAge);
+    createParam(PS_CARD_CPU,                asynParamInt32,         &P_CardCpu);
+    createParam(PS_CARD_PRIORITY,           asynParamInt32,         &P_CardPriority);
+    createParam(PS_CARD_RT,                 asynParamInt32,         &P_CardRT);
+    createParam(PS_CARD_RECONNECTS,         asynParamInt32,         &P_CardReconnects);
+    createParam(PS_CARD_DOWNTIME,           asynParamFloat64,       &P_CardDowntime);
+    createParam(PS_CARD_DOWNTIME_TOTAL,     asynParamFloat64,       &P_CardDowntimeTotal);
+    createParam(PS_CARD_RETRY,              asynParamFloat64,       &P_CardRetry);
+    createParam(PS_INTEG_ALARM,             asynParamInt32,         &P_IntegAlarm);
+    createParam(PS_INTEG_CHAN,              asynParamInt32,         &P_IntegChan);
+    createParam(PS_INTEG_ZERO_FRAMES,       asynParamInt32,         &P_IntegZeroFrames);
+    createParam(PS_INTEG_SAT_FRAMES,        asynParamInt32,         &P_IntegSatFrames);
+    createParam(PS_INTEG_GAPS,              asynParamInt32,         &P_IntegGaps);
+    createParam(PS_INTEG_GAP_SAMPLES,       asynParamInt32,         &P_IntegGapSamples);
+    createParam(PS_INTEG_RESTARTS,          asynParamInt32,         &P_IntegRestarts);
+    createParam(PS_INTEG_EVERY,             asynParamInt32,         &P_IntegEvery);
+    createParam(PS_INTEG_ZERO_RUN,          asynParamInt32,         &P_IntegZeroRun);
+    createParam(PS_INTEG_RESTART,           asynParamInt32,         &P_IntegRestart);
+    createParam(PS_REC_ENABLE,              asynParamInt32,         &P_RecEnable);
+    createParam(PS_REC_ROOT,                asynParamOctet,         &P_RecRoot);
+    createParam(PS_REC_FORMAT,              asynParamInt32,         &P_RecFormat);
+    createParam(PS_REC_ROTATE_MB,           asynParamInt32,         &P_RecRotateMB);
+    createParam(PS_REC_ODIRECT,             asynParamInt32,         &P_RecODirect);
+    createParam(PS_REC_MBPS,                asynParamFloat64,       &P_RecMBps);
+    createParam(PS_REC_BACKLOG,             asynParamInt32,         &P_RecBacklog);
+    createParam(PS_REC_OVERRUNS,            asynParamInt32,         &P_RecOverruns);
+    createParam(PS_REC_FILESETS,            asynParamInt32,         &P_RecFilesets);
+    createParam(PS_REC_ERRORS,              asynParamInt32,         &P_RecErrors);
+    createParam(PS_REC_FILE,                asynParamOctet,         &P_RecFile);
+    createParam(PS_ARENA_MB,                asynParamFloat64,       &P_ArenaMB);
+    createParam(PS_ARENA_PAGES,             asynParamInt32,         &P_ArenaPages);
+    createParam(PS_ARENA_NODE,              asynParamInt32,         &P_ArenaNode);
+    createParam(PS_CHAN_MASK,               asynParamInt32,         &P_ChanMask);
+    createParam(PS_CHAN_ACTIVE,             asynParamInt32,         &P_ChanActive);
+    createParam(PS_FILTER_TYPE,             asynParamInt32,         &P_FilterType);
+    createParam(PS_FILTER_COEFFS,           asynParamFloat64Array,  &P_FilterCoeffs);
+    createParam(PS_FILTER_FILE,             asynParamOctet,         &P_FilterFile);
+    createParam(PS_FILTER_NCOEF,            asynParamInt32,         &P_FilterNcoef);
+    createParam(PS_SPEC_POWER,              asynParamFloat64Array,  &P_SpecPower);
+    createParam(PS_SPEC_FREQ,               asynParamFloat64Array,  &P_SpecFreq);
+    createParam(PS_SPEC_NFFT,               asynParamInt32,         &P_SpecNfft);
+    createParam(PS_SPEC_WINDOW,             asynParamInt32,         &P_SpecWindow);
+    createParam(PS_SPEC_AVG_MODE,           asynParamInt32,         &P_SpecAvgMode);
+    createParam(PS_SPEC_AVG_N,              asynParamInt32,         &P_SpecAvgN);
+    createParam(PS_SPEC_AVERAGES,           asynParamInt32,         &P_SpecAverages);
+    createParam(PS_SPEC_OVERRUNS,           asynParamInt32,         &P_SpecOverruns);
+    createParam(PS_TRIG_MODE,               asynParamInt32,         &P_TrigMode);
+    createParam(PS_TRIG_CHANNEL,            asynParamInt32,         &P_TrigChannel);
+    createParam(PS_TRIG_SLOPE,              asynParamInt32,         &P_TrigSlope);
+    createParam(PS_TRIG_LEVEL,              asynParamFloat64,       &P_TrigLevel);
+    createParam(PS_TRIG_HYST,               asynParamFloat64,       &P_TrigHyst);
+    createParam(PS_TRIG_PRE,                asynParamInt32,         &P_TrigPre);
+    createParam(PS_TRIG_POST,               asynParamInt32,         &P_TrigPost);
+    createParam(PS_TRIG_WAVEFORM,           asynParamFloat64Array,  &P_TrigWaveform);
+    createParam(PS_TRIG_TIME_BASE,          asynParamFloat64Array,  &P_TrigTimeBase);
+    createParam(PS_TRIG_SAMPLE,             asynParamFloat64,       &P_TrigSample);
+    createParam(PS_TRIG_EVENTS,             asynParamInt32,         &P_TrigEvents);
+    createParam(PS_TRIG_DROPPED,            asynParamInt32,         &P_TrigDropped);
+    createParam(PS_TRIG_MAX,                asynParamInt32,         &P_TrigMax);
+    createParam(PS_COMP_CODEC,              asynParamInt32,         &P_CompCodec);
+    createParam(PS_COMP_LEVEL,              asynParamInt32,         &P_CompLevel);
+    createParam(PS_COMP_WAVEFORM,           asynParamInt8Array,     &P_CompWaveform);
+    createParam(PS_COMP_BYTES,              asynParamInt32,         &P_CompBytes);
+    createParam(PS_COMP_RATIO,              asynParamFloat64,       &P_CompRatio);
+    createParam(PS_COMP_ENCODE_US,          asynParamFloat64,       &P_CompEncodeUs);
+    createParam(PS_COMP_OVERRUNS,           asynParamInt32,         &P_CompOverruns);
+    createParam(PS_COMP_ENABLED,            asynParamInt32,         &P_CompEnabled);
+
+    for (int ib = 0; ib < NUM_STATS_BANKS; ++ib){
+        static const char* stats_names[STATS_NUM] = { "MEAN", "RMS", "MIN", "MAX", "STD" };
+        static const int stats_rates[NUM_STATS_BANKS] = { 1, 10, 100 };
+        char pname[40];
+
+        banks[ib] = new StatsBank<epicsFloat64>(nchan, NUM_PUBLISH_BUFFERS);
+        epicsSnprintf(pname, sizeof(pname), PS_STATS_PREFIX "%d_RATE", ib+1);
+        createParam(pname,                  asynParamInt32,         &P_StatsRate[ib]);
+        epicsSnprintf(pname, sizeof(pname), PS_STATS_PREFIX "%d_ARRAY", ib+1);
+        createParam(pname,                  asynParamFloat64Array,  &P_StatsArray[ib]);
+        for (int is = 0; is < STATS_NUM; ++is){
+            epicsSnprintf(pname, sizeof(pname), PS_STATS_PREFIX "%d_%s", ib+1, stats_names[is]);
+            createParam(pname,              asynParamFloat64,       &P_Stats[ib][is]);
+        }
+        setIntegerParam(P_StatsRate[ib],    stats_rates[ib]);
+    }
 
     /* Set the initial values of some parameters */
     setIntegerParam(P_MaxPoints,         maxPoints);
@@ -124,14 +347,117 @@ acq164AsynPortDriver::acq164AsynPortDriver(const char *portName, int maxPoints,
     setDoubleParam (P_MinValue,          0.0);
     setDoubleParam (P_MaxValue,          3.3);
     setDoubleParam (P_MeanValue,         0.0);
+    setIntegerParam(P_ScalarPerChannel,  1);
+    setDoubleParam (P_ScanPeriod,        0.0);
+    setIntegerParam(P_SampleRate,        ACQ164_DEFAULT_SAMPLE_RATE);
+    for (int ii = 0; ii < nchan; ++ii){
+        setDoubleParam(ii, P_CalEslo,    pCal_[ii]);
+        setDoubleParam(ii, P_CalEoff,    pCal_[nchan+ii]);
+    }
+    setIntegerParam(P_CalRefresh,        0);
+    setIntegerParam(P_CalValid,          0);
+    setIntegerParam(P_CalUpdates,        0);
+    setIntegerParam(P_FastMask,          0);
+    setIntegerParam(P_FastMode,          FAST_LAST);
+    setDoubleParam (P_FastLatencyUs,     0.0);
+    setDoubleParam (P_FastLatencyMaxUs,  0.0);
+    setIntegerParam(P_WfMode,            WF_MODE_BLOCK);
+    setIntegerParam(P_PvaLayout,         PVA_LAYOUT_CHANNEL);
+    setIntegerParam(P_WfSlideFrames,     1);
+    setIntegerParam(P_DecFactor,         1);
+    setIntegerParam(P_DecMode,           DEC_MODE_PICK);
+    setIntegerParam(P_DecOverruns,       0);
+    setIntegerParam(P_PubInFlight,       0);
+    setIntegerParam(P_PubOverruns,       0);
+    setDoubleParam (P_SampleNumber,      0.0);
+    setDoubleParam (P_InstInterval,      1.0);
+    setIntegerParam(P_InstMissed,        0);
+    setIntegerParam(P_InstDuplicated,    0);
+    setIntegerParam(P_CardState,         CARD_IDLE);
+    setIntegerParam(P_CardFrames,        0);
+    setDoubleParam (P_CardFrameAge,      -1.0);
+    setIntegerParam(P_CardCpu,           -1);
+    setIntegerParam(P_CardPriority,      0);
+    setIntegerParam(P_CardRT,            0);
+    setIntegerParam(P_CardReconnects,    0);
+    setDoubleParam (P_CardDowntime,      0.0);
+    setDoubleParam (P_CardDowntimeTotal, 0.0);
+    setDoubleParam (P_CardRetry,         2.0);
+    setIntegerParam(P_IntegAlarm,        0);
+    setIntegerParam(P_IntegZeroFrames,   0);
+    setIntegerParam(P_IntegSatFrames,    0);
+    setIntegerParam(P_IntegGaps,         0);
+    setIntegerParam(P_IntegGapSamples,   0);
+    setIntegerParam(P_IntegRestarts,     0);
+    setIntegerParam(P_IntegEvery,        integ.every);
+    setIntegerParam(P_IntegZeroRun,      integ.zero_limit);
+    setIntegerParam(P_IntegRestart,      integ.restart_frames);
+    setIntegerParam(P_RecEnable,         0);
+    setStringParam (P_RecRoot,           "");
+    setIntegerParam(P_RecFormat,         REC_FORMAT_DIRFILE);
+    setIntegerParam(P_RecRotateMB,       0);
+    setIntegerParam(P_RecODirect,        0);
+    setDoubleParam (P_RecMBps,           0.0);
+    setIntegerParam(P_RecBacklog,        0);
+    setIntegerParam(P_RecOverruns,       0);
+    setIntegerParam(P_RecFilesets,       0);
+    setIntegerParam(P_RecErrors,         0);
+    setStringParam (P_RecFile,           "");
+    setDoubleParam (P_ArenaMB,           arena.size()/1048576.0);
+    setIntegerParam(P_ArenaPages,        arena.getPages());
+    setIntegerParam(P_ArenaNode,         -1);
+    setIntegerParam(P_ChanMask,          chan_mask);
+    setIntegerParam(P_ChanActive,        nactive);
+    setIntegerParam(P_FilterType,        FILTER_OFF);
+    setStringParam (P_FilterFile,        "");
+    setIntegerParam(P_FilterNcoef,       0);
+    setIntegerParam(P_SpecNfft,          0);
+    setIntegerParam(P_SpecWindow,        SPEC_WINDOW_HANN);
+    setIntegerParam(P_SpecAvgMode,       SPEC_AVG_EXP);
+    setIntegerParam(P_SpecAvgN,          8);
+    setIntegerParam(P_SpecAverages,      0);
+    setIntegerParam(P_SpecOverruns,      0);
+    setIntegerParam(P_TrigMode,          TRIG_OFF);
+    setIntegerParam(P_TrigChannel,       0);
+    setIntegerParam(P_TrigSlope,         TRIG_RISING);
+    setDoubleParam (P_TrigLevel,         0.0);
+    setDoubleParam (P_TrigHyst,          0.0);
+    setIntegerParam(P_TrigPre,           0);
+    setIntegerParam(P_TrigPost,          1024);
+    setDoubleParam (P_TrigSample,        0.0);
+    setIntegerParam(P_TrigEvents,        0);
+    setIntegerParam(P_TrigDropped,       0);
+    setIntegerParam(P_TrigMax,           0);
+    setIntegerParam(P_CompCodec,         COMP_OFF);
+    setIntegerParam(P_CompLevel,         1);
+    setIntegerParam(P_CompBytes,         0);
+    setDoubleParam (P_CompRatio,         0.0);
+    setDoubleParam (P_CompEncodeUs,      0.0);
+    setIntegerParam(P_CompOverruns,      0);
+    setIntegerParam(P_CompEnabled,       0);
+
+
+
+    /* Create the streaming thread, one per port: each card streams independently.
+     * EPICS runs it SCHED_FIFO if the IOC has realtime permission */
+    char tname[32];
+    epicsSnprintf(tname, sizeof(tname), "%s.stream", portName);
+    status = (asynStatus)(epicsThreadCreate(tname,
+                          priority,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+						  (EPICSTHREADFUNC)::task_runner,
+                          this) == NULL);
+    if (status) {
+        printf("%s:%s: epicsThreadCreate failure\n", driverName, __FUNCTION__);
+        return;
+    }
 
-
-
-    /* Create the thread that computes the waveforms in the background */
-    status = (asynStatus)(epicsThreadCreate("testAsynPortDriverTask",
+    /* Array callbacks run here, so the streaming thread never waits on CA/PVA clients */
+    epicsSnprintf(tname, sizeof(tname), "%s.publish", portName);
+    status = (asynStatus)(epicsThreadCreate(tname,
                           epicsThreadPriorityMedium,
                           epicsThreadGetStackSize(epicsThreadStackMedium),
-						  (EPICSTHREADFUNC)::task_runner,
+						  (EPICSTHREADFUNC)::publisher_runner,
                           this) == NULL);
     if (status) {
         printf("%s:%s: epicsThreadCreate failure\n", driverName, __FUNCTION__);
@@ -139,9 +465,423 @@ acq164AsynPortDriver::acq164AsynPortDriver(const char *portName, int maxPoints,
     }
 }
 
+/** Streaming thread: sample happens now. Timestamps count on from here */
+void acq164AsynPortDriver::setClock(long long sample)
+{
+	epicsMutexMustLock(clockMutex_);
+	epicsTimeGetCurrent(&clock_ts);
+	clock_sample = sample;
+	epicsMutexUnlock(clockMutex_);
+}
+
+/** time of sample, from the sample clock. Host time now if not anchored */
+void acq164AsynPortDriver::sampleTime(long long sample, epicsTimeStamp *ts)
+{
+	const int rate = epicsAtomicGetIntT(&sample_clock);
+
+	epicsMutexMustLock(clockMutex_);
+	if (clock_sample < 0 || rate <= 0){
+		epicsTimeGetCurrent(ts);
+	}else{
+		*ts = clock_ts;
+		epicsTimeAddSeconds(ts, (double)(sample - clock_sample)/rate);
+	}
+	epicsMutexUnlock(clockMutex_);
+}
+
+/** the calibration buffer not live, to build the next one in */
+double* acq164AsynPortDriver::spareCal()
+{
+	double* live = (double *)epicsAtomicGetPtrT((EpicsAtomicPtrT *)&cal_live);
+	return live == pCal_? pCal_ + 2*nchan: pCal_;
+}
+
+/** cal, from spareCal(), is complete: make it live, and copy it to the
+ *  recorder and the CAL_ params. valid: 1 from the card or file.
+ *  Call from the thread that fills the slots, so cal is not rewritten
+ *  under the copy */
+void acq164AsynPortDriver::installCal(double *cal, int valid)
+{
+	epicsAtomicWriteMemoryBarrier();
+	epicsAtomicSetPtrT((EpicsAtomicPtrT *)&cal_live, cal);
+	recorder.setCalibration(cal, cal+nchan);
+
+	lock();
+	for (int ii = 0; ii < nchan; ++ii){
+		setDoubleParam(ii, P_CalEslo, cal[ii]);
+		setDoubleParam(ii, P_CalEoff, cal[nchan+ii]);
+		callParamCallbacks(ii);
+	}
+	setIntegerParam(P_CalValid, valid);
+	setIntegerParam(P_CalUpdates, ++cal_updates);
+	callParamCallbacks();
+	unlock();
+}
 
+/** Streaming thread: one pass over the asynFloat64 clients, as
+ *  asynPortDriver's own callbacks do, but with no port lock to wait for
+ *  behind the publisher */
+void acq164AsynPortDriver::fastCallbacks(int mask, const epicsFloat64 *values, const epicsTimeStamp& ts)
+{
+	ELLLIST *pclientList;
+	interruptNode *pnode;
+
+	pasynManager->interruptStart(asynStdInterfaces.float64InterruptPvt, &pclientList);
+	for (pnode = (interruptNode *)ellFirst(pclientList); pnode; pnode = (interruptNode *)ellNext(&pnode->node)){
+		asynFloat64Interrupt *pInterrupt = (asynFloat64Interrupt *)pnode->drvPvt;
+		const int addr = pInterrupt->addr;
+		if (pInterrupt->reason == P_FastValue && addr >= 0 && addr < nchan && addr < 32 && (mask & (1u << addr))){
+			pInterrupt->pasynUser->auxStatus = asynSuccess;
+			pInterrupt->pasynUser->timestamp = ts;
+			pInterrupt->callback(pInterrupt->userPvt, pInterrupt->pasynUser, values[addr]);
+		}
+	}
+	pasynManager->interruptEnd(asynStdInterfaces.float64InterruptPvt);
+}
 
+/** time base in s from the first sample of a block, remade only if the
+  * sample clock changes. Call with the port locked */
+void acq164AsynPortDriver::updateTimeBase(int maxPoints)
+{
+	const int rate = epicsAtomicGetIntT(&sample_clock);
 
+	if (rate == timebase_rate || rate <= 0){
+		return;
+	}
+	for (int i = 0; i < maxPoints; i++){
+		pTimeBase_[i] = (double)i/rate;
+	}
+	timebase_rate = rate;
+	doCallbacksFloat64Array(pTimeBase_, maxPoints, P_TimeBase, 0);
+}
+
+/** Called from the streaming thread when pData_ is complete.
+  * Hands pData_ to the publisher and moves on to a free buffer.
+  * If the publisher still holds every other buffer, the block is dropped
+  * and pData_ is refilled in place.
+  * \param[in] sample start sample number of the last frame in the buffer
+  * \param[in] first sample number of the first sample in the buffer */
+void acq164AsynPortDriver::publishBuffer(long long sample, long long first)
+{
+	int next = pool.acquire(fill_ib);
+	if (next < 0){
+		epicsAtomicIncrIntT(&publish_overruns);
+		return;
+	}
+	poolSample_[fill_ib] = sample;
+	poolFirst_[fill_ib] = first;
+	poolMask_[fill_ib] = chan_mask;
+	pool.post(fill_ib);
+	epicsEventSignal(publishEventId_);
+
+	fill_ib = next;
+	pData_ = poolBuffer(fill_ib);
+	pRaw_ = rawBuffer(fill_ib);
+	pFilt_ = filtBuffer(fill_ib);
+}
+
+/** Carve the acquisition buffers from the arena in the same order every
+ *  time: the pools and what the streaming thread touches every frame, then
+ *  the time base, then cold, the sliding rings. Each region is cache line
+ *  aligned, large ones page aligned, so with maxPoints a multiple of 16
+ *  every channel row starts on a cache line. Channel rows are not padded
+ *  apart: the PVA output shares each buffer as one [nchan][maxPoints] block */
+void acq164AsynPortDriver::layoutBuffers(int maxPoints)
+{
+    const size_t bufferPoints = (size_t)maxPoints*nchan;
+
+    /* A raw only IOC has no volts buffers at all */
+    pDataPool_ = outputs&OUTPUT_VOLTS? arena.alloc<epicsFloat64>(bufferPoints*pool.size()): 0;
+    pRawPool_ = outputs&OUTPUT_RAW? arena.alloc<epicsInt32>(bufferPoints*pool.size()): 0;
+    pFiltPool_ = outputs&OUTPUT_FILTERED? arena.alloc<epicsFloat64>(bufferPoints*pool.size()): 0;
+    poolSample_ = arena.alloc<long long>(pool.size());
+    poolFirst_ = arena.alloc<long long>(pool.size());
+    poolMask_ = arena.alloc<int>(pool.size());
+    active = arena.alloc<int>(nchan);
+    pCal_ = arena.alloc<double>(NUM_CAL_BUFFERS*2*nchan);
+    pScalarPool_ = arena.alloc<epicsFloat64>((size_t)scalarPool.size()*SCALAR_NUM*nchan);
+    scalarSample_ = arena.alloc<long long>(scalarPool.size());
+    scalarMask_ = arena.alloc<int>(scalarPool.size());
+    arena.markCold();
+    /* filled by updateTimeBase() for the sample clock, on this thread and the publisher */
+    pTimeBase_ = arena.alloc<epicsFloat64>(maxPoints);
+    pRingData_ = outputs&OUTPUT_VOLTS? arena.alloc<epicsFloat64>(bufferPoints): 0;
+    pRingRaw_ = outputs&OUTPUT_RAW? arena.alloc<epicsInt32>(bufferPoints): 0;
+    pRingFilt_ = outputs&OUTPUT_FILTERED? arena.alloc<epicsFloat64>(bufferPoints): 0;
+}
+
+/** Publisher: the latest scalar tick, older ones on offer are dropped.
+ *  SCOPE_SCALAR_ARRAY is one callback; the per channel params, if wanted,
+ *  are set under the same lock */
+void acq164AsynPortDriver::publishScalars(int *list)
+{
+	int ib;
+	int last = -1;
+
+	while ((ib = scalarPool.take()) >= 0){
+		if (last >= 0){
+			scalarPool.release(last);
+		}
+		last = ib;
+	}
+	if (last < 0){
+		return;
+	}
+	epicsFloat64* rr = scalarBuffer(last);
+	const int nw = maskChannels(scalarMask_[last], nchan, list);
+	int per_channel;
+	epicsTimeStamp ts;
+	sampleTime(scalarSample_[last], &ts);
+
+	lock();
+	setTimeStamp(&ts);
+	getIntegerParam(P_ScalarPerChannel, &per_channel);
+	if (per_channel){
+		for (int k = 0; k < nw; ++k){
+			const int ic = list[k];
+			setDoubleParam(ic, P_Scalar, rr[SCALAR_MEAN*nchan+ic]);
+			setDoubleParam(ic, P_MeanValue, rr[SCALAR_MEAN*nchan+ic]);
+			setDoubleParam(ic, P_MinValue, rr[SCALAR_MIN*nchan+ic]);
+			setDoubleParam(ic, P_MaxValue, rr[SCALAR_MAX*nchan+ic]);
+			callParamCallbacks(ic);
+		}
+	}
+	doCallbacksFloat64Array(rr + SCALAR_MEAN*nchan, nchan, P_ScalarArray, 0);
+	unlock();
+	scalarPool.release(last);
+}
+
+/** CHAN_MASK to a list of channels, returns the count.
+  * 0, or no bit below nchan, selects every channel */
+int acq164AsynPortDriver::maskChannels(int mask, int nchan, int *list)
+{
+	int nw = 0;
+	for (int ic = 0; ic < nchan; ++ic){
+		if (ic < 32 && (mask & (1u << ic))){
+			list[nw++] = ic;
+		}
+	}
+	if (nw == 0){
+		for (; nw < nchan; ++nw){
+			list[nw] = nw;
+		}
+	}
+	return nw;
+}
+
+/** Publisher thread: runs the array callbacks for each buffer posted by publishBuffer() */
+void acq164AsynPortDriver::publisher()
+{
+	const int maxPoints = get_maxPoints();
+	int *list = new int[nchan];
+	int nw;
+
+	while(1){
+		epicsEventWaitWithTimeout(publishEventId_, 1.0);
+		updateHealth();
+
+		int ib;
+		while ((ib = pool.take()) >= 0){
+			epicsFloat64* data = poolBuffer(ib);
+			epicsInt32* raw = rawBuffer(ib);
+			epicsFloat64* filt = filtBuffer(ib);
+			nw = maskChannels(poolMask_[ib], nchan, list);
+			epicsTimeStamp ts;
+			sampleTime(poolFirst_[ib], &ts);
+			int layout;
+
+			lock();
+			getIntegerParam(P_PvaLayout, &layout);
+			updateTimeBase(maxPoints);
+			setTimeStamp(&ts);
+			setDoubleParam(P_SampleNumber, poolSample_[ib]);
+			setIntegerParam(P_PubInFlight, pool.inUse()-1-(snap_ib >= 0));
+			setIntegerParam(P_PubOverruns, epicsAtomicGetIntT(&publish_overruns));
+			callParamCallbacks();
+
+			for (int k = 0; k < nw; k++){
+				if (data){
+					doCallbacksFloat64Array(data+k*maxPoints, maxPoints, P_Waveform, list[k]);
+				}
+				if (raw){
+					doCallbacksInt32Array(raw+k*maxPoints, maxPoints, P_WaveformRaw, list[k]);
+				}
+				if (filt){
+					doCallbacksFloat64Array(filt+k*maxPoints, maxPoints, P_WaveformFilt, list[k]);
+				}
+			}
+			if (data){
+				doCallbacksFloat64Array(data, (size_t)nw*maxPoints, P_WaveformAll, 0);
+			}
+			unlock();
+
+			if (pva){
+				if (!pva->publish(pool, ib, nw, data, raw, poolSample_[ib], ts, layout)){
+					epicsAtomicIncrIntT(&publish_overruns);
+				}
+			}
+			if (comp){
+				comp->feed(raw, nw, poolMask_[ib], poolSample_[ib], ts);
+			}
+			/* our reference moves to the snapshot, the old one goes back */
+			lock();
+			int old = snap_ib;
+			snap_ib = ib;
+			unlock();
+			if (old >= 0){
+				pool.release(old);
+			}
+		}
+
+		publishScalars(list);
+
+		for (int ik = 0; ik < NUM_STATS_BANKS; ++ik){
+			StatsBank<epicsFloat64>* bank = banks[ik];
+			while ((ib = bank->take()) >= 0){
+				epicsFloat64* rr = bank->result(ib);
+				nw = maskChannels(epicsAtomicGetIntT(&chan_mask), nchan, list);
+				epicsTimeStamp ts;
+				sampleTime(bank->sample(ib), &ts);
+				lock();
+				setTimeStamp(&ts);
+				for (int k = 0; k < nw; k++){
+					const int ic = list[k];
+					for (int is = 0; is < STATS_NUM; ++is){
+						setDoubleParam(ic, P_Stats[ik][is], rr[is*nchan+ic]);
+					}
+					callParamCallbacks(ic);
+				}
+				doCallbacksFloat64Array(rr, bank->length(), P_StatsArray[ik], 0);
+				unlock();
+				bank->release(ib);
+			}
+		}
+
+		while ((ib = inst.take()) >= 0){
+			const InstResult& r = inst.result(ib);
+			lock();
+			setDoubleParam(P_InstFrameRate, r.frame_rate);
+			setDoubleParam(P_InstSampleRate, r.sample_rate);
+			for (int ph = 0; ph < INST_PHASES; ++ph){
+				setDoubleParam(P_InstPhaseUs[ph], r.phase_us[ph]);
+			}
+			setDoubleParam(P_InstFrameUs, r.frame_us);
+			setDoubleParam(P_InstFrameMaxUs, r.frame_max_us);
+			setDoubleParam(P_InstGapMaxUs, r.gap_max_us);
+			setDoubleParam(P_FastLatencyUs, r.fast_us);
+			setDoubleParam(P_FastLatencyMaxUs, r.fast_max_us);
+			setIntegerParam(P_InstMissed, r.missed);
+			setIntegerParam(P_InstDuplicated, r.duplicated);
+			callParamCallbacks();
+			doCallbacksInt32Array((epicsInt32 *)r.gap_hist, INST_HIST_BINS, P_InstGapHist, 0);
+			unlock();
+			inst.release(ib);
+		}
+
+		while ((ib = dec.take()) >= 0){
+			nw = maskChannels(dec.tag(ib), nchan, list);
+			epicsTimeStamp ts;
+			sampleTime(dec.first(ib), &ts);
+			lock();
+			setTimeStamp(&ts);
+			setIntegerParam(P_DecOverruns, dec.overruns);
+			callParamCallbacks();
+			for (int k = 0; k < nw; k++){
+				const int ic = list[k];
+				doCallbacksFloat64Array(dec.lo(ib, ic), dec.size(), P_WaveformDec, ic);
+				epicsFloat64* hi = dec.hi(ib, ic);
+				if (hi){
+					doCallbacksFloat64Array(hi, dec.size(), P_WaveformDecMax, ic);
+				}
+			}
+			unlock();
+			dec.release(ib);
+		}
+
+		publishTrigger(list);
+	}
+}
+
+
+
+
+
+/** Run tap on every frame, after the driver. Taps can be added while streaming, never removed */
+int acq164AsynPortDriver::addFrameTap(FrameTap *tap)
+{
+	if (ntaps >= MAX_FRAME_TAPS){
+		fprintf(stderr, "%s:%s: %s no room for another tap\n", driverName, __FUNCTION__, portName);
+		return asynError;
+	}
+	taps[ntaps] = tap;
+	epicsAtomicWriteMemoryBarrier();
+	epicsAtomicIncrIntT(&ntaps);
+	return asynSuccess;
+}
+
+/** Streaming thread: apply cpumask and note where and how it runs */
+void acq164AsynPortDriver::placeStreamingThread()
+{
+#ifdef __linux__
+	if (cpumask){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu = 0; cpu < 32; ++cpu){
+			if (cpumask & (1u << cpu)){
+				CPU_SET(cpu, &set);
+			}
+		}
+		if (sched_setaffinity(0, sizeof(set), &set) != 0){
+			fprintf(stderr, "%s:%s: %s failed to set cpumask 0x%x\n",
+					driverName, __FUNCTION__, portName, cpumask);
+		}
+	}
+	int policy = sched_getscheduler(0);
+	epicsAtomicSetIntT(&card_rt, policy == SCHED_FIFO || policy == SCHED_RR);
+	epicsAtomicSetIntT(&card_cpu, sched_getcpu());
+#endif
+	epicsAtomicSetIntT(&card_priority, epicsThreadGetPrioritySelf());
+}
+
+/** Publisher thread, at least once a second: card health params at 1Hz */
+void acq164AsynPortDriver::updateHealth()
+{
+	const epicsUInt64 now = epicsMonotonicGet();
+	const int frames = epicsAtomicGetIntT(&card_frames);
+
+	if (frames != health_frames){
+		health_frames = frames;
+		health_seen = now;
+	}
+	if (now - health_published < 1000000000ULL){
+		return;
+	}
+	health_published = now;
+
+	lock();
+	setIntegerParam(P_CardState, epicsAtomicGetIntT(&card_state));
+	setIntegerParam(P_CardFrames, frames);
+	setDoubleParam(P_CardFrameAge, health_seen? (now - health_seen)*1e-9: -1.0);
+	setIntegerParam(P_CardCpu, epicsAtomicGetIntT(&card_cpu));
+	setIntegerParam(P_CardPriority, epicsAtomicGetIntT(&card_priority));
+	setIntegerParam(P_CardRT, epicsAtomicGetIntT(&card_rt));
+	setIntegerParam(P_CardReconnects, epicsAtomicGetIntT(&card_reconnects));
+	setDoubleParam(P_CardDowntime, epicsAtomicGetIntT(&downtime_ms)*1e-3);
+	setDoubleParam(P_CardDowntimeTotal, epicsAtomicGetIntT(&downtime_total_ms)*1e-3);
+	setIntegerParam(P_IntegAlarm, epicsAtomicGetIntT(&integ.alarm));
+	setIntegerParam(P_IntegZeroFrames, epicsAtomicGetIntT(&integ.zero_frames));
+	setIntegerParam(P_IntegSatFrames, epicsAtomicGetIntT(&integ.sat_frames));
+	setIntegerParam(P_IntegGaps, epicsAtomicGetIntT(&integ.gaps));
+	setIntegerParam(P_IntegGapSamples, epicsAtomicGetIntT(&integ.gap_samples));
+	setIntegerParam(P_IntegRestarts, epicsAtomicGetIntT(&integ_restarts));
+	for (int ic = nchan-1; ic > 0; --ic){
+		setIntegerParam(ic, P_IntegChan, epicsAtomicGetIntT(&integ.chan_alarm[ic]));
+		callParamCallbacks(ic);
+	}
+	setIntegerParam(0, P_IntegChan, epicsAtomicGetIntT(&integ.chan_alarm[0]));
+	callParamCallbacks();
+	unlock();
+}
 
 /** Called when asyn clients call pasynInt32->write().
   * This function sends a signal to the simTask thread if the value of P_Run has changed.
@@ -152,11 +892,18 @@ asynStatus acq164AsynPortDriver::writeInt32(asynUser *pasynUser, epicsInt32 valu
 {
     int function = pasynUser->reason;
     asynStatus status = asynSuccess;
+    asynStatus rec_status = asynSuccess;
+    asynStatus status2 = asynSuccess;
     const char *paramName;
     const char* functionName = "writeInt32";
 
+    /* limits the streaming thread relies on, the readback shows the value used */
+    if (function == P_IntegEvery && value < 1) value = 1;
+    if ((function == P_IntegZeroRun || function == P_IntegRestart) && value < 0) value = 0;
+
     /* Set the parameter in the parameter library. */
     status = (asynStatus) setIntegerParam(function, value);
+    epicsAtomicIncrIntT(&param_gen);
 
     /* Fetch the parameter string name for possible use in debugging */
     getParamName(function, &paramName);
@@ -165,6 +912,27 @@ asynStatus acq164AsynPortDriver::writeInt32(asynUser *pasynUser, epicsInt32 valu
         /* If run was set then wake up the simulation task */
         if (value) epicsEventSignal(eventId_);
     }
+    else if (function == P_CalRefresh) {
+        if (value) epicsEventSignal(calEventId_);
+        setIntegerParam(P_CalRefresh, 0);
+    }
+    else if (function == P_FilterType) {
+        if (filter.set(value, 0, 0) != 0) status2 = asynError;
+        filterStatus();
+    }
+    else if (function == P_CompCodec || function == P_CompLevel) {
+        status2 = (asynStatus) configureCompressor();
+    }
+    else if (function == P_SpecWindow || function == P_SpecAvgMode || function == P_SpecAvgN) {
+        configureSpectrum();
+    }
+    else if (function == P_RecEnable) {
+        if (!value) {
+            recorder.stop();
+        } else if ((rec_status = (asynStatus) startRecorder()) != asynSuccess) {
+            setIntegerParam(P_RecEnable, 0);
+        }
+    }
     else {
         /* All other parameters just get set in parameter list, no need to
          * act on them here */
@@ -172,6 +940,8 @@ asynStatus acq164AsynPortDriver::writeInt32(asynUser *pasynUser, epicsInt32 valu
 
     /* Do callbacks so higher layers see any changes */
     status = (asynStatus) callParamCallbacks();
+    if (rec_status) status = rec_status;
+    if (status2) status = status2;
 
     if (status)
         epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
@@ -199,6 +969,7 @@ asynStatus acq164AsynPortDriver::writeFloat64(asynUser *pasynUser, epicsFloat64
 
     /* Set the parameter in the parameter library. */
     status = (asynStatus) setDoubleParam(function, value);
+    epicsAtomicIncrIntT(&param_gen);
 
     /* Fetch the parameter string name for possible use in debugging */
     getParamName(function, &paramName);
@@ -245,24 +1016,43 @@ asynStatus acq164AsynPortDriver::readFloat64Array(asynUser *pasynUser, epicsFloa
                                          size_t nElements, size_t *nIn)
 {
     int function = pasynUser->reason;
-    size_t ncopy;
-    epicsInt32 itemp;
+    /* the buffers are sized from maxPoints_, not the param a client can write */
+    const int itemp = get_maxPoints();
+    size_t ncopy = itemp;
     asynStatus status = asynSuccess;
     epicsTimeStamp timeStamp;
     const char *functionName = "readFloat64Array";
 
     getTimeStamp(&timeStamp);
     pasynUser->timestamp = timeStamp;
-    getIntegerParam(P_MaxPoints, &itemp); ncopy = itemp;
     if (nElements < ncopy) ncopy = nElements;
-    if (function == P_Waveform) {
-    	assert(0);
-        *nIn = ncopy;
+    *nIn = 0;
+    if (function == P_Waveform || function == P_WaveformFilt) {
+        int addr;
+        getAddress(pasynUser, &addr);
+        const int k = snapshotIndex(addr);
+        epicsFloat64 *data = k < 0? 0: function == P_Waveform? poolBuffer(snap_ib): filtBuffer(snap_ib);
+        if (data == 0) {
+            status = asynError;
+        } else {
+            memcpy(value, data + (size_t)k*itemp, ncopy*sizeof(epicsFloat64));
+            sampleTime(poolFirst_[snap_ib], &pasynUser->timestamp);
+            *nIn = ncopy;
+        }
     }
     else if (function == P_TimeBase) {
         memcpy(value, pTimeBase_, ncopy*sizeof(epicsFloat64));
         *nIn = ncopy;
     }
+    else if (function == P_SpecFreq && spec) {
+        ncopy = spec->bins();
+        if (nElements < ncopy) ncopy = nElements;
+        memcpy(value, pSpecFreq_, ncopy*sizeof(epicsFloat64));
+        *nIn = ncopy;
+    }
+    else {
+        return asynPortDriver::readFloat64Array(pasynUser, value, nElements, nIn);
+    }
     if (status)
         epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
                   "%s:%s: status=%d, function=%d",
@@ -274,6 +1064,405 @@ asynStatus acq164AsynPortDriver::readFloat64Array(asynUser *pasynUser, epicsFloa
     return status;
 }
 
+/** buffer index of channel addr in the snapshot, -1 if none or not selected.
+  * Call with the port locked */
+int acq164AsynPortDriver::snapshotIndex(int addr)
+{
+	if (snap_ib < 0){
+		return -1;
+	}
+	const int mask = poolMask_[snap_ib];
+	int k = 0;
+	for (int ic = 0; ic < nchan; ++ic){
+		if (ic < 32 && (mask & (1u << ic))){
+			if (ic == addr){
+				return k;
+			}
+			++k;
+		}
+	}
+	/* no channel selected: all of them */
+	return k == 0 && addr >= 0 && addr < nchan? addr: -1;
+}
+
+/** Called when asyn clients call pasynInt32Array->read().
+  * Returns the latest published P_WaveformRaw for the channel.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value Pointer to the array to read.
+  * \param[in] nElements Number of elements to read.
+  * \param[out] nIn Number of elements actually read. */
+asynStatus acq164AsynPortDriver::readInt32Array(asynUser *pasynUser, epicsInt32 *value,
+                                         size_t nElements, size_t *nIn)
+{
+    int function = pasynUser->reason;
+    const int itemp = get_maxPoints();
+    size_t ncopy = itemp;
+    asynStatus status = asynSuccess;
+    const char *functionName = "readInt32Array";
+
+    if (nElements < ncopy) ncopy = nElements;
+    *nIn = 0;
+    if (function == P_WaveformRaw) {
+        int addr;
+        getAddress(pasynUser, &addr);
+        const int k = snapshotIndex(addr);
+        epicsInt32 *raw = k < 0? 0: rawBuffer(snap_ib);
+        if (raw == 0) {
+            status = asynError;
+        } else {
+            memcpy(value, raw + (size_t)k*itemp, ncopy*sizeof(epicsInt32));
+            sampleTime(poolFirst_[snap_ib], &pasynUser->timestamp);
+            *nIn = ncopy;
+        }
+    }
+    else {
+        return asynPortDriver::readInt32Array(pasynUser, value, nElements, nIn);
+    }
+    if (status)
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                  "%s:%s: status=%d, function=%d, no data for this channel",
+                  driverName, functionName, status, function);
+    else
+        asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+              "%s:%s: function=%d\n",
+              driverName, functionName, function);
+    return status;
+}
+
+/** Called when asyn clients call pasynFloat64Array->write().
+  * FILTER_COEFFS: new coefficients for the current FILTER_TYPE.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value Pointer to the array to write.
+  * \param[in] nElements Number of elements to write. */
+asynStatus acq164AsynPortDriver::writeFloat64Array(asynUser *pasynUser, epicsFloat64 *value,
+                                         size_t nElements)
+{
+    int function = pasynUser->reason;
+    asynStatus status = asynSuccess;
+    epicsInt32 type;
+    const char *functionName = "writeFloat64Array";
+
+    if (function == P_FilterCoeffs) {
+        getIntegerParam(P_FilterType, &type);
+        if (filter.set(type, value, (int)nElements) != 0) {
+            status = asynError;
+        }
+        filterStatus();
+        callParamCallbacks();
+    }
+    else {
+        status = asynPortDriver::writeFloat64Array(pasynUser, value, nElements);
+    }
+    if (status)
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                  "%s:%s: status=%d, function=%d, nElements=%d",
+                  driverName, functionName, status, function, (int)nElements);
+    else
+        asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+              "%s:%s: function=%d, nElements=%d\n",
+              driverName, functionName, function, (int)nElements);
+    return status;
+}
+
+/** Called when asyn clients call pasynOctet->write().
+  * FILTER_FILE loads the filter type and coefficients from the file.
+  * For all parameters it sets the value in the parameter library and calls any registered callbacks.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value Address of the string to write.
+  * \param[in] nChars Number of characters to write.
+  * \param[out] nActual Number of characters actually written. */
+asynStatus acq164AsynPortDriver::writeOctet(asynUser *pasynUser, const char *value,
+                                            size_t nChars, size_t *nActual)
+{
+    int function = pasynUser->reason;
+    asynStatus status = asynSuccess;
+    char fname[256];
+    const char *functionName = "writeOctet";
+
+    if (nChars >= sizeof(fname)) nChars = sizeof(fname)-1;
+    memcpy(fname, value, nChars);
+    fname[nChars] = '\0';
+
+    status = (asynStatus) setStringParam(function, fname);
+
+    if (function == P_FilterFile && fname[0]) {
+        if (filter.load(fname) < 0) {
+            status = asynError;
+        }
+        filterStatus();
+    }
+
+    callParamCallbacks();
+    *nActual = nChars;
+    if (status)
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                  "%s:%s: status=%d, function=%d, value=%s",
+                  driverName, functionName, status, function, fname);
+    else
+        asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+              "%s:%s: function=%d, value=%s\n",
+              driverName, functionName, function, fname);
+    return status;
+}
+
+/** FILTER_ readbacks from the filter. Call with the port locked */
+void acq164AsynPortDriver::filterStatus()
+{
+	setIntegerParam(P_FilterType, filter.getType());
+	setIntegerParam(P_FilterNcoef, filter.getNcoef());
+}
+
+/** Publish each block as one NTNDArray on pvName, in addition to the per channel arrays */
+int acq164AsynPortDriver::setPvaOutput(const char *pvName)
+{
+	PvaPublisher *pub = PvaPublisher::create(pvName, nchan, get_maxPoints());
+	if (pub == 0){
+		return asynError;
+	}
+	pva = pub;
+	return asynSuccess;
+}
+
+/** Add the spectrum engine: nfft point spectra of every active channel on nworkers threads */
+int acq164AsynPortDriver::setSpectrum(int nfft, int nworkers)
+{
+	if (spec){
+		fprintf(stderr, "%s:%s: %s spectrum already configured\n", driverName, __FUNCTION__, portName);
+		return asynError;
+	}
+	if (nfft < 16 || nfft > (1<<20) || (nfft & (nfft-1))){
+		fprintf(stderr, "%s:%s: %s nfft %d must be a power of 2, 16..2^20\n", driverName, __FUNCTION__, portName, nfft);
+		return asynError;
+	}
+	if (pDataPool_ == 0){
+		fprintf(stderr, "%s:%s: %s spectrum needs OUTPUT_VOLTS\n", driverName, __FUNCTION__, portName);
+		return asynError;
+	}
+	spec_list = new int[nchan];
+	Spectrum *sp = new Spectrum(portName, nchan, nfft, nworkers, spectrum_result, this);
+	pSpecFreq_ = (epicsFloat64 *)calloc(sp->bins(), sizeof(epicsFloat64));
+
+	lock();
+	epicsAtomicSetPtrT((EpicsAtomicPtrT *)&spec, sp);
+	configureSpectrum();
+	setIntegerParam(P_SpecNfft, nfft);
+	callParamCallbacks();
+	unlock();
+	return asynSuccess;
+}
+
+/** SPEC_ settings to the engine. Call with the port locked */
+void acq164AsynPortDriver::configureSpectrum()
+{
+	int window, avg_mode, avg_n;
+
+	if (spec == 0){
+		return;
+	}
+	getIntegerParam(P_SpecWindow, &window);
+	getIntegerParam(P_SpecAvgMode, &avg_mode);
+	getIntegerParam(P_SpecAvgN, &avg_n);
+	spec->configure(window, avg_mode, avg_n);
+}
+
+/** Spectrum thread: an average is ready */
+void acq164AsynPortDriver::spectrumResult()
+{
+	const int nw = maskChannels(spec->mask(), nchan, spec_list);
+	const int nbins = spec->bins();
+	const int rate = epicsAtomicGetIntT(&sample_clock);
+
+	epicsTimeStamp ts;
+	sampleTime(spec->sample(), &ts);
+	lock();
+	setTimeStamp(&ts);
+	if (rate != spec_rate){
+		for (int m = 0; m < nbins; ++m){
+			pSpecFreq_[m] = (double)m*rate/spec->size();
+		}
+		spec_rate = rate;
+	}
+	setIntegerParam(P_SpecAverages, spec->getAverages());
+	setIntegerParam(P_SpecOverruns, epicsAtomicGetIntT(&spec->overruns));
+	callParamCallbacks();
+	doCallbacksFloat64Array(pSpecFreq_, nbins, P_SpecFreq, 0);
+	for (int k = 0; k < nw; ++k){
+		doCallbacksFloat64Array((epicsFloat64 *)spec->power(k), nbins, P_SpecPower, spec_list[k]);
+	}
+	unlock();
+}
+
+/** Add the compressed output: each raw block, encoded per COMP_CODEC, as COMP_WAVEFORM */
+int acq164AsynPortDriver::setCompressor()
+{
+	if (comp){
+		fprintf(stderr, "%s:%s: %s compressor already configured\n", driverName, __FUNCTION__, portName);
+		return asynError;
+	}
+	if (pRawPool_ == 0){
+		fprintf(stderr, "%s:%s: %s compressor needs OUTPUT_RAW\n", driverName, __FUNCTION__, portName);
+		return asynError;
+	}
+	Compressor *cp = new Compressor(portName, nchan, get_maxPoints(), compress_result, this);
+
+	lock();
+	comp = cp;
+	configureCompressor();
+	setIntegerParam(P_CompEnabled, 1);
+	callParamCallbacks();
+	unlock();
+	return asynSuccess;
+}
+
+/** COMP_ settings to the compressor. Call with the port locked.
+ *  returns asynError for a codec not built in, which is turned off */
+int acq164AsynPortDriver::configureCompressor()
+{
+	int codec, level;
+
+	getIntegerParam(P_CompCodec, &codec);
+	getIntegerParam(P_CompLevel, &level);
+	if (codec != COMP_OFF && !comp_have_codec(codec)){
+		fprintf(stderr, "%s:%s: %s codec %d not built in\n", driverName, __FUNCTION__, portName, codec);
+		codec = COMP_OFF;
+		setIntegerParam(P_CompCodec, codec);
+		if (comp){
+			comp->configure(codec, level);
+		}
+		return asynError;
+	}
+	if (comp){
+		comp->configure(codec, level);
+	}
+	return asynSuccess;
+}
+
+/** Compressor thread: a block is encoded */
+void acq164AsynPortDriver::compressResult()
+{
+	lock();
+	setTimeStamp(&comp->timeStamp());
+	setIntegerParam(P_CompBytes, comp->length());
+	setDoubleParam(P_CompRatio, comp->getRatio());
+	setDoubleParam(P_CompEncodeUs, comp->getEncodeUs());
+	setIntegerParam(P_CompOverruns, epicsAtomicGetIntT(&comp->overruns));
+	callParamCallbacks();
+	doCallbacksInt8Array((epicsInt8 *)comp->data(), comp->length(), P_CompWaveform, 0);
+	unlock();
+}
+
+/** Add the trigger engine: events of up to maxSamples, pre + post, nevents deep */
+int acq164AsynPortDriver::setTrigger(int maxSamples, int nevents)
+{
+	if (trig){
+		fprintf(stderr, "%s:%s: %s trigger already configured\n", driverName, __FUNCTION__, portName);
+		return asynError;
+	}
+	if (maxSamples < 2 || maxSamples > (1<<20)){
+		fprintf(stderr, "%s:%s: %s max samples %d outside 2..2^20\n", driverName, __FUNCTION__, portName, maxSamples);
+		return asynError;
+	}
+	Trigger *tg = new Trigger(nchan, maxSamples, nevents);
+	pTrigTime_ = (epicsFloat64 *)calloc(maxSamples, sizeof(epicsFloat64));
+
+	lock();
+	epicsAtomicSetPtrT((EpicsAtomicPtrT *)&trig, tg);
+	setIntegerParam(P_TrigMax, maxSamples);
+	callParamCallbacks();
+	unlock();
+	return asynSuccess;
+}
+
+/** Publisher: every trigger event on offer as one set of TRIG_WAVEFORM,
+ *  stamped with the time of its trigger sample */
+void acq164AsynPortDriver::publishTrigger(int *list)
+{
+	Trigger *tg = (Trigger *)epicsAtomicGetPtrT((EpicsAtomicPtrT *)&trig);
+	int ib;
+
+	if (tg == 0){
+		return;
+	}
+	while ((ib = tg->take()) >= 0){
+		const int nw = maskChannels(tg->mask(ib), nchan, list);
+		const int len = tg->length(ib);
+		const int rate = epicsAtomicGetIntT(&sample_clock);
+		epicsTimeStamp ts;
+		sampleTime(tg->sample(ib), &ts);
+
+		lock();
+		if (rate != trig_time_rate || tg->pre(ib) != trig_time_pre || len != trig_time_len){
+			for (int id = 0; id < len; ++id){
+				pTrigTime_[id] = rate? (double)(id - tg->pre(ib))/rate: 0;
+			}
+			trig_time_rate = rate;
+			trig_time_pre = tg->pre(ib);
+			trig_time_len = len;
+		}
+		setTimeStamp(&ts);
+		setDoubleParam(P_TrigSample, tg->sample(ib));
+		callParamCallbacks();
+		doCallbacksFloat64Array(pTrigTime_, len, P_TrigTimeBase, 0);
+		for (int k = 0; k < nw; ++k){
+			doCallbacksFloat64Array((epicsFloat64 *)tg->wave(ib, k), len, P_TrigWaveform, list[k]);
+		}
+		unlock();
+		tg->release(ib);
+	}
+	lock();
+	setIntegerParam(P_TrigEvents, epicsAtomicGetIntT(&tg->events_total));
+	setIntegerParam(P_TrigDropped, epicsAtomicGetIntT(&tg->dropped));
+	callParamCallbacks();
+	unlock();
+}
+
+/** start the recorder from the REC_ params. Call with the port locked */
+int acq164AsynPortDriver::startRecorder()
+{
+	char root[200];
+	int format;
+	int rotate_mb;
+	int odirect;
+
+	getStringParam(P_RecRoot, sizeof(root), root);
+	getIntegerParam(P_RecFormat, &format);
+	getIntegerParam(P_RecRotateMB, &rotate_mb);
+	getIntegerParam(P_RecODirect, &odirect);
+	return recorder.start(root, format, rotate_mb, odirect != 0) == 0? asynSuccess: asynError;
+}
+
+/** Record raw data to disk from now on, as if written to the REC_ params */
+int acq164AsynPortDriver::setRecorder(const char *root, int format, int rotate_mb, int odirect)
+{
+	lock();
+	setStringParam(P_RecRoot, root);
+	setIntegerParam(P_RecFormat, format);
+	setIntegerParam(P_RecRotateMB, rotate_mb);
+	setIntegerParam(P_RecODirect, odirect);
+	int status = startRecorder();
+	setIntegerParam(P_RecEnable, status == asynSuccess);
+	callParamCallbacks();
+	unlock();
+	return status;
+}
+
+/** Recorder writer thread, once a second */
+void acq164AsynPortDriver::recorderStatus()
+{
+	RecorderStatus st;
+	recorder.getStatus(st);
+
+	lock();
+	setDoubleParam(P_RecMBps, st.mbps);
+	setIntegerParam(P_RecBacklog, st.backlog);
+	setIntegerParam(P_RecOverruns, st.overruns);
+	setIntegerParam(P_RecFilesets, st.filesets);
+	setIntegerParam(P_RecErrors, st.errors);
+	setStringParam(P_RecFile, st.file);
+	callParamCallbacks();
+	unlock();
+}
+
 asynStatus acq164AsynPortDriver::readEnum(asynUser *pasynUser, char *strings[], int values[], int severities[], size_t nElements, size_t *nIn)
 {
     //int function = pasynUser->reason;
@@ -299,25 +1488,87 @@ asynStatus acq164AsynPortDriver::readEnum(asynUser *pasynUser, char *strings[],
 #include "Frame.h"
 
 #include "DataStreamer.h"
-#include "DirfileFrameHandler.h"
+
+static void calibrator_runner(void *drvPvt);
 
 class Acq164Device: public acq164AsynPortDriver, FrameHandler {
 	int verbose;
-	int cursor;
+	int cursor;		/* write position in the fill buffer or sliding ring */
+	long long block_first;	/* sample number at cursor 0 */
+	long long clock_next;	/* next sample expected, -1: clock not anchored */
+	epicsUInt64 down_since;	/* monotonic ns the stream was lost, 0: streaming */
+
+	/* params onFrame() uses, reloaded by load_params() when param_gen moves */
+	int frame_gen;
+	int max_points;
+	int slide_frames;
+	double inst_interval;
+	int window_clock;	/* sample_clock the scalar and stats windows are set for */
+	TriggerSettings trig_set;
+	int fast_mask;		/* FAST_MASK, 0: no fast path */
+	int fast_mode;
+	bool frame_checked;	/* the stream delivers ConcreteFrame<int> */
+	void load_params();
 	virtual void onFrame(
 			Acq2xx& _card, const AcqType& _acqType,
 			const Frame* frame);
-
-	double* eslo;
-	double* eoff;
-
-	void compute_cal(Acq2xx& card);
-	void setup(Acq2xx& card);
+	const int** frame_chan;	/* the live frame's channels, as a RawFrame */
+	bool processFrame(const RawFrame *cf);
+	void end_frame();
+	epicsFloat64* fast_values;	/* [nchan] FAST_VALUE */
+	void fast_path(const RawFrame *cf, long long sample);
+
+	int wf_mode;
+	bool ring_full;
+	int frames_since_publish;
+	epicsFloat64* ring_data;	/* WF_MODE_SLIDING: per channel ring of maxPoints */
+	epicsInt32* ring_raw;
+	epicsFloat64* ring_filt;
+
+	void accumulate(const RawFrame *cf, int r0, int n);
+	void convert(const RawFrame *cf, int r0, int n,
+			epicsFloat64* data, epicsInt32* rawbuf, epicsFloat64* filt, int maxPoints);
+	void set_wf_mode(int mode, int maxPoints);
+	void set_chan_mask(int mask, int maxPoints);
+	void trigger(const RawFrame *cf, long long sample);
+	void publish_ring(int maxPoints, long long sample);
+	long long scalar_window();
+	void publish_scalars(long long s);
+	long long bank_window[NUM_STATS_BANKS];	/* samples, 0: off */
+	void set_bank_windows();
+	long long close_windows(long long s);
+
+	const double* eslo;	/* cal_live as of this frame */
+	const double* eoff;
+	void load_cal();
+
+	/* recorded frames in place of the card, see acq164ReplayConfigure */
+	Replay* replay;
+	const double replay_speed;	/* x real time, 0: as fast as possible */
+
+	int compute_cal(Acq2xx& card, acq2xx_VRange* ranges, double* cal);
+	bool cal_in_use(double* cal);
+	int setup(Acq2xx& card);
+	void stream(Acq2xx& card);
+	void replay_stream();
+	bool check_integrity(const RawFrame *cf, long long sample);
 public:
-	Acq164Device(const char *portName, int maxArraySize, int nchan) :
-		acq164AsynPortDriver(portName, maxArraySize, nchan),
-		cursor(0)
+	Acq164Device(const char *portName, int maxArraySize, int nchan, int outputs,
+			int cpumask, int priority, int hugepages, Replay* _replay, double speed) :
+		acq164AsynPortDriver(portName, maxArraySize, nchan, outputs, cpumask, priority, hugepages),
+		cursor(0), block_first(0), clock_next(-1), down_since(0),
+		frame_gen(0), max_points(0), slide_frames(1), inst_interval(1.0),
+		window_clock(0), fast_mask(0), fast_mode(FAST_LAST),
+		frame_checked(false), frame_chan(new const int*[nchan]),
+		fast_values(new epicsFloat64[nchan]()),
+		wf_mode(WF_MODE_BLOCK), ring_full(false), frames_since_publish(0),
+		ring_data(0), ring_raw(0), ring_filt(0),
+		eslo(0), eoff(0),
+		replay(_replay), replay_speed(speed)
 	{
+		for (int ib = 0; ib < NUM_STATS_BANKS; ++ib){
+			bank_window[ib] = 0;
+		}
 		const char* key = ::getenv("ACQ164DEVICE_VERBOSE");
 		if (key){
 			verbose = ::strtoul(key, 0, 0);
@@ -326,10 +1577,28 @@ public:
 		if (key){
 			acq200_debug = ::strtoul(key, 0, 0);
 		}
+		/* a replay's calibration comes from the file, in task().
+		 * No calibration buffers: the base port is disabled */
+		if (replay == 0 && pCal_){
+			char tname[32];
+			epicsSnprintf(tname, sizeof(tname), "%s.cal", portName);
+			if (epicsThreadCreate(tname,
+					epicsThreadPriorityLow,
+					epicsThreadGetStackSize(epicsThreadStackMedium),
+					(EPICSTHREADFUNC)::calibrator_runner, this) == NULL){
+				printf("%s:%s: epicsThreadCreate failure\n", driverName, __FUNCTION__);
+			}
+		}
 	}
 	virtual void task();
+	void calibrator();
 };
 
+static void calibrator_runner(void *drvPvt)
+{
+	((Acq164Device *)drvPvt)->calibrator();
+}
+
 /*
  *  y = mx + c
  *  (y - Y1)/(x-X1) = (Y2-Y1)/(X2-X1)
@@ -340,127 +1609,686 @@ public:
  *  ESLO = (Y2-Y1)/(X2-X1) = (Y2-Y1)/(1<<24)
  *  EOFF = Y1 -X1*ESLO
  */
-void Acq164Device::compute_cal(Acq2xx& card)
+int Acq164Device::compute_cal(Acq2xx& card, acq2xx_VRange* ranges, double* cal)
 {
-	acq2xx_VRange* ranges = new acq2xx_VRange[nchan+2];  /* +2? Bug in getChannelRanges() ? */
-	eslo = new double[nchan];
-	eoff = new double[nchan];
 	int X1 = -(1<<23);
 	int X2 = 1<<23;
 
 	if (verbose) printf("nchan:%d\n", nchan);
 
-	card.getChannelRanges(ranges, nchan+1);
+	if (card.getChannelRanges(ranges, nchan+1) != STATUS_OK){
+		return -1;
+	}
 	for (int ii = 0; ii < nchan; ++ii){
 		double Y1 = ranges[ii+1].vmin;
 		double Y2 = ranges[ii+1].vmax;
 		double ESLO = (Y2-Y1)/(X2-X1);
 		double EOFF = Y1 - X1*ESLO;
 		if (verbose) printf("[%2d] Y1:%.2f Y2:%.2f %x ESLO:%.5g EOFF:%.5f\n", ii, Y1, Y2, X2-X1, ESLO, EOFF);
-		eslo[ii] = ESLO;
-		eoff[ii] = EOFF;
+		cal[ii] = ESLO;
+		cal[nchan+ii] = EOFF;
 	}
+	return 0;
+}
 
-	delete[] ranges;
+/** true while the streaming thread may still be reading cal: it has not
+ *  yet seen the live calibration, and it is streaming */
+bool Acq164Device::cal_in_use(double* cal)
+{
+	return (double *)epicsAtomicGetPtrT((EpicsAtomicPtrT *)&cal_seen) == cal &&
+		epicsAtomicGetIntT(&card_state) == CARD_STREAMING;
 }
 
-void Acq164Device::setup(Acq2xx& card)
+/** Calibration thread: on CAL_REFRESH, and each time task() connects, read
+ *  the channel ranges over a connection of its own, build them in the spare
+ *  and swap it in. A blocking round trip to the card, so never on the
+ *  streaming thread, which runs on the previous calibration meanwhile */
+void Acq164Device::calibrator()
+{
+	acq2xx_VRange* ranges = new acq2xx_VRange[nchan+2];  /* +2? Bug in getChannelRanges() ? */
+
+	while(1){
+		epicsEventWait(calEventId_);
+		double* cal = spareCal();
+		/* the previous swap, if any, has to be picked up first */
+		for (int ms = 0; cal_in_use(cal) && ms < 2000; ms += 10){
+			epicsThreadSleep(0.01);
+		}
+		if (cal_in_use(cal)){
+			printf("%s %s stream stalled, calibration not replaced\n", __FUNCTION__, portName);
+			continue;
+		}
+		Transport *t = Transport::getTransport(portName);
+		if (t == 0){
+			printf("%s %s no transport, calibration not replaced\n", __FUNCTION__, portName);
+			continue;
+		}
+		Acq2xx card(t);
+		if (compute_cal(card, ranges, cal) == 0){
+			installCal(cal, 1);
+		}else{
+			fprintf(stderr, "ERROR: %s %s failed to get channel ranges\n", __FUNCTION__, portName);
+		}
+		delete t;
+	}
+}
+
+/** streaming thread, start of a frame: pick up a new calibration. A pointer
+ *  read, no lock */
+void Acq164Device::load_cal()
+{
+	double* cal = (double *)epicsAtomicGetPtrT((EpicsAtomicPtrT *)&cal_live);
+	if (cal != eslo){
+		epicsAtomicReadMemoryBarrier();
+		eslo = cal;
+		eoff = cal+nchan;
+		epicsAtomicSetPtrT((EpicsAtomicPtrT *)&cal_seen, cal);
+	}
+}
+
+/** configure and arm the card if it is stopped: a card still running after
+ *  a reconnect is left alone. returns 1 if armed, 0 if running, -1 if the
+ *  card can't be read */
+int Acq164Device::setup(Acq2xx& card)
 {
 	enum STATE state;
 	if (card.getState(state) != STATUS_OK){
-		fprintf(stderr, "ERROR: failed to get state\n");
-		exit(1);
+		fprintf(stderr, "ERROR: %s failed to get state\n", portName);
+		return -1;
 	}
 	if (state != ST_STOP){
 		fprintf(stderr, "card state:%d let it run, or abort if you want it to be reconfigured\n", state);
-		return;
+		return 0;
 	}
 
 	char response[80];
+	char command[80];
+	int sample_rate;
+
+	getIntegerParam(P_SampleRate, &sample_rate);
+	epicsSnprintf(command, 80, "set.acq164.role MASTER %d", sample_rate/1000);
 
 	card.getTransport()->acq2sh("set.dtacq channel_mask 1", response, 80);
-	card.getTransport()->acq2sh("set.acq164.role MASTER 20", response, 80);
+	card.getTransport()->acq2sh(command, response, 80);
+	/* the card clocks in whole kHz */
+	epicsAtomicSetIntT(&sample_clock, sample_rate/1000*1000);
 	card.getTransport()->acqcmd("setMode SOFT_CONTINUOUS 1", response, 80);
 	card.getTransport()->acqcmd("setArm", response, 80);
+	return 1;
 }
 
-void Acq164Device::onFrame(
-		Acq2xx& _card, const AcqType& _acqType,
-		const Frame* frame)
+/** check the frame, INTEG_ settings from load_params(). A card stuck on
+ *  zeros for INTEG_RESTART frames is to be aborted: returns true once,
+ *  onFrame() sends the abort, streamData() returns and task() arms it again */
+bool Acq164Device::check_integrity(const RawFrame *cf, long long sample)
 {
-	const ConcreteFrame<int> *cf =
-				dynamic_cast<const ConcreteFrame<int> *>(frame);
-	const int maxPoints = get_maxPoints();
+	integ.window = epicsAtomicGetIntT(&sample_clock)/FRAME_SAMPLES;
+	if (integ.window < 1){
+		integ.window = 1;
+	}
+	if (integ.check(cf, sample, active, nactive) && !epicsAtomicGetIntT(&restart_pending)){
+		printf("%s %s zeros for %d frames at %lld, restarting the stream\n",
+				__FUNCTION__, portName, integ.restart_frames, sample);
+		epicsAtomicSetIntT(&restart_pending, 1);
+		return true;
+	}
+	return false;
+}
 
-	for (int ic = 0; ic < nchan; ++ic){
-		int ix0 = ic*maxPoints;
-		int consecutive_zeros = 0;
-		const int* raw = cf->getChannel(ic+1);
-		for (int id = 0; id < FRAME_SAMPLES; ++id){
-			int yy = raw[id];
-			if (yy == 0){
-				if (++consecutive_zeros > 60){
-					printf("%s zeros detected at %lld\n", __FUNCTION__, cf->getStartSampleNumber());
-					exit(1);
-				}
+/** Streaming thread: take a consistent copy of every param onFrame() uses,
+ *  and apply the ones that changed. The generation is read first, so a
+ *  write during the copy is picked up on the next frame */
+void Acq164Device::load_params()
+{
+	const int gen = epicsAtomicGetIntT(&param_gen);
+	int mask;
+	int mode;
+	int dec_factor;
+	int dec_mode;
+
+	lock();
+	max_points = get_maxPoints();
+	getIntegerParam(P_ChanMask, &mask);
+	getIntegerParam(P_WfMode, &mode);
+	getIntegerParam(P_WfSlideFrames, &slide_frames);
+	getIntegerParam(P_DecFactor, &dec_factor);
+	getIntegerParam(P_DecMode, &dec_mode);
+	getDoubleParam(P_InstInterval, &inst_interval);
+	window_clock = epicsAtomicGetIntT(&sample_clock);
+	acc.setWindow(scalar_window());
+	set_bank_windows();
+	getIntegerParam(P_IntegEvery, &integ.every);
+	getIntegerParam(P_IntegZeroRun, &integ.zero_limit);
+	getIntegerParam(P_IntegRestart, &integ.restart_frames);
+	getIntegerParam(P_TrigMode, &trig_set.mode);
+	getIntegerParam(P_TrigChannel, &trig_set.channel);
+	getIntegerParam(P_TrigSlope, &trig_set.slope);
+	getDoubleParam(P_TrigLevel, &trig_set.level);
+	getDoubleParam(P_TrigHyst, &trig_set.hyst);
+	getIntegerParam(P_TrigPre, &trig_set.pre);
+	getIntegerParam(P_TrigPost, &trig_set.post);
+	getIntegerParam(P_FastMask, &fast_mask);
+	getIntegerParam(P_FastMode, &fast_mode);
+	unlock();
+	frame_gen = gen;
+
+	/* these take the port lock themselves */
+	if (mask != chan_mask){
+		set_chan_mask(mask, max_points);
+	}
+	if (mode != wf_mode){
+		set_wf_mode(mode, max_points);
+	}
+	if (dec_factor != dec.getFactor() || dec_mode != dec.getMode()){
+		dec.configure(dec_factor, dec_mode);
+	}
+}
+
+/** scalar and stats sums for n samples per active channel from frame offset r0 */
+void Acq164Device::accumulate(const RawFrame *cf, int r0, int n)
+{
+	for (int k = 0; k < nactive; ++k){
+		const int ic = active[k];
+		const int* raw = cf->getChannel(ic+1) + r0;
+		long long rsum;
+		double rsumsq;
+		int rmin, rmax;
+
+		raw_stats(raw, n, &rsum, &rsumsq, &rmin, &rmax);
+		acc.add_raw(ic, eslo[ic], eoff[ic], n, rsum, rsumsq, rmin, rmax);
+		for (int ib = 0; ib < NUM_STATS_BANKS; ++ib){
+			if (bank_window[ib]){
+				banks[ib]->stats.add_raw(ic, eslo[ic], eoff[ic], n, rsum, rsumsq, rmin, rmax);
+			}
+		}
+	}
+	acc.count(n);
+	for (int ib = 0; ib < NUM_STATS_BANKS; ++ib){
+		if (bank_window[ib]){
+			banks[ib]->stats.count(n);
+		}
+	}
+}
+
+/** convert n samples per active channel from frame offset r0 to buffers data, rawbuf, filt at cursor */
+void Acq164Device::convert(const RawFrame *cf, int r0, int n,
+		epicsFloat64* data, epicsInt32* rawbuf, epicsFloat64* filt, int maxPoints)
+{
+	for (int k = 0; k < nactive; ++k){
+		const int ic = active[k];
+		int ix0 = k*maxPoints + cursor;
+		const int* raw = cf->getChannel(ic+1) + r0;
+
+		if (data){
+			calibrate_channel(data+ix0, raw, n, eslo[ic], eoff[ic]);
+			if (dec.enabled()){
+				dec.decimate(ic, data+ix0, n);
 			}
-			double volts = eslo[ic]*yy + eoff[ic];
-			pData_[ix0+cursor+id] = volts;
-			acc.set(ic, volts);
 		}
+		if (rawbuf){
+			memcpy(rawbuf+ix0, raw, n*sizeof(int));
+		}
+	}
+	if (filt){
+		filter.process(filt+cursor, data+cursor, maxPoints, n, nactive, chan_mask);
+	}
+	Spectrum *sp = (Spectrum *)epicsAtomicGetPtrT((EpicsAtomicPtrT *)&spec);
+	if (data && sp){
+		sp->feed(data+cursor, maxPoints, n, nactive, chan_mask, block_first + cursor);
+	}
+	const long long s0 = block_first + cursor;
+	cursor += n;
+
+	if (data && dec.enabled() && dec.commit(n, s0, chan_mask)){
+		epicsEventSignal(publishEventId_);
+	}
+}
+
+/** WF_MODE changed: start a new window. The sliding ring pages fault in on first use */
+void Acq164Device::set_wf_mode(int mode, int maxPoints)
+{
+	if (mode == WF_MODE_SLIDING){
+		ring_data = pRingData_;
+		ring_raw = pRingRaw_;
+		ring_filt = pRingFilt_;
 	}
-	cursor += FRAME_SAMPLES;
+	wf_mode = mode;
+	cursor = 0;
+	ring_full = false;
+	frames_since_publish = 0;
+}
 
+/** CHAN_MASK changed: restart the waveform, decimation and scalar windows
+ *  so that no block mixes channel sets */
+void Acq164Device::set_chan_mask(int mask, int maxPoints)
+{
+	epicsAtomicSetIntT(&chan_mask, mask);
+	nactive = maskChannels(mask, nchan, active);
+	set_wf_mode(wf_mode, maxPoints);
+	if (dec.enabled()){
+		dec.configure(dec.getFactor(), dec.getMode());
+	}
+	acc.clear();
+	for (int ib = 0; ib < NUM_STATS_BANKS; ++ib){
+		banks[ib]->stats.clear();
+	}
+
+	lock();
+	setIntegerParam(P_ChanActive, nactive);
+	callParamCallbacks();
+	unlock();
+}
+
+/** run the trigger engine on the frame, with the TRIG_ settings from load_params() */
+void Acq164Device::trigger(const RawFrame *cf, long long sample)
+{
+	Trigger *tg = (Trigger *)epicsAtomicGetPtrT((EpicsAtomicPtrT *)&trig);
+
+	if (tg == 0){
+		return;
+	}
+	tg->configure(trig_set);
+	if (tg->onFrame(cf, sample, active, nactive, chan_mask, eslo, eoff)){
+		epicsEventSignal(publishEventId_);
+	}
+}
+
+/** copy the sliding ring, oldest sample first, to the fill buffer and publish it */
+void Acq164Device::publish_ring(int maxPoints, long long sample)
+{
+	const int n1 = maxPoints - cursor;
+	for (int k = 0; k < nactive; ++k){
+		int ix0 = k*maxPoints;
+		if (pData_){
+			memcpy(pData_+ix0, ring_data+ix0+cursor, n1*sizeof(epicsFloat64));
+			memcpy(pData_+ix0+n1, ring_data+ix0, cursor*sizeof(epicsFloat64));
+		}
+		if (pRaw_){
+			memcpy(pRaw_+ix0, ring_raw+ix0+cursor, n1*sizeof(epicsInt32));
+			memcpy(pRaw_+ix0+n1, ring_raw+ix0, cursor*sizeof(epicsInt32));
+		}
+		if (pFilt_){
+			memcpy(pFilt_+ix0, ring_filt+ix0+cursor, n1*sizeof(epicsFloat64));
+			memcpy(pFilt_+ix0+n1, ring_filt+ix0, cursor*sizeof(epicsFloat64));
+		}
+	}
+	publishBuffer(sample, sample + FRAME_SAMPLES - maxPoints);
+}
+
+/** scalar window in samples: SCAN_PERIOD s if set, else 1/SCAN_FREQ,
+ *  at window_clock */
+long long Acq164Device::scalar_window()
+{
+	const int sample_rate = window_clock;
 	int scan_freq;
+	double scan_period;
+
+	getDoubleParam(P_ScanPeriod, &scan_period);
+	if (scan_period > 0){
+		return (long long)(scan_period*sample_rate + 0.5);
+	}
 	getIntegerParam(P_ScanFreq, &scan_freq);
+	return scan_freq > 0? sample_rate/scan_freq: sample_rate;
+}
 
-	if (acc.update_timestamp(NSPS/scan_freq)){
-		for (int ic = 0; ic < nchan; ++ic){
-			if (verbose && ic < 3) printf("setDoubleParam(%d %d %f\n", ic, P_Scalar, acc.get(ic));
-			setDoubleParam(ic, P_Scalar, acc.get(ic));
-			callParamCallbacks(ic);
+/** scalar window done at sample s: hand the tick to the publisher */
+void Acq164Device::publish_scalars(long long s)
+{
+	epicsFloat64* rr = scalarBuffer(scalar_ib);
+
+	for (int ic = 0; ic < nchan; ++ic){
+		rr[SCALAR_MEAN*nchan+ic] = rr[SCALAR_MIN*nchan+ic] = rr[SCALAR_MAX*nchan+ic] = epicsNAN;
+	}
+	for (int k = 0; k < nactive; ++k){
+		const int ic = active[k];
+		if (verbose && ic < 3) printf("scalar(%d %f\n", ic, acc.get(ic));
+		rr[SCALAR_MEAN*nchan+ic] = acc.get(ic);
+		rr[SCALAR_MIN*nchan+ic] = acc.vmin[ic];
+		rr[SCALAR_MAX*nchan+ic] = acc.vmax[ic];
+	}
+	acc.clear();
+
+	int next = scalarPool.acquire(scalar_ib);
+	if (next < 0){
+		epicsAtomicIncrIntT(&publish_overruns);
+		return;
+	}
+	scalarSample_[scalar_ib] = s;
+	scalarMask_[scalar_ib] = chan_mask;
+	scalarPool.post(scalar_ib);
+	epicsEventSignal(publishEventId_);
+	scalar_ib = next;
+}
+
+/** stats bank windows from STATSn_RATE at window_clock, 0: bank off */
+void Acq164Device::set_bank_windows()
+{
+	const int sample_rate = window_clock;
+
+	for (int ib = 0; ib < NUM_STATS_BANKS; ++ib){
+		int rate;
+		getIntegerParam(P_StatsRate[ib], &rate);
+		long long window = rate > 0? sample_rate/rate: 0;
+		if (window && !bank_window[ib]){
+			banks[ib]->stats.clear();
+		}
+		bank_window[ib] = window;
+		if (window){
+			banks[ib]->stats.setWindow(window);
 		}
-		acc.clear();
 	}
+}
 
-	if (cursor >= maxPoints){
-		//printf("%s %lld\n", __FUNCTION__, cf->getStartSampleNumber());
-		setDoubleParam(P_UpdateTime, cf->getStartSampleNumber());
-		callParamCallbacks();
+/** publish any scalar or stats window complete at sample s.
+ *  returns samples to the nearest remaining window boundary */
+long long Acq164Device::close_windows(long long s)
+{
+	if (acc.remaining(s) <= 0){
+		publish_scalars(s);
+	}
+	long long left = acc.remaining(s);
 
-		for (int ic=0; ic< nchan; ic++){
-			int ix0 = ic*maxPoints;
-		  	doCallbacksFloat64Array(pData_+ix0, maxPoints, P_Waveform, ic);
+	for (int ib = 0; ib < NUM_STATS_BANKS; ++ib){
+		if (bank_window[ib] == 0){
+			continue;
+		}
+		if (banks[ib]->stats.remaining(s) <= 0 && banks[ib]->complete(s, chan_mask)){
+			epicsEventSignal(publishEventId_);
+		}
+		long long bl = banks[ib]->stats.remaining(s);
+		if (bl < left){
+			left = bl;
 		}
-		cursor = 0;
 	}
+	return left;
 }
 
+void Acq164Device::onFrame(
+		Acq2xx& _card, const AcqType& _acqType,
+		const Frame* frame)
+{
+	/* the frame type is fixed by the card: check it once */
+	if (!frame_checked){
+		if (dynamic_cast<const ConcreteFrame<int> *>(frame) == 0){
+			fprintf(stderr, "ERROR: %s %s frame is not ConcreteFrame<int>\n", __FUNCTION__, portName);
+			return;
+		}
+		frame_checked = true;
+	}
+	const ConcreteFrame<int> *lf = static_cast<const ConcreteFrame<int> *>(frame);
+	for (int ic = 0; ic < nchan; ++ic){
+		frame_chan[ic] = lf->getChannel(ic+1);
+	}
+	const RawFrame rf(frame_chan, lf->getStartSampleNumber());
+	if (processFrame(&rf)){
+		char response[80];
+		_card.getTransport()->acqcmd("setAbort", response, 80);
+	}
+	end_frame();
+}
 
+/** the pipeline, one frame, live or replayed. returns true if the stream
+ *  is to be restarted, see check_integrity() */
+bool Acq164Device::processFrame(const RawFrame *cf)
+{
+	/* the windows follow the rate applied to the card, not SAMPLE_RATE */
+	if (epicsAtomicGetIntT(&param_gen) != frame_gen ||
+			epicsAtomicGetIntT(&sample_clock) != window_clock){
+		load_params();
+	}
+	load_cal();
+	const int maxPoints = max_points;
+	const long long sample = cf->getStartSampleNumber();
+	unsigned long long t = inst.frameStart(sample, FRAME_SAMPLES);
+	epicsAtomicIncrIntT(&card_frames);
+	if (down_since){
+		int ms = (int)((epicsMonotonicGet() - down_since)/1000000);
+		epicsAtomicSetIntT(&downtime_ms, ms);
+		epicsAtomicAddIntT(&downtime_total_ms, ms);
+		down_since = 0;
+	}
+#ifdef __linux__
+	epicsAtomicSetIntT(&card_cpu, sched_getcpu());
+#endif
+	/* timestamps count samples on from the first frame, which ends now */
+	if (clock_next < 0 || sample < clock_next - FRAME_SAMPLES){
+		setClock(sample + FRAME_SAMPLES);
+	}
+	clock_next = sample + FRAME_SAMPLES;
+	if (fast_mask){
+		fast_path(cf, sample);
+	}
 
-void Acq164Device::task(void)
+	t = inst_ticks();
+	const bool restart = check_integrity(cf, sample);
+	t = inst.add(INST_INTEG, t);
+	trigger(cf, sample);
+	inst.add(INST_TRIG, t);
+
+	/* neither waveform nor scalar windows need be a multiple of the frame:
+	 * split the frame at each boundary */
+	for (int r0 = 0; r0 < FRAME_SAMPLES; ){
+		t = inst_ticks();
+		long long left = close_windows(sample + r0);
+		t = inst.add(INST_CB, t);
+		int n = FRAME_SAMPLES - r0;
+		if (n > maxPoints - cursor){
+			n = maxPoints - cursor;
+		}
+		if (n > left){
+			n = left;
+		}
+		if (cursor == 0){
+			block_first = sample + r0;
+		}
+		accumulate(cf, r0, n);
+		t = inst.add(INST_ACC, t);
+		if (wf_mode == WF_MODE_SLIDING){
+			convert(cf, r0, n, ring_data, ring_raw, ring_filt, maxPoints);
+		}else{
+			convert(cf, r0, n, pData_, pRaw_, pFilt_, maxPoints);
+		}
+		t = inst.add(INST_CONV, t);
+		r0 += n;
+
+		if (cursor >= maxPoints){
+			cursor = 0;
+			if (wf_mode == WF_MODE_SLIDING){
+				ring_full = true;
+			}else{
+				//printf("%s %lld\n", __FUNCTION__, sample);
+				publishBuffer(sample, block_first);
+				inst.add(INST_CB, t);
+			}
+		}
+	}
+	t = inst_ticks();
+	close_windows(sample + FRAME_SAMPLES);
+
+	if (wf_mode == WF_MODE_SLIDING && ring_full && ++frames_since_publish >= slide_frames){
+		publish_ring(maxPoints, sample);
+		frames_since_publish = 0;
+	}
+	t = inst.add(INST_CB, t);
+
+	const int nt = epicsAtomicGetIntT(&ntaps);
+	epicsAtomicReadMemoryBarrier();
+	for (int it = 0; it < nt; ++it){
+		taps[it]->onFrame(*cf);
+	}
+	inst.add(INST_TAPS, t);
+	return restart;
+}
+
+/** FAST_VALUE for the FAST_MASK channels before anything else is done with
+ *  the frame: feedback waits one frame, not a waveform or a SCAN window.
+ *  Time stamped at the sample it stands for */
+void Acq164Device::fast_path(const RawFrame *cf, long long sample)
+{
+	for (int ic = 0; ic < nchan && ic < 32; ++ic){
+		if (fast_mask & (1u << ic)){
+			const int* raw = cf->getChannel(ic+1);
+			double yy;
+			if (fast_mode == FAST_MEAN){
+				long long sum = 0;
+				for (int id = 0; id < FRAME_SAMPLES; ++id){
+					sum += raw[id];
+				}
+				yy = (double)sum/FRAME_SAMPLES;
+			}else{
+				yy = raw[FRAME_SAMPLES-1];
+			}
+			fast_values[ic] = eslo[ic]*yy + eoff[ic];
+		}
+	}
+	epicsTimeStamp ts;
+	sampleTime(fast_mode == FAST_MEAN? sample + FRAME_SAMPLES/2: sample + FRAME_SAMPLES-1, &ts);
+	fastCallbacks(fast_mask, fast_values, ts);
+	inst.fastDone();
+}
+
+void Acq164Device::end_frame()
 {
-	Transport *t = Transport::getTransport(portName);
-	Acq2xx card(t);
-	DataStreamer* dataStreamer = DataStreamer::create(
-				card, AcqType::getAcqType(card));
-	compute_cal(card);
-	setup(card);
-	dataStreamer->addFrameHandler(this);
+	if (inst.frameEnd(inst_interval)){
+		epicsEventSignal(publishEventId_);
+	}
+}
+
+
+
+/** stream from a connected card, once, and again each time
+ *  check_integrity() aborts a stuck card. Returns when the stream is lost */
+void Acq164Device::stream(Acq2xx& card)
+{
+	do {
+		epicsAtomicSetIntT(&restart_pending, 0);
+		DataStreamer* dataStreamer = DataStreamer::create(
+					card, AcqType::getAcqType(card));
+		epicsAtomicSetIntT(&card_state, CARD_SETUP);
+		int armed = setup(card);
+		if (armed < 0){
+			delete dataStreamer;
+			return;
+		}
+		if (armed){
+			/* sample numbers start again */
+			integ.reset();
+		}
+		dataStreamer->addFrameHandler(this);
+		dataStreamer->addFrameHandler(&recorder);
 /*
-	dataStreamer->addFrameHandler(
-				DataStreamer::createMeanHandler(
-					AcqType::getAcqType(card), 1));
-	dataStreamer->addFrameHandler(
-				DataStreamer::createNewlineHandler());
+		dataStreamer->addFrameHandler(
+					DataStreamer::createMeanHandler(
+						AcqType::getAcqType(card), 1));
+		dataStreamer->addFrameHandler(
+					DataStreamer::createNewlineHandler());
 */
-	dataStreamer->streamData();
+		epicsAtomicSetIntT(&card_state, CARD_STREAMING);
+		dataStreamer->streamData();
+		delete dataStreamer;
+	} while (epicsAtomicGetIntT(&restart_pending) && epicsAtomicIncrIntT(&integ_restarts));
+}
+
+/** Replay in place of the card: frames through the same pipeline at
+ *  replay_speed x SAMPLE_RATE, 0: as fast as they can be processed, with
+ *  the INST_ rates and phase times showing what that is. A change to
+ *  SAMPLE_RATE restarts the pacing. A frame that would restart a card
+ *  restarts the integrity checks only.
+ *  Returns at the end of the file, never if it loops */
+void Acq164Device::replay_stream()
+{
+	int gen = -1;
+	double ns_per_sample = 0;
+	epicsUInt64 t0 = 0;
+	long long paced = 0;
+	long long nsam = 0;
+	RawFrame rf;
+
+	epicsAtomicSetIntT(&card_state, CARD_STREAMING);
+	while (replay->next(rf)){
+		if (epicsAtomicGetIntT(&param_gen) != gen){
+			int sample_rate;
+			gen = epicsAtomicGetIntT(&param_gen);
+			lock();
+			getIntegerParam(P_SampleRate, &sample_rate);
+			unlock();
+			epicsAtomicSetIntT(&sample_clock, sample_rate);
+			ns_per_sample = replay_speed > 0 && sample_rate > 0? 1e9/(sample_rate*replay_speed): 0;
+			t0 = epicsMonotonicGet();
+			paced = 0;
+		}
+		if (processFrame(&rf)){
+			epicsAtomicIncrIntT(&integ_restarts);
+			integ.reset();
+			epicsAtomicSetIntT(&restart_pending, 0);
+		}
+		end_frame();
+		nsam += FRAME_SAMPLES;
+
+		if (ns_per_sample > 0){
+			paced += FRAME_SAMPLES;
+			const epicsUInt64 due = t0 + (epicsUInt64)(paced*ns_per_sample);
+			const epicsUInt64 now = epicsMonotonicGet();
+			if (due > now){
+				epicsThreadSleep((due - now)*1e-9);
+			}
+		}
+	}
+	printf("%s %s replay done, %lld samples\n", __FUNCTION__, portName, nsam);
+}
+
+/** Supervisor: connect, stream, and when the stream is lost reconnect
+ *  every CARD_RETRY s. Buffers and pools are kept. Streaming starts on the
+ *  calibration it has: each connection asks calibrator() for a fresh one */
+void Acq164Device::task(void)
+{
+	placeStreamingThread();
+	/* first touch puts the hot buffers on this thread's NUMA node */
+	arena.touch();
+	lock();
+	setIntegerParam(P_ArenaNode, arena.getNode());
+	callParamCallbacks();
+	unlock();
+
+	if (replay){
+		/* a plain file carries none: stay on nominal +/-10 V */
+		double* cal = spareCal();
+		if (replay->getCalibration(cal, cal+nchan)){
+			installCal(cal, 1);
+		}
+		replay_stream();
+		epicsAtomicSetIntT(&card_state, CARD_STOPPED);
+		return;
+	}
+	for (int pass = 0; ; ++pass){
+		epicsAtomicSetIntT(&card_state, CARD_CONNECTING);
+		Transport *t = Transport::getTransport(portName);
+		if (t){
+			Acq2xx card(t);
+			epicsEventSignal(calEventId_);
+			if (pass){
+				epicsAtomicIncrIntT(&card_reconnects);
+			}
+			stream(card);
+			delete t;
+		}
+		if (down_since == 0){
+			down_since = epicsMonotonicGet();
+		}
+		epicsAtomicSetIntT(&card_state, CARD_STOPPED);
+
+		double retry;
+		getDoubleParam(P_CardRetry, &retry);
+		printf("%s %s stream lost, reconnect in %.1f s\n", __FUNCTION__, portName, retry);
+		epicsThreadSleep(retry > 0? retry: 0.1);
+	}
 }
 
 
-int acq164AsynPortDriver::factory(const char *portName, int maxPoints, int nchan)
+int acq164AsynPortDriver::factory(const char *portName, int maxPoints, int nchan, int outputs,
+		int cpumask, int priority, int hugepages, Replay *replay, double speed)
 {
-	new Acq164Device(portName, maxPoints, nchan);
+	new Acq164Device(portName, maxPoints, nchan, outputs, cpumask, priority, hugepages, replay, speed);
 	return(asynSuccess);
 }
 
@@ -470,28 +2298,243 @@ extern "C" {
 
 /** EPICS iocsh callable function to call constructor for the testAsynPortDriver class.
   * \param[in] portName The name of the asyn port driver to be created.
-  * \param[in] maxPoints The maximum  number of points in the volt and time arrays */
-int acq164AsynPortDriverConfigure(const char *portName, int maxPoints, int nchan)
+  * \param[in] maxPoints The maximum  number of points in the volt and time arrays
+  * \param[in] outputs OUTPUT_VOLTS=1 | OUTPUT_RAW=2 | OUTPUT_FILTERED=4, default 0: volts only
+  * \param[in] cpumask pin the streaming thread to these cpus, default 0: any
+  * \param[in] priority streaming thread EPICS priority 1..99, default 0: medium.
+  *            One port per card: each has its own streaming and publisher threads
+  * \param[in] hugepages 1: buffers on 2 MB hugepages, else transparent hugepages, default 0: normal pages */
+int acq164AsynPortDriverConfigure(const char *portName, int maxPoints, int nchan, int outputs,
+		int cpumask, int priority, int hugepages)
+{
+	return acq164AsynPortDriver::factory(portName, maxPoints, nchan, outputs, cpumask, priority, hugepages);
+}
+
+
+/** As acq164AsynPortDriverConfigure, with recorded frames in place of the
+  * card: for benchmarks and regression tests on a machine with no ACQ164.
+  * Paced by SAMPLE_RATE: set it to the recording's rate
+  * \param[in] file Recorder .raw, Recorder dirfile directory, or plain int32 [sample][nchan]
+  * \param[in] speed 1: real time, N: N x real time, 0: as fast as possible
+  * \param[in] loop 1: go round the file for ever, 0: stop at the end */
+int acq164ReplayConfigure(const char *portName, int maxPoints, int nchan, int outputs,
+		int cpumask, int priority, int hugepages, const char *file, double speed, int loop)
+{
+	Replay *replay = Replay::create(file, nchan, loop != 0);
+	if (replay == 0){
+		return asynError;
+	}
+	return acq164AsynPortDriver::factory(portName, maxPoints, nchan, outputs, cpumask, priority, hugepages,
+			replay, speed > 0? speed: 0);
+}
+
+/** Load template once per channel of the port, with CH=01.. and ADDR=0..
+  * added to macros: one call in place of a dbLoadRecords line per channel,
+  * and it follows nchan. Before iocInit
+  * \param[in] portName port created by acq164AsynPortDriverConfigure
+  * \param[in] file per channel template, eg db/asynWaveform.db
+  * \param[in] macros for every channel, eg P=,R=,PORT=,TIMEOUT=,NPOINTS= */
+int acq164LoadChannelRecords(const char *portName, const char *file, const char *macros)
+{
+	acq164AsynPortDriver *drv = dynamic_cast<acq164AsynPortDriver *>(
+			(asynPortDriver *)findAsynPortDriver(portName));
+	if (drv == 0){
+		fprintf(stderr, "ERROR: %s: port %s not found\n", __FUNCTION__, portName);
+		return asynError;
+	}
+	if (file == 0){
+		fprintf(stderr, "ERROR: %s: no template\n", __FUNCTION__);
+		return asynError;
+	}
+	const size_t len = (macros? strlen(macros): 0) + 32;
+	char* subs = (char *)malloc(len);
+
+	for (int ic = 0; ic < drv->getNchan(); ++ic){
+		epicsSnprintf(subs, len, "%s%sCH=%02d,ADDR=%d",
+				macros? macros: "", macros && *macros? ",": "", ic+1, ic);
+		if (dbLoadRecords(file, subs) != 0){
+			fprintf(stderr, "ERROR: %s: %s %s failed\n", __FUNCTION__, file, subs);
+			free(subs);
+			return asynError;
+		}
+	}
+	free(subs);
+	return asynSuccess;
+}
+
+/** Add an NTNDArray PVA output to an existing port: needs QSRV
+  * \param[in] portName port created by acq164AsynPortDriverConfigure
+  * \param[in] pvName PVA channel name */
+int acq164PvaConfigure(const char *portName, const char *pvName)
 {
-	return acq164AsynPortDriver::factory(portName, maxPoints, nchan);
+	acq164AsynPortDriver *drv = dynamic_cast<acq164AsynPortDriver *>(
+			(asynPortDriver *)findAsynPortDriver(portName));
+	if (drv == 0){
+		fprintf(stderr, "ERROR: %s: port %s not found\n", __FUNCTION__, portName);
+		return asynError;
+	}
+	return drv->setPvaOutput(pvName);
 }
 
+/** Record raw data to disk, see Recorder.h. Same as setting the REC_ PVs
+  * \param[in] portName port created by acq164AsynPortDriverConfigure
+  * \param[in] root directory for filesets
+  * \param[in] format 0: dirfile, 1: raw
+  * \param[in] rotateMB new fileset every rotateMB MB, 0: never
+  * \param[in] odirect 1: O_DIRECT where supported */
+int acq164RecorderConfigure(const char *portName, const char *root, int format, int rotateMB, int odirect)
+{
+	acq164AsynPortDriver *drv = dynamic_cast<acq164AsynPortDriver *>(
+			(asynPortDriver *)findAsynPortDriver(portName));
+	if (drv == 0){
+		fprintf(stderr, "ERROR: %s: port %s not found\n", __FUNCTION__, portName);
+		return asynError;
+	}
+	return drv->setRecorder(root, format, rotateMB, odirect);
+}
+
+/** Add per channel power spectra to an existing port, see Spectrum.h
+  * \param[in] portName port created by acq164AsynPortDriverConfigure
+  * \param[in] nfft FFT length, power of 2
+  * \param[in] nworkers worker threads, default 0: 2 */
+int acq164SpectrumConfigure(const char *portName, int nfft, int nworkers)
+{
+	acq164AsynPortDriver *drv = dynamic_cast<acq164AsynPortDriver *>(
+			(asynPortDriver *)findAsynPortDriver(portName));
+	if (drv == 0){
+		fprintf(stderr, "ERROR: %s: port %s not found\n", __FUNCTION__, portName);
+		return asynError;
+	}
+	return drv->setSpectrum(nfft, nworkers > 0? nworkers: 2);
+}
+
+/** Add a software trigger to an existing port, see Trigger.h
+  * \param[in] portName port created by acq164AsynPortDriverConfigure
+  * \param[in] maxSamples longest event, TRIG_PRE + TRIG_POST
+  * \param[in] nevents events queued for the publisher, default 0: 8 */
+int acq164TriggerConfigure(const char *portName, int maxSamples, int nevents)
+{
+	acq164AsynPortDriver *drv = dynamic_cast<acq164AsynPortDriver *>(
+			(asynPortDriver *)findAsynPortDriver(portName));
+	if (drv == 0){
+		fprintf(stderr, "ERROR: %s: port %s not found\n", __FUNCTION__, portName);
+		return asynError;
+	}
+	return drv->setTrigger(maxSamples, nevents > 0? nevents: 8);
+}
+
+/** Add a compressed copy of the raw blocks to an existing port, for clients
+  * on a slow link, see Compressor.h. COMP_CODEC turns it on
+  * \param[in] portName port created by acq164AsynPortDriverConfigure with OUTPUT_RAW */
+int acq164CompressConfigure(const char *portName)
+{
+	acq164AsynPortDriver *drv = dynamic_cast<acq164AsynPortDriver *>(
+			(asynPortDriver *)findAsynPortDriver(portName));
+	if (drv == 0){
+		fprintf(stderr, "ERROR: %s: port %s not found\n", __FUNCTION__, portName);
+		return asynError;
+	}
+	return drv->setCompressor();
+}
 
 /* EPICS iocsh shell commands */
 
 static const iocshArg initArg0 = { "portName",iocshArgString};
 static const iocshArg initArg1 = { "max points",iocshArgInt};
 static const iocshArg initArg2 = { "max chan",iocshArgInt};
-static const iocshArg * const initArgs[] = {&initArg0, &initArg1, &initArg2};
-static const iocshFuncDef initFuncDef = {"acq164AsynPortDriverConfigure",3,initArgs};
+static const iocshArg initArg3 = { "outputs 1:volts 2:raw 4:filtered",iocshArgInt};
+static const iocshArg initArg4 = { "cpumask 0:any",iocshArgInt};
+static const iocshArg initArg5 = { "priority 0:medium",iocshArgInt};
+static const iocshArg initArg6 = { "hugepages 0:no",iocshArgInt};
+static const iocshArg * const initArgs[] = {&initArg0, &initArg1, &initArg2, &initArg3, &initArg4, &initArg5, &initArg6};
+static const iocshFuncDef initFuncDef = {"acq164AsynPortDriverConfigure",7,initArgs};
 static void initCallFunc(const iocshArgBuf *args)
 {
-	acq164AsynPortDriverConfigure(args[0].sval, args[1].ival, args[2].ival);
+	acq164AsynPortDriverConfigure(args[0].sval, args[1].ival, args[2].ival, args[3].ival,
+			args[4].ival, args[5].ival, args[6].ival);
+}
+
+static const iocshArg replayArg7 = { "file",iocshArgString};
+static const iocshArg replayArg8 = { "speed 1:real time 0:max",iocshArgDouble};
+static const iocshArg replayArg9 = { "loop",iocshArgInt};
+static const iocshArg * const replayArgs[] = {&initArg0, &initArg1, &initArg2, &initArg3, &initArg4, &initArg5, &initArg6,
+		&replayArg7, &replayArg8, &replayArg9};
+static const iocshFuncDef replayFuncDef = {"acq164ReplayConfigure",10,replayArgs};
+static void replayCallFunc(const iocshArgBuf *args)
+{
+	acq164ReplayConfigure(args[0].sval, args[1].ival, args[2].ival, args[3].ival,
+			args[4].ival, args[5].ival, args[6].ival, args[7].sval, args[8].dval, args[9].ival);
+}
+
+static const iocshArg chanArg0 = { "portName",iocshArgString};
+static const iocshArg chanArg1 = { "template",iocshArgString};
+static const iocshArg chanArg2 = { "macros",iocshArgString};
+static const iocshArg * const chanArgs[] = {&chanArg0, &chanArg1, &chanArg2};
+static const iocshFuncDef chanFuncDef = {"acq164LoadChannelRecords",3,chanArgs};
+static void chanCallFunc(const iocshArgBuf *args)
+{
+	acq164LoadChannelRecords(args[0].sval, args[1].sval, args[2].sval);
+}
+
+static const iocshArg pvaArg0 = { "portName",iocshArgString};
+static const iocshArg pvaArg1 = { "pvName",iocshArgString};
+static const iocshArg * const pvaArgs[] = {&pvaArg0, &pvaArg1};
+static const iocshFuncDef pvaFuncDef = {"acq164PvaConfigure",2,pvaArgs};
+static void pvaCallFunc(const iocshArgBuf *args)
+{
+	acq164PvaConfigure(args[0].sval, args[1].sval);
+}
+
+static const iocshArg recArg0 = { "portName",iocshArgString};
+static const iocshArg recArg1 = { "root",iocshArgString};
+static const iocshArg recArg2 = { "format 0:dirfile 1:raw",iocshArgInt};
+static const iocshArg recArg3 = { "rotate MB, 0:never",iocshArgInt};
+static const iocshArg recArg4 = { "O_DIRECT",iocshArgInt};
+static const iocshArg * const recArgs[] = {&recArg0, &recArg1, &recArg2, &recArg3, &recArg4};
+static const iocshFuncDef recFuncDef = {"acq164RecorderConfigure",5,recArgs};
+static void recCallFunc(const iocshArgBuf *args)
+{
+	acq164RecorderConfigure(args[0].sval, args[1].sval, args[2].ival, args[3].ival, args[4].ival);
+}
+
+static const iocshArg specArg0 = { "portName",iocshArgString};
+static const iocshArg specArg1 = { "nfft",iocshArgInt};
+static const iocshArg specArg2 = { "workers 0:2",iocshArgInt};
+static const iocshArg * const specArgs[] = {&specArg0, &specArg1, &specArg2};
+static const iocshFuncDef specFuncDef = {"acq164SpectrumConfigure",3,specArgs};
+static void specCallFunc(const iocshArgBuf *args)
+{
+	acq164SpectrumConfigure(args[0].sval, args[1].ival, args[2].ival);
+}
+
+static const iocshArg trigArg0 = { "portName",iocshArgString};
+static const iocshArg trigArg1 = { "max samples",iocshArgInt};
+static const iocshArg trigArg2 = { "events 0:8",iocshArgInt};
+static const iocshArg * const trigArgs[] = {&trigArg0, &trigArg1, &trigArg2};
+static const iocshFuncDef trigFuncDef = {"acq164TriggerConfigure",3,trigArgs};
+static void trigCallFunc(const iocshArgBuf *args)
+{
+	acq164TriggerConfigure(args[0].sval, args[1].ival, args[2].ival);
+}
+
+static const iocshArg compArg0 = { "portName",iocshArgString};
+static const iocshArg * const compArgs[] = {&compArg0};
+static const iocshFuncDef compFuncDef = {"acq164CompressConfigure",1,compArgs};
+static void compCallFunc(const iocshArgBuf *args)
+{
+	acq164CompressConfigure(args[0].sval);
 }
 
 void acq164AsynPortDriverRegister(void)
 {
     iocshRegister(&initFuncDef,initCallFunc);
+    iocshRegister(&replayFuncDef,replayCallFunc);
+    iocshRegister(&chanFuncDef,chanCallFunc);
+    iocshRegister(&pvaFuncDef,pvaCallFunc);
+    iocshRegister(&recFuncDef,recCallFunc);
+    iocshRegister(&specFuncDef,specCallFunc);
+    iocshRegister(&trigFuncDef,trigCallFunc);
+    iocshRegister(&compFuncDef,compCallFunc);
 }
 
 epicsExportRegistrar(acq164AsynPortDriverRegister);
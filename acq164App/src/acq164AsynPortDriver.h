@@ -38,8 +38,20 @@
  */
 
 #include "asynPortDriver.h"
-
-int acq200_debug;
+#include "BufferPool.h"
+#include "Decimator.h"
+#include "Stats.h"
+#include "PvaPublisher.h"
+#include "Recorder.h"
+#include "Instrument.h"
+#include "Filter.h"
+#include "Spectrum.h"
+#include "Compressor.h"
+#include "Trigger.h"
+#include "Integrity.h"
+#include "Arena.h"
+#include "RawFrame.h"
+#include "Replay.h"
 
 #define NUM_VERT_SELECTIONS 4
 
@@ -51,77 +63,157 @@ int acq200_debug;
 #define P_NoiseAmplitudeString     "SCOPE_NOISE_AMPLITUDE"      /* asynFloat64,  r/w */
 #define P_UpdateTimeString         "SCOPE_UPDATE_TIME"          /* asynFloat64,  r/w */
 #define P_WaveformString           "SCOPE_WAVEFORM"             /* asynFloat64Array,  r/o */
+#define P_WaveformDecString        "SCOPE_WAVEFORM_DEC"         /* asynFloat64Array,  r/o decimated: pick, mean or min */
+#define P_WaveformDecMaxString     "SCOPE_WAVEFORM_DEC_MAX"     /* asynFloat64Array,  r/o decimated: max envelope */
+#define P_WaveformRawString        "SCOPE_WAVEFORM_RAW"         /* asynInt32Array,  r/o raw ADC codes */
+#define P_WaveformFiltString       "SCOPE_WAVEFORM_FILT"        /* asynFloat64Array,  r/o filtered volts */
+#define PS_WAVEFORM_ALL            "SCOPE_WAVEFORM_ALL"         /* asynFloat64Array,  r/o every active channel, [CHAN_ACTIVE][maxPoints] */
 #define P_ScalarString             "SCOPE_SCALAR"               /* asynFloat64,  r/o */
-#define P_TimeBaseString           "SCOPE_TIME_BASE"            /* asynFloat64Array,  r/o */
+#define P_TimeBaseString           "SCOPE_TIME_BASE"            /* asynFloat64Array,  r/o s from the first sample of a block */
 #define P_MinValueString           "SCOPE_MIN_VALUE"            /* asynFloat64,  r/o */
 #define P_MaxValueString           "SCOPE_MAX_VALUE"            /* asynFloat64,  r/o */
 #define P_MeanValueString          "SCOPE_MEAN_VALUE"           /* asynFloat64,  r/o */
+#define PS_SCALAR_ARRAY            "SCOPE_SCALAR_ARRAY"         /* asynFloat64Array,  r/o every channel's mean, NaN: not selected */
+#define PS_SCALAR_PER_CHANNEL      "SCALAR_PER_CHANNEL"         /* asynInt32,  r/w 1: also SCOPE_SCALAR, _MEAN/MIN/MAX_VALUE per channel */
 #define PS_SCAN_FREQ			   "SCAN_FREQ"			        /* asynInt32,  r/w scalar update in Hz */
+#define PS_SCAN_PERIOD             "SCAN_PERIOD"                /* asynFloat64,  r/w scalar update in s, overrides SCAN_FREQ if > 0 */
+#define PS_SAMPLE_RATE             "SAMPLE_RATE"                /* asynInt32,  r/w ADC clock in Hz, applied at setup() */
+#define PS_CAL_ESLO                "CAL_ESLO"                   /* asynFloat64,  r/o per channel volts = raw*ESLO + EOFF */
+#define PS_CAL_EOFF                "CAL_EOFF"                   /* asynFloat64,  r/o per channel */
+#define PS_CAL_REFRESH             "CAL_REFRESH"                /* asynInt32,  r/w 1: fetch the calibration from the card again */
+#define PS_CAL_VALID               "CAL_VALID"                  /* asynInt32,  r/o 0: nominal +/-10 V, 1: from the card or file */
+#define PS_CAL_UPDATES             "CAL_UPDATES"                /* asynInt32,  r/o calibrations installed */
+#define PS_FAST_MASK               "FAST_MASK"                  /* asynInt32,  r/w channels on the fast path, bit ic, 0: off */
+#define PS_FAST_MODE               "FAST_MODE"                  /* asynInt32,  r/w FAST_LAST, FAST_MEAN */
+#define PS_FAST_VALUE              "FAST_VALUE"                 /* asynFloat64,  r/o per channel, every frame from the streaming thread, I/O Intr only */
+#define PS_FAST_LATENCY_US         "FAST_LATENCY_US"            /* asynFloat64,  r/o mean frame start to FAST_VALUE callbacks done */
+#define PS_FAST_LATENCY_MAX_US     "FAST_LATENCY_MAX_US"        /* asynFloat64,  r/o worst in the INST_INTERVAL */
+#define PS_WF_MODE                 "WF_MODE"                    /* asynInt32,  r/w WF_MODE_BLOCK, WF_MODE_SLIDING */
+#define PS_PVA_LAYOUT              "PVA_LAYOUT"                 /* asynInt32,  r/w PVA_LAYOUT_CHANNEL, PVA_LAYOUT_SAMPLE */
+#define PS_WF_SLIDE_FRAMES         "WF_SLIDE_FRAMES"            /* asynInt32,  r/w sliding: publish every N frames */
+#define PS_DEC_FACTOR              "DEC_FACTOR"                 /* asynInt32,  r/w decimation factor, 1: off */
+#define PS_DEC_MODE                "DEC_MODE"                   /* asynInt32,  r/w DEC_MODE_PICK, _MEAN, _MINMAX */
+#define PS_DEC_OVERRUNS            "DEC_OVERRUNS"               /* asynInt32,  r/o decimated blocks dropped */
+#define PS_STATS_PREFIX            "STATS"                      /* STATSn_RATE asynInt32 r/w Hz, 0: off
+                                                                 * STATSn_MEAN, _RMS, _MIN, _MAX, _STD asynFloat64 r/o per channel
+                                                                 * STATSn_ARRAY asynFloat64Array r/o [STATS_NUM][nchan] */
+#define PS_PUB_IN_FLIGHT           "PUB_BUFFERS_IN_FLIGHT"      /* asynInt32,  r/o buffers posted, not yet released */
+#define PS_PUB_OVERRUNS            "PUB_OVERRUNS"               /* asynInt32,  r/o blocks dropped, no free buffer */
+#define PS_SAMPLE_NUMBER           "SAMPLE_NUMBER"              /* asynFloat64,  r/o start sample of the last frame in the published block */
+#define PS_INST_INTERVAL           "INST_INTERVAL"              /* asynFloat64,  r/w instrumentation update in s */
+#define PS_INST_FRAME_RATE         "INST_FRAME_RATE"            /* asynFloat64,  r/o frames/s */
+#define PS_INST_SAMPLE_RATE        "INST_SAMPLE_RATE"           /* asynFloat64,  r/o samples/s per channel */
+#define PS_INST_CONV_US            "INST_CONV_US"               /* asynFloat64,  r/o per frame: calibration, decimation, copies */
+#define PS_INST_ACC_US             "INST_ACC_US"                /* asynFloat64,  r/o per frame: scalar and stats accumulation */
+#define PS_INST_CB_US              "INST_CB_US"                 /* asynFloat64,  r/o per frame: scalar callbacks, buffer hand off */
+#define PS_INST_INTEG_US           "INST_INTEG_US"              /* asynFloat64,  r/o per frame: integrity check */
+#define PS_INST_TRIG_US            "INST_TRIG_US"               /* asynFloat64,  r/o per frame: trigger and event capture */
+#define PS_INST_TAPS_US            "INST_TAPS_US"               /* asynFloat64,  r/o per frame: frame taps, eg the merge stage */
+#define PS_INST_FRAME_US           "INST_FRAME_US"              /* asynFloat64,  r/o per frame: all of onFrame() */
+#define PS_INST_FRAME_MAX_US       "INST_FRAME_MAX_US"          /* asynFloat64,  r/o worst onFrame() in the interval */
+#define PS_INST_GAP_MAX_US         "INST_GAP_MAX_US"            /* asynFloat64,  r/o worst time between frames */
+#define PS_INST_GAP_HIST           "INST_GAP_HIST"              /* asynInt32Array,  r/o time between frames, INST_HIST_BINS log2 us bins */
+#define PS_INST_MISSED             "INST_MISSED"                /* asynInt32,  r/o samples skipped in the sample numbers */
+#define PS_INST_DUPLICATED         "INST_DUPLICATED"            /* asynInt32,  r/o frames with a repeated or earlier sample number */
+#define PS_CARD_STATE              "CARD_STATE"                 /* asynInt32,  r/o CARD_IDLE .. CARD_STOPPED */
+#define PS_CARD_FRAMES             "CARD_FRAMES"                /* asynInt32,  r/o frames received */
+#define PS_CARD_FRAME_AGE          "CARD_FRAME_AGE"             /* asynFloat64,  r/o s since the last frame, -1: none yet */
+#define PS_CARD_CPU                "CARD_CPU"                   /* asynInt32,  r/o cpu the streaming thread last ran on */
+#define PS_CARD_PRIORITY           "CARD_PRIORITY"              /* asynInt32,  r/o streaming thread EPICS priority */
+#define PS_CARD_RT                 "CARD_RT"                    /* asynInt32,  r/o 1: streaming thread is SCHED_FIFO/RR */
+#define PS_CARD_RECONNECTS         "CARD_RECONNECTS"            /* asynInt32,  r/o streams restarted after the stream was lost */
+#define PS_CARD_DOWNTIME           "CARD_DOWNTIME"              /* asynFloat64,  r/o s from losing the stream to the next frame, last outage */
+#define PS_CARD_DOWNTIME_TOTAL     "CARD_DOWNTIME_TOTAL"        /* asynFloat64,  r/o s, all outages */
+#define PS_CARD_RETRY              "CARD_RETRY"                 /* asynFloat64,  r/w s between reconnect attempts */
+#define PS_INTEG_ALARM             "INTEG_ALARM"                /* asynInt32,  r/o INTEG_ZERO | _SAT | _GAP in the last second, see Integrity.h */
+#define PS_INTEG_CHAN              "INTEG_CHAN"                 /* asynInt32,  r/o per channel INTEG_ZERO | _SAT in the last second */
+#define PS_INTEG_ZERO_FRAMES       "INTEG_ZERO_FRAMES"          /* asynInt32,  r/o frames with a zero run */
+#define PS_INTEG_SAT_FRAMES        "INTEG_SAT_FRAMES"           /* asynInt32,  r/o frames with codes at full scale */
+#define PS_INTEG_GAPS              "INTEG_GAPS"                 /* asynInt32,  r/o sample number discontinuities */
+#define PS_INTEG_GAP_SAMPLES       "INTEG_GAP_SAMPLES"          /* asynInt32,  r/o samples missing */
+#define PS_INTEG_RESTARTS          "INTEG_RESTARTS"             /* asynInt32,  r/o stream restarts on zero runs */
+#define PS_INTEG_EVERY             "INTEG_EVERY"                /* asynInt32,  r/w check sample data every N frames */
+#define PS_INTEG_ZERO_RUN          "INTEG_ZERO_RUN"             /* asynInt32,  r/w zeros in a row that count as stuck */
+#define PS_INTEG_RESTART           "INTEG_RESTART"              /* asynInt32,  r/w restart the stream after N frames with zero runs, 0: never */
+#define PS_REC_ENABLE              "REC_ENABLE"                 /* asynInt32,  r/w record raw to disk, see Recorder.h */
+#define PS_REC_ROOT                "REC_ROOT"                   /* asynOctet,  r/w directory for filesets */
+#define PS_REC_FORMAT              "REC_FORMAT"                 /* asynInt32,  r/w REC_FORMAT_DIRFILE, REC_FORMAT_RAW */
+#define PS_REC_ROTATE_MB           "REC_ROTATE_MB"              /* asynInt32,  r/w new fileset every N MB, 0: never */
+#define PS_REC_ODIRECT             "REC_ODIRECT"                /* asynInt32,  r/w 1: write with O_DIRECT where supported */
+#define PS_REC_MBPS                "REC_MBPS"                   /* asynFloat64,  r/o write rate MB/s */
+#define PS_REC_BACKLOG             "REC_BACKLOG"                /* asynInt32,  r/o blocks waiting for the writer */
+#define PS_REC_OVERRUNS            "REC_OVERRUNS"               /* asynInt32,  r/o blocks dropped, writer too slow */
+#define PS_REC_FILESETS            "REC_FILESETS"               /* asynInt32,  r/o filesets opened, including rotations */
+#define PS_REC_ERRORS              "REC_ERRORS"                 /* asynInt32,  r/o open/write failures */
+#define PS_REC_FILE                "REC_FILE"                   /* asynOctet,  r/o current fileset */
+#define PS_ARENA_MB                "ARENA_MB"                   /* asynFloat64,  r/o buffer arena footprint, MB */
+#define PS_ARENA_PAGES             "ARENA_PAGES"                /* asynInt32,  r/o ARENA_PAGES_NORMAL, _THP, _HUGETLB, see Arena.h */
+#define PS_ARENA_NODE              "ARENA_NODE"                 /* asynInt32,  r/o NUMA node of the arena, -1: not known */
+#define PS_CHAN_MASK               "CHAN_MASK"                  /* asynInt32,  r/w bit ic selects channel ic, 0: all */
+#define PS_CHAN_ACTIVE             "CHAN_ACTIVE"                /* asynInt32,  r/o channels selected */
+#define PS_FILTER_TYPE             "FILTER_TYPE"                /* asynInt32,  r/w FILTER_OFF, _BIQUAD, _FIR, see Filter.h */
+#define PS_FILTER_COEFFS           "FILTER_COEFFS"              /* asynFloat64Array,  w coefficients for FILTER_TYPE */
+#define PS_FILTER_FILE             "FILTER_FILE"                /* asynOctet,  r/w load type and coefficients from file */
+#define PS_FILTER_NCOEF            "FILTER_NCOEF"               /* asynInt32,  r/o coefficients loaded */
+#define PS_SPEC_POWER              "SPEC_POWER"                 /* asynFloat64Array,  r/o per channel power spectrum, V^2 per bin, see Spectrum.h */
+#define PS_SPEC_FREQ               "SPEC_FREQ"                  /* asynFloat64Array,  r/o frequency axis, Hz */
+#define PS_SPEC_NFFT               "SPEC_NFFT"                  /* asynInt32,  r/o FFT length, 0: no spectrum engine */
+#define PS_SPEC_WINDOW             "SPEC_WINDOW"                /* asynInt32,  r/w SPEC_WINDOW_HANN, _FLATTOP */
+#define PS_SPEC_AVG_MODE           "SPEC_AVG_MODE"              /* asynInt32,  r/w SPEC_AVG_EXP, _LINEAR */
+#define PS_SPEC_AVG_N              "SPEC_AVG_N"                 /* asynInt32,  r/w spectra averaged */
+#define PS_SPEC_AVERAGES           "SPEC_AVERAGES"              /* asynInt32,  r/o spectra in the last result */
+#define PS_SPEC_OVERRUNS           "SPEC_OVERRUNS"              /* asynInt32,  r/o blocks dropped, workers too slow */
+#define PS_TRIG_MODE               "TRIG_MODE"                  /* asynInt32,  r/w TRIG_OFF, _LEVEL, _EDGE, see Trigger.h */
+#define PS_TRIG_CHANNEL            "TRIG_CHANNEL"               /* asynInt32,  r/w channel 0..nchan-1 */
+#define PS_TRIG_SLOPE              "TRIG_SLOPE"                 /* asynInt32,  r/w TRIG_RISING, _FALLING */
+#define PS_TRIG_LEVEL              "TRIG_LEVEL"                 /* asynFloat64,  r/w volts */
+#define PS_TRIG_HYST               "TRIG_HYST"                  /* asynFloat64,  r/w volts, TRIG_EDGE re-arm */
+#define PS_TRIG_PRE                "TRIG_PRE"                   /* asynInt32,  r/w samples before the trigger */
+#define PS_TRIG_POST               "TRIG_POST"                  /* asynInt32,  r/w samples from the trigger on */
+#define PS_TRIG_WAVEFORM           "TRIG_WAVEFORM"              /* asynFloat64Array,  r/o per channel event, volts */
+#define PS_TRIG_TIME_BASE          "TRIG_TIME_BASE"             /* asynFloat64Array,  r/o event time from the trigger, s */
+#define PS_TRIG_SAMPLE             "TRIG_SAMPLE"                /* asynFloat64,  r/o trigger sample of the last event */
+#define PS_TRIG_EVENTS             "TRIG_EVENTS"                /* asynInt32,  r/o events captured */
+#define PS_TRIG_DROPPED            "TRIG_DROPPED"               /* asynInt32,  r/o events dropped, publisher too slow */
+#define PS_TRIG_MAX                "TRIG_MAX"                   /* asynInt32,  r/o pre + post limit, 0: no trigger engine */
+#define PS_COMP_CODEC              "COMP_CODEC"                 /* asynInt32,  r/w COMP_OFF, _DELTA, _LZ4, see acq164Codec.h */
+#define PS_COMP_LEVEL              "COMP_LEVEL"                 /* asynInt32,  r/w COMP_DELTA: difference order 0..2, COMP_LZ4: acceleration */
+#define PS_COMP_WAVEFORM           "COMP_WAVEFORM"              /* asynInt8Array,  r/o each raw block compressed, layout in acq164Codec.h */
+#define PS_COMP_BYTES              "COMP_BYTES"                 /* asynInt32,  r/o length of the last COMP_WAVEFORM */
+#define PS_COMP_RATIO              "COMP_RATIO"                 /* asynFloat64,  r/o raw bytes / compressed bytes */
+#define PS_COMP_ENCODE_US          "COMP_ENCODE_US"             /* asynFloat64,  r/o encode time of the last block */
+#define PS_COMP_OVERRUNS           "COMP_OVERRUNS"              /* asynInt32,  r/o blocks dropped, compressor too slow */
+#define PS_COMP_ENABLED            "COMP_ENABLED"               /* asynInt32,  r/o 1: acq164CompressConfigure done */
 
-#define NSPS 1000000000
-
-template <class T>
-class Acc {
-	const int nchan;
-
-	int diff(epicsTimeStamp& t1, epicsTimeStamp& t0)
-	/* return t1-t0 in nsec */
-	{
-		if (t1.secPastEpoch < t0.secPastEpoch){
-			return -1;
-		}
-		if (t1.nsec > t0.nsec){
-			return t1.nsec - t0.nsec + (t1.secPastEpoch - t0.secPastEpoch)*NSPS;
-		}else if (t1.secPastEpoch > t0.secPastEpoch){
-			return t1.nsec + NSPS - t0.nsec + (t1.secPastEpoch - t0.secPastEpoch - 1)*NSPS;
-		}else{
-			return -2;
-		}
-	}
+#define NUM_PUBLISH_BUFFERS	3	/* triple buffer: fill, publish, spare */
+#define NUM_WAVEFORM_BUFFERS	4	/* fill, publish, snapshot for reads, spare */
+#define NUM_STATS_BANKS		3	/* independent stats reporting rates */
+#define NUM_CAL_BUFFERS		2	/* live, and the spare the next calibration is built in */
 
-public:
-	T *ch;
-	int nadd;
-	epicsTimeStamp t0;
-
-
-
-	Acc(int _nchan): nchan(_nchan), nadd(0) {
-		ch = new T[nchan];
-	}
-	void clear() {
-		memset(ch, 0, nchan*sizeof(T));
-		nadd = 0;
-		t0.secPastEpoch = 0;
-	}
-	void set(int ic, T y1){
-		ch[ic] += y1;
-		if (ic == 0) nadd += 1;
-	}
-	bool update_timestamp(int nsec)
-	/* return true if nsec exceeeded since first update */
-	{
-		epicsTimeStamp t1;
-		epicsTimeGetCurrent(&t1);
-
-		if (t0.secPastEpoch == 0){
-			t0.secPastEpoch = t1.secPastEpoch;
-			t0.nsec = t1.nsec;
-			return false;
-		}else if (diff(t1, t0) > nsec){
-			return true;
-		}else{
-			return false;
-		}
-	}
-	T get(int ic){
-		if (nadd){
-			return ch[ic]/ nadd;
-		}else{
-			return 0;
-		}
-	}
-};
+/* scalar tick buffer, [SCALAR_NUM][nchan] */
+enum { SCALAR_MEAN, SCALAR_MIN, SCALAR_MAX, SCALAR_NUM };
+
+#define FAST_LAST		0	/* FAST_VALUE: the frame's last sample */
+#define FAST_MEAN		1	/* FAST_VALUE: mean of the frame */
+
+#define WF_MODE_BLOCK		0	/* publish each maxPoints block once full */
+#define WF_MODE_SLIDING		1	/* publish latest maxPoints every WF_SLIDE_FRAMES frames */
+
+/* outputs argument to acq164AsynPortDriverConfigure, 0 means OUTPUT_VOLTS */
+#define OUTPUT_VOLTS		0x1	/* SCOPE_WAVEFORM, calibrated float64 */
+#define OUTPUT_RAW		0x2	/* SCOPE_WAVEFORM_RAW, raw int32 */
+#define OUTPUT_FILTERED		0x4	/* SCOPE_WAVEFORM_FILT, filtered float64, implies OUTPUT_VOLTS */
+
+#define ACQ164_DEFAULT_SAMPLE_RATE	20000
+
+#define MAX_FRAME_TAPS		4	/* extra FrameTaps run after the driver's own pipeline */
+
+/* CARD_STATE: where the streaming thread is */
+#define CARD_IDLE		0
+#define CARD_CONNECTING		1	/* transport */
+#define CARD_SETUP		2	/* configure and arm */
+#define CARD_STREAMING		3
+#define CARD_STOPPED		4	/* stream lost, reconnect in CARD_RETRY s */
 
 /** Class that demonstrates the use of the asynPortDriver base class to greatly simplify the task
   * of writing an asyn port driver.
@@ -131,22 +223,57 @@ public:
   * but they should really all be private. */
 class acq164AsynPortDriver : public asynPortDriver {
 public:
-    acq164AsynPortDriver(const char *portName, int maxArraySize, int nchan);
+    acq164AsynPortDriver(const char *portName, int maxArraySize, int nchan, int outputs,
+                         int cpumask, int priority, int hugepages);
 
     /* These are the methods that we override from asynPortDriver */
     virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
     virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
     virtual asynStatus readFloat64Array(asynUser *pasynUser, epicsFloat64 *value,
                                         size_t nElements, size_t *nIn);
+    virtual asynStatus writeFloat64Array(asynUser *pasynUser, epicsFloat64 *value,
+                                        size_t nElements);
+    virtual asynStatus readInt32Array(asynUser *pasynUser, epicsInt32 *value,
+                                      size_t nElements, size_t *nIn);
+    virtual asynStatus writeOctet(asynUser *pasynUser, const char *value,
+                                  size_t nChars, size_t *nActual);
     virtual asynStatus readEnum(asynUser *pasynUser, char *strings[], int values[], int severities[],
                                 size_t nElements, size_t *nIn);
 
     virtual void task() = 0;
 
-    static int factory(const char *portName, int maxPoints, int nchan);
+    static int factory(const char *portName, int maxPoints, int nchan, int outputs,
+                       int cpumask, int priority, int hugepages,
+                       Replay *replay = 0, double speed = 0);
+
+    void publisher();
+
+    int setPvaOutput(const char *pvName);
+
+    int setRecorder(const char *root, int format, int rotate_mb, int odirect);
+
+    int setSpectrum(int nfft, int nworkers);
+    int setTrigger(int maxSamples, int nevents);
+    void spectrumResult();
+    int setCompressor();
+    void compressResult();
+
+    int addFrameTap(FrameTap *tap);
+    int getNchan() const {
+        return nchan;
+    }
+    /** time of sample on this card's sample clock, for the merge stage */
+    void timeOfSample(long long sample, epicsTimeStamp *ts) {
+        sampleTime(sample, ts);
+    }
+    void recorderStatus();
 
 protected:
 
+    /* bumped by writeInt32(), writeFloat64(): the streaming thread reloads
+     * its copy of the params when it moves, not on every frame */
+    int param_gen;
+
     /** Values used for pasynUser->reason, and indexes into the parameter library. */
     int P_Run;
     int P_MaxPoints;
@@ -154,24 +281,290 @@ protected:
     int P_NoiseAmplitude;
     int P_UpdateTime;
     int P_Waveform;
+    int P_WaveformRaw;
+    int P_WaveformFilt;
+    int P_WaveformAll;
+    int P_WaveformDec;
+    int P_WaveformDecMax;
     int P_Scalar;
     int P_TimeBase;
     int P_MinValue;
     int P_MaxValue;
     int P_MeanValue;
+    int P_ScalarArray;
+    int P_ScalarPerChannel;
     int P_ScanFreq;
+    int P_ScanPeriod;
+    int P_SampleRate;
+    int P_CalEslo;
+    int P_CalEoff;
+    int P_CalRefresh;
+    int P_CalValid;
+    int P_CalUpdates;
+    int P_FastMask;
+    int P_FastMode;
+    int P_FastValue;
+    int P_FastLatencyUs;
+    int P_FastLatencyMaxUs;
+    int P_WfMode;
+    int P_PvaLayout;
+    int P_WfSlideFrames;
+    int P_DecFactor;
+    int P_DecMode;
+    int P_DecOverruns;
+    int P_StatsRate[NUM_STATS_BANKS];
+    int P_Stats[NUM_STATS_BANKS][STATS_NUM];
+    int P_StatsArray[NUM_STATS_BANKS];
+    int P_PubInFlight;
+    int P_PubOverruns;
+    int P_SampleNumber;
+    int P_InstInterval;
+    int P_InstFrameRate;
+    int P_InstSampleRate;
+    int P_InstPhaseUs[INST_PHASES];
+    int P_InstFrameUs;
+    int P_InstFrameMaxUs;
+    int P_InstGapMaxUs;
+    int P_InstGapHist;
+    int P_InstMissed;
+    int P_InstDuplicated;
+    int P_CardState;
+    int P_CardFrames;
+    int P_CardFrameAge;
+    int P_CardCpu;
+    int P_CardPriority;
+    int P_CardRT;
+    int P_CardReconnects;
+    int P_CardDowntime;
+    int P_CardDowntimeTotal;
+    int P_CardRetry;
+    int P_IntegAlarm;
+    int P_IntegChan;
+    int P_IntegZeroFrames;
+    int P_IntegSatFrames;
+    int P_IntegGaps;
+    int P_IntegGapSamples;
+    int P_IntegRestarts;
+    int P_IntegEvery;
+    int P_IntegZeroRun;
+    int P_IntegRestart;
+    int P_RecEnable;
+    int P_RecRoot;
+    int P_RecFormat;
+    int P_RecRotateMB;
+    int P_RecODirect;
+    int P_RecMBps;
+    int P_RecBacklog;
+    int P_RecOverruns;
+    int P_RecFilesets;
+    int P_RecErrors;
+    int P_RecFile;
+    int P_ArenaMB;
+    int P_ArenaPages;
+    int P_ArenaNode;
+    int P_ChanMask;
+    int P_ChanActive;
+    int P_FilterType;
+    int P_FilterCoeffs;
+    int P_FilterFile;
+    int P_FilterNcoef;
+    int P_SpecPower;
+    int P_SpecFreq;
+    int P_SpecNfft;
+    int P_SpecWindow;
+    int P_SpecAvgMode;
+    int P_SpecAvgN;
+    int P_SpecAverages;
+    int P_SpecOverruns;
+    int P_TrigMode;
+    int P_TrigChannel;
+    int P_TrigSlope;
+    int P_TrigLevel;
+    int P_TrigHyst;
+    int P_TrigPre;
+    int P_TrigPost;
+    int P_TrigWaveform;
+    int P_TrigTimeBase;
+    int P_TrigSample;
+    int P_TrigEvents;
+    int P_TrigDropped;
+    int P_TrigMax;
+    int P_CompCodec;
+    int P_CompLevel;
+    int P_CompWaveform;
+    int P_CompBytes;
+    int P_CompRatio;
+    int P_CompEncodeUs;
+    int P_CompOverruns;
+    int P_CompEnabled;
 
     /* Our data */
     epicsEventId eventId_;
+    epicsEventId publishEventId_;
     epicsFloat64 *pTimeBase_;
+    int timebase_rate;		/* sample_clock pTimeBase_ was made for */
+    void updateTimeBase(int maxPoints);
+
+    /* sample clock: timestamps come from sample numbers at sample_clock,
+     * anchored to host time once per run by the streaming thread */
+    epicsMutexId clockMutex_;
+    int sample_clock;		/* Hz, as applied to the card */
+    epicsTimeStamp clock_ts;
+    long long clock_sample;	/* sample at clock_ts, -1: not anchored */
+    void setClock(long long sample);
+    void sampleTime(long long sample, epicsTimeStamp *ts);
+
+    /* calibration, one of NUM_CAL_BUFFERS in pCal_. The next one is built in
+     * the spare and swapped in as cal_live: the streaming thread picks it up,
+     * with no lock, at the start of a frame and says so in cal_seen. Only
+     * then is the old one spare again */
+    double *cal_live;
+    double *cal_seen;
+    epicsEventId calEventId_;	/* CAL_REFRESH */
+    int cal_updates;
+    double *spareCal();
+    void installCal(double *cal, int valid);
+
+    /* FAST_VALUE for the channels in mask, values[ic], straight to the
+     * asynFloat64 clients: no port lock, no param library */
+    void fastCallbacks(int mask, const epicsFloat64 *values, const epicsTimeStamp& ts);
 
     int nchan;
-    Acc<double> acc;
+    /* MAX_POINTS, fixed at construction: read without the port lock */
+    const int maxPoints_;
+    Stats<double> acc;
+
+    StatsBank<epicsFloat64>* banks[NUM_STATS_BANKS];
+
+    const int outputs;
+
+    /* every buffer below, the sliding rings and the calibration, in one
+     * allocation: hot buffers first, faulted in by the streaming thread */
+    Arena arena;
+    void layoutBuffers(int maxPoints);
+    double *pCal_;		/* [NUM_CAL_BUFFERS][2][nchan] eslo, eoff */
+    epicsFloat64 *pRingData_;	/* WF_MODE_SLIDING, cold until used */
+    epicsInt32 *pRingRaw_;
+    epicsFloat64 *pRingFilt_;
+
+    /* pData_, pRaw_, pFilt_ are the buffers being filled, one of NUM_WAVEFORM_BUFFERS in each pool.
+     * A pool is NULL if its output is not selected */
+    BufferPool pool;
+    epicsFloat64 *pDataPool_;
+    epicsInt32 *pRawPool_;
+    epicsFloat64 *pFiltPool_;
+    long long *poolSample_;
+    long long *poolFirst_;
+    int *poolMask_;
+    int fill_ib;
     epicsFloat64 *pData_;
+    epicsInt32 *pRaw_;
+    epicsFloat64 *pFilt_;
+    int publish_overruns;
+
+    /* last published buffer, held by a pool reference for readFloat64Array()
+     * and readInt32Array(), so the streamer never refills it. Guarded by the
+     * port lock, -1: nothing published yet */
+    int snap_ib;
+    int snapshotIndex(int addr);
+
+    /* CHAN_MASK, owned by the streaming thread: only the nactive channels in
+     * active[] are converted, and buffers hold them packed, channel active[k]
+     * at k*maxPoints. Each buffer keeps the mask it was filled with */
+    int chan_mask;
+    int nactive;
+    int *active;
+    static int maskChannels(int mask, int nchan, int *list);
+
+    /* optional, whole block as one NTNDArray, shares the pool buffer */
+    PvaPublisher *pva;
+
+    /* raw to disk, a FrameHandler on the streamer, idle until REC_ENABLE */
+    Recorder recorder;
+    int startRecorder();
+
+    /* added at any time, eg by the merge stage, run on the streaming thread */
+    FrameTap *taps[MAX_FRAME_TAPS];
+    int ntaps;
+
+    /* streaming thread placement, from acq164AsynPortDriverConfigure */
+    const int cpumask;		/* 0: any cpu */
+    const int priority;		/* EPICS priority */
+
+    /* card health, set by the streaming thread, published once a second */
+    int card_state;
+    int card_frames;
+    int card_cpu;
+    int card_priority;
+    int card_rt;
+    int card_reconnects;
+    int downtime_ms;		/* last outage */
+    int downtime_total_ms;
+    int health_frames;
+    epicsUInt64 health_seen;	/* monotonic ns when card_frames last moved */
+    epicsUInt64 health_published;
+    void updateHealth();
+    void placeStreamingThread();
+
+    /* data integrity, checked by the streaming thread, published with the card health */
+    Integrity integ;
+    int integ_restarts;
+    int restart_pending;	/* set by the streaming thread to run the stream again */
+
+    /* onFrame() timing, results drained by the publisher */
+    Instrument inst;
+
+    /* OUTPUT_FILTERED: volts through the filter, into pFilt_ */
+    Filter filter;
+    void filterStatus();
+
+    /* optional, from acq164SpectrumConfigure: fed volts by the streaming thread */
+    Spectrum *spec;
+    epicsFloat64 *pSpecFreq_;
+    int spec_rate;		/* sample_clock pSpecFreq_ was made for */
+    int *spec_list;
+    void configureSpectrum();
+
+    /* optional, from acq164TriggerConfigure: run on the streaming thread,
+     * events drained by the publisher */
+    Trigger *trig;
+    epicsFloat64 *pTrigTime_;
+    int trig_time_rate;		/* sample_clock, pre, length pTrigTime_ was made for */
+    int trig_time_pre;
+    int trig_time_len;
+    void publishTrigger(int *list);
+
+    /* optional, from acq164CompressConfigure: fed raw blocks by the publisher */
+    Compressor *comp;
+    int configureCompressor();
+
+    /* decimated volts, maxPoints per channel, own pool and update rate */
+    Decimator<epicsFloat64> dec;
+
+    /* each scalar tick, filled by the streaming thread without the port lock.
+     * The publisher sends only the latest on offer, under one lock */
+    BufferPool scalarPool;
+    epicsFloat64 *pScalarPool_;
+    long long *scalarSample_;
+    int *scalarMask_;
+    int scalar_ib;
+    epicsFloat64 *scalarBuffer(int ib) {
+    	return pScalarPool_ + (size_t)ib*SCALAR_NUM*nchan;
+    }
+    void publishScalars(int *list);
+
+    epicsFloat64 *poolBuffer(int ib) {
+    	return pDataPool_? pDataPool_ + (size_t)ib*maxPoints_*nchan: 0;
+    }
+    epicsInt32 *rawBuffer(int ib) {
+    	return pRawPool_? pRawPool_ + (size_t)ib*maxPoints_*nchan: 0;
+    }
+    epicsFloat64 *filtBuffer(int ib) {
+    	return pFiltPool_? pFiltPool_ + (size_t)ib*maxPoints_*nchan: 0;
+    }
+    void publishBuffer(long long sample, long long first);
 
-    int get_maxPoints() {
-    	int maxPoints;
-    	getIntegerParam(P_MaxPoints,        &maxPoints);
-    	return maxPoints;
+    int get_maxPoints() const {
+    	return maxPoints_;
     }
 };
@@ -0,0 +1,137 @@
+/* ------------------------------------------------------------------------- */
+/* acq164CalBench.cpp
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+/*
+ * Microbenchmark: raw-to-volts calibration, per-sample loop (as onFrame() was)
+ * vs the kernels as processFrame() runs them: zero_run_exceeds(), raw_stats()
+ * for the accumulators, then calibrate_channel().
+ *
+ * usage: acq164CalBench [nchan=32] [frame_samples=1024] [nframes=20000] [rate_khz=20]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <epicsTime.h>
+
+#include "acq164Kernels.h"
+
+/* volatile sink stops the compiler discarding the work */
+static volatile double sink;
+
+static void ref_loop(double* data, int* const* raw, int nchan, int nsam,
+		const double* eslo, const double* eoff, double *acc)
+{
+	for (int ic = 0; ic < nchan; ++ic){
+		int consecutive_zeros = 0;
+		for (int id = 0; id < nsam; ++id){
+			int yy = raw[ic][id];
+			if (yy == 0){
+				if (++consecutive_zeros > 60){
+					printf("zeros detected\n");
+					exit(1);
+				}
+			}
+			double volts = eslo[ic]*yy + eoff[ic];
+			data[ic*nsam+id] = volts;
+			acc[ic] += volts;
+		}
+	}
+}
+
+static void kernel_loop(double* data, int* const* raw, int nchan, int nsam,
+		const double* eslo, const double* eoff, double *acc)
+{
+	for (int ic = 0; ic < nchan; ++ic){
+		if (zero_run_exceeds(raw[ic], nsam, 60)){
+			printf("zeros detected\n");
+			exit(1);
+		}
+		long long rsum;
+		double rsumsq;
+		int rmin, rmax;
+		raw_stats(raw[ic], nsam, &rsum, &rsumsq, &rmin, &rmax);
+		acc[ic] += eslo[ic]*rsum + eoff[ic]*nsam;
+		calibrate_channel(data+ic*nsam, raw[ic], nsam, eslo[ic], eoff[ic]);
+	}
+}
+
+typedef void (*LOOP)(double*, int* const*, int, int, const double*, const double*, double*);
+
+static double run(const char* label, LOOP loop, double* data, int* const* raw, int nchan, int nsam,
+		const double* eslo, const double* eoff, double *acc, int nframes)
+{
+	epicsTimeStamp t0, t1;
+
+	epicsTimeGetCurrent(&t0);
+	for (int ii = 0; ii < nframes; ++ii){
+		loop(data, raw, nchan, nsam, eslo, eoff, acc);
+	}
+	epicsTimeGetCurrent(&t1);
+	sink = acc[0] + data[nsam-1];
+
+	double secs = epicsTimeDiffInSeconds(&t1, &t0);
+	double sps = (double)nchan*nsam*nframes/secs;
+	printf("%-8s %10.3f s %12.4g samples/s %8.3f ns/sample\n", label, secs, sps, 1e9/sps);
+	return sps;
+}
+
+int main(int argc, char* argv[])
+{
+	int nchan = argc > 1? atoi(argv[1]): 32;
+	int nsam = argc > 2? atoi(argv[2]): 1024;
+	int nframes = argc > 3? atoi(argv[3]): 20000;
+	double rate_khz = argc > 4? atof(argv[4]): 20;
+
+	int** raw = new int*[nchan];
+	double* eslo = new double[nchan];
+	double* eoff = new double[nchan];
+	double* acc = new double[nchan];
+	double* data = new double[nchan*nsam];
+
+	srand(1);
+	for (int ic = 0; ic < nchan; ++ic){
+		raw[ic] = new int[nsam];
+		for (int id = 0; id < nsam; ++id){
+			raw[ic][id] = ((rand() & 0xffffff) - (1<<23)) | 1;
+		}
+		eslo[ic] = 20.0/(1<<24);
+		eoff[ic] = 1e-4*ic;
+		acc[ic] = 0;
+	}
+
+#if defined(__AVX__)
+	const char* simd = "AVX";
+#elif defined(__SSE2__)
+	const char* simd = "SSE2";
+#else
+	const char* simd = "scalar";
+#endif
+	printf("nchan:%d frame_samples:%d nframes:%d kernel:%s\n", nchan, nsam, nframes, simd);
+
+	double sps0 = run("before", ref_loop, data, raw, nchan, nsam, eslo, eoff, acc, nframes);
+	double sps1 = run("after", kernel_loop, data, raw, nchan, nsam, eslo, eoff, acc, nframes);
+	double need = nchan*rate_khz*1000;
+
+	printf("speedup %.2f, headroom at %.0f kHz x %d: before %.0f after %.0f\n",
+			sps1/sps0, rate_khz, nchan, sps0/need, sps1/need);
+	return 0;
+}
@@ -0,0 +1,248 @@
+/* ------------------------------------------------------------------------- */
+/* acq164Codec.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+/*
+ * Lossless codecs for raw ADC codes, for the compressed output.
+ * No EPICS dependencies, so a client can decode with this header alone.
+ * Streams and block words are in host order: little endian on every
+ * platform the IOC runs on.
+ */
+
+#ifndef ACQ164CODEC_H_
+#define ACQ164CODEC_H_
+
+#include <string.h>
+
+#ifdef ACQ164_LZ4
+#include <lz4.h>
+#endif
+
+/* COMP_CODEC */
+#define COMP_OFF		0
+#define COMP_DELTA		1	/* difference of order COMP_LEVEL 0..2, zigzag, bitpacked */
+#define COMP_LZ4		2	/* LZ4 of the int32 codes, COMP_LEVEL: acceleration. Needs ACQ164_LZ4 */
+
+#define COMP_BLOCK		64	/* COMP_DELTA: residuals sharing one bit width */
+#define COMP_MAX_ORDER		2
+
+/* A compressed block, COMP_WAVEFORM: COMP_HEADER_WORDS int32
+ *   [0] COMP_MAGIC [1] codec [2] level [3] nw channels [4] npoints
+ *   [5] channel mask, 0: all [6] [7] start sample, low and high word
+ * then per channel, in mask order: [nbytes] and nbytes of its stream,
+ * padded to a whole word */
+#define COMP_MAGIC		0x34363141	/* "A164" */
+#define COMP_HEADER_WORDS	8
+
+static inline unsigned comp_zigzag(unsigned d)
+{
+	return (d << 1) ^ (0u - (d >> 31));
+}
+
+static inline unsigned comp_unzigzag(unsigned u)
+{
+	return (u >> 1) ^ (0u - (u & 1));
+}
+
+/** prediction of x[id] from the samples before it, order 0..2 */
+static inline unsigned comp_predict(const int* x, int id, int order)
+{
+	if (order == 1){
+		return (unsigned)x[id-1];
+	}else if (order == 2){
+		return 2u*(unsigned)x[id-1] - (unsigned)x[id-2];
+	}
+	return 0;
+}
+
+/** most bytes delta_pack() can write for nsam samples */
+static inline size_t delta_pack_bound(int nsam)
+{
+	return COMP_MAX_ORDER*4 + (size_t)((nsam + COMP_BLOCK-1)/COMP_BLOCK)*(1 + COMP_BLOCK*4);
+}
+
+/** The first order samples as they are, then each residual from
+ *  comp_predict(), zigzagged, in blocks of COMP_BLOCK: one byte of bit width
+ *  then the residuals at that width, LSB first. Wraps mod 2^32, so any int32
+ *  round trips; 24 bit codes that move slowly pack to a few bits a sample.
+ *  \return bytes written */
+static inline size_t delta_pack(unsigned char* out, const int* x, int nsam, int order)
+{
+	unsigned char* p = out;
+	unsigned r[COMP_BLOCK];
+	const int nhead = order < nsam? order: nsam;
+
+	memcpy(p, x, (size_t)nhead*4);
+	p += nhead*4;
+	for (int i0 = nhead; i0 < nsam; i0 += COMP_BLOCK){
+		const int n = nsam - i0 < COMP_BLOCK? nsam - i0: COMP_BLOCK;
+		unsigned all = 0;
+		for (int k = 0; k < n; ++k){
+			r[k] = comp_zigzag((unsigned)x[i0+k] - comp_predict(x, i0+k, order));
+			all |= r[k];
+		}
+		int w = 0;
+		while (w < 32 && (all >> w) != 0){
+			++w;
+		}
+		*p++ = (unsigned char)w;
+
+		unsigned long long acc = 0;
+		int nbits = 0;
+		for (int k = 0; k < n; ++k){
+			acc |= (unsigned long long)r[k] << nbits;
+			for (nbits += w; nbits >= 8; nbits -= 8){
+				*p++ = (unsigned char)acc;
+				acc >>= 8;
+			}
+		}
+		if (nbits > 0){
+			*p++ = (unsigned char)acc;
+		}
+	}
+	return p - out;
+}
+
+/** inverse of delta_pack(). \return bytes read, -1 if in is short or corrupt */
+static inline long delta_unpack(int* x, int nsam, const unsigned char* in, size_t len, int order)
+{
+	const unsigned char* p = in;
+	const unsigned char* end = in + len;
+	const int nhead = order < nsam? order: nsam;
+
+	if (end - p < nhead*4){
+		return -1;
+	}
+	memcpy(x, p, (size_t)nhead*4);
+	p += nhead*4;
+	for (int i0 = nhead; i0 < nsam; i0 += COMP_BLOCK){
+		const int n = nsam - i0 < COMP_BLOCK? nsam - i0: COMP_BLOCK;
+		if (p >= end){
+			return -1;
+		}
+		const int w = *p++;
+		if (w > 32 || end - p < (n*w + 7)/8){
+			return -1;
+		}
+		const unsigned mask = w == 32? ~0u: (1u << w) - 1;
+		unsigned long long acc = 0;
+		int nbits = 0;
+		for (int k = 0; k < n; ++k){
+			for (; nbits < w; nbits += 8){
+				acc |= (unsigned long long)*p++ << nbits;
+			}
+			const unsigned r = (unsigned)acc & mask;
+			acc >>= w;
+			nbits -= w;
+			x[i0+k] = (int)(comp_unzigzag(r) + comp_predict(x, i0+k, order));
+		}
+	}
+	return p - in;
+}
+
+/** false if codec is not built in */
+static inline bool comp_have_codec(int codec)
+{
+#ifdef ACQ164_LZ4
+	if (codec == COMP_LZ4){
+		return true;
+	}
+#endif
+	return codec == COMP_DELTA;
+}
+
+/** most bytes comp_encode() can write for nsam samples */
+static inline size_t comp_bound(int nsam)
+{
+	size_t bound = delta_pack_bound(nsam);
+#ifdef ACQ164_LZ4
+	if ((size_t)LZ4_compressBound(nsam*4) > bound){
+		bound = LZ4_compressBound(nsam*4);
+	}
+#endif
+	return bound;
+}
+
+/** one channel. \return bytes written, at most comp_bound(nsam), -1 if codec is not built in */
+static inline long comp_encode(unsigned char* out, const int* x, int nsam, int codec, int level)
+{
+	if (codec == COMP_DELTA){
+		return delta_pack(out, x, nsam, level < 0? 0: level > COMP_MAX_ORDER? COMP_MAX_ORDER: level);
+	}
+#ifdef ACQ164_LZ4
+	if (codec == COMP_LZ4){
+		return LZ4_compress_fast((const char*)x, (char*)out, nsam*4, comp_bound(nsam), level < 1? 1: level);
+	}
+#endif
+	return -1;
+}
+
+/** one channel. \return 0, -1 if in is not nsam samples of codec */
+static inline int comp_decode(int* x, int nsam, const unsigned char* in, size_t len, int codec, int level)
+{
+	if (codec == COMP_DELTA){
+		return delta_unpack(x, nsam, in, len, level < 0? 0: level > COMP_MAX_ORDER? COMP_MAX_ORDER: level) < 0? -1: 0;
+	}
+#ifdef ACQ164_LZ4
+	if (codec == COMP_LZ4){
+		return LZ4_decompress_safe((const char*)in, (char*)x, len, nsam*4) == nsam*4? 0: -1;
+	}
+#endif
+	return -1;
+}
+
+/** a whole COMP_WAVEFORM block into x[nw][npoints], at most maxsam ints.
+ *  \return nw, npoints in *npoints, -1 if the block is short or corrupt */
+static inline int comp_block_decode(int* x, size_t maxsam, int* npoints,
+		const unsigned char* in, size_t len)
+{
+	int hdr[COMP_HEADER_WORDS];
+
+	if (len < sizeof(hdr)){
+		return -1;
+	}
+	memcpy(hdr, in, sizeof(hdr));
+	const int nw = hdr[3];
+	const int np = hdr[4];
+	if (hdr[0] != COMP_MAGIC || nw < 0 || np < 0 || (size_t)nw*np > maxsam){
+		return -1;
+	}
+	size_t pos = sizeof(hdr);
+	for (int k = 0; k < nw; ++k){
+		int nbytes;
+		if (len - pos < 4){
+			return -1;
+		}
+		memcpy(&nbytes, in + pos, 4);
+		pos += 4;
+		if (nbytes < 0 || len - pos < (size_t)nbytes ||
+				comp_decode(x + (size_t)k*np, np, in + pos, nbytes, hdr[1], hdr[2]) != 0){
+			return -1;
+		}
+		pos += (nbytes + 3) & ~3;
+		if (pos > len){
+			pos = len;
+		}
+	}
+	*npoints = np;
+	return nw;
+}
+
+#endif /* ACQ164CODEC_H_ */
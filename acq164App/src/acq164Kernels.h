@@ -0,0 +1,219 @@
+/* ------------------------------------------------------------------------- */
+/* acq164Kernels.h
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+/*
+ * Hot path kernels for the acquisition pipeline.
+ * No EPICS dependencies, so the benchmarks can build them standalone.
+ * SIMD is selected at compile time from the build target:
+ * AVX (+FMA) if available, else SSE2, else plain scalar.
+ */
+
+#ifndef ACQ164KERNELS_H_
+#define ACQ164KERNELS_H_
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/** Convert one channel block of raw ADC codes to volts: volts = eslo*raw + eoff.
+ *  The statistics come from the raw codes, see raw_stats() */
+static inline void calibrate_channel(
+		double* volts, const int* raw, int nsam, double eslo, double eoff)
+{
+	int id = 0;
+#if defined(__AVX__)
+	const __m256d m = _mm256_set1_pd(eslo);
+	const __m256d c = _mm256_set1_pd(eoff);
+
+	for (; id+8 <= nsam; id += 8){
+		__m256d x0 = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(raw+id)));
+		__m256d x1 = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(raw+id+4)));
+#if defined(__FMA__)
+		__m256d y0 = _mm256_fmadd_pd(x0, m, c);
+		__m256d y1 = _mm256_fmadd_pd(x1, m, c);
+#else
+		__m256d y0 = _mm256_add_pd(_mm256_mul_pd(x0, m), c);
+		__m256d y1 = _mm256_add_pd(_mm256_mul_pd(x1, m), c);
+#endif
+		_mm256_storeu_pd(volts+id, y0);
+		_mm256_storeu_pd(volts+id+4, y1);
+	}
+#elif defined(__SSE2__)
+	const __m128d m = _mm_set1_pd(eslo);
+	const __m128d c = _mm_set1_pd(eoff);
+
+	for (; id+4 <= nsam; id += 4){
+		__m128i x = _mm_loadu_si128((const __m128i*)(raw+id));
+		__m128d y0 = _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(x), m), c);
+		__m128d y1 = _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(x, 8)), m), c);
+		_mm_storeu_pd(volts+id, y0);
+		_mm_storeu_pd(volts+id+2, y1);
+	}
+#endif
+	for (; id < nsam; ++id){
+		volts[id] = eslo*raw[id] + eoff;
+	}
+}
+
+/** Single pass sum, sum of squares, min and max of one channel block of raw codes.
+ *  24 bit codes: the int64 sum of squares is exact for blocks up to 2^17 */
+static inline void raw_stats(const int* raw, int nsam,
+		long long* sum, double* sumsq, int* vmin, int* vmax)
+{
+	long long s1 = 0;
+	long long s2 = 0;
+	int mn = nsam? raw[0]: 0;
+	int mx = mn;
+
+	for (int id = 0; id < nsam; ++id){
+		int yy = raw[id];
+		s1 += yy;
+		s2 += (long long)yy*yy;
+		mn = yy < mn? yy: mn;
+		mx = yy > mx? yy: mx;
+	}
+	*sum = s1;
+	*sumsq = (double)s2;
+	*vmin = mn;
+	*vmax = mx;
+}
+
+/** true if raw holds a run of more than limit consecutive zeros.
+ *  Any such run covers a multiple of limit+1, so only those samples are
+ *  tested, and the run is measured only on a hit. limit < 0 counts as 0 */
+static inline bool zero_run_exceeds(const int* raw, int nsam, int limit)
+{
+	if (limit < 0){
+		limit = 0;
+	}
+	const int stride = limit+1;
+
+	for (int id = 0; id < nsam; id += stride){
+		if (raw[id] == 0){
+			int i1 = id;
+			int i2 = id;
+			while (i1 > 0 && raw[i1-1] == 0){
+				--i1;
+			}
+			while (i2+1 < nsam && raw[i2+1] == 0){
+				++i2;
+			}
+			if (i2 - i1 + 1 > limit){
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/** number of raw codes at or beyond lo or hi: compares and adds, no
+ *  branches, so the compiler vectorizes it */
+static inline int full_scale_count(const int* raw, int nsam, int lo, int hi)
+{
+	int count = 0;
+
+	for (int id = 0; id < nsam; ++id){
+		count += (raw[id] <= lo) | (raw[id] >= hi);
+	}
+	return count;
+}
+
+/* Filters run sample-major: x[id*nl + k] is sample id of lane (channel) k.
+ * All lanes share the coefficients, so the inner loop over lanes is
+ * independent, contiguous, and is vectorized by the compiler. */
+
+#define TRANSPOSE_TILE	16	/* 16x16 doubles, 2 KB a side, stays in L1 */
+
+/** dst[c*dst_stride + r] = src[r*src_stride + c] for r < rows, c < cols.
+ *  Done tile by tile, so reads and writes both stay within a few cache
+ *  lines per row while the tile is in L1 */
+template <class T>
+static inline void transpose_block(T* dst, long dst_stride,
+		const T* src, long src_stride, int rows, int cols)
+{
+	for (int r0 = 0; r0 < rows; r0 += TRANSPOSE_TILE){
+		const int r1 = r0 + TRANSPOSE_TILE < rows? r0 + TRANSPOSE_TILE: rows;
+		for (int c0 = 0; c0 < cols; c0 += TRANSPOSE_TILE){
+			const int c1 = c0 + TRANSPOSE_TILE < cols? c0 + TRANSPOSE_TILE: cols;
+			for (int r = r0; r < r1; ++r){
+				const T* s = src + r*src_stride;
+				for (int c = c0; c < c1; ++c){
+					dst[c*dst_stride + r] = s[c];
+				}
+			}
+		}
+	}
+}
+
+/** channel-major block, lane k at in + k*stride, to sample-major x[nsam][nl] */
+static inline void to_lanes(double* x, const double* in, int stride, int nsam, int nl)
+{
+	transpose_block(x, nl, in, stride, nl, nsam);
+}
+
+/** sample-major x[nsam][nl] back to channel-major out + k*stride */
+static inline void from_lanes(double* out, int stride, const double* x, int nsam, int nl)
+{
+	transpose_block(out, stride, x, nl, nsam, nl);
+}
+
+/** one biquad section in place, transposed direct form II.
+ *  c: b0 b1 b2 a1 a2, a0 = 1. z1, z2: state per lane, kept across blocks */
+static inline void biquad_lanes(double* x, int nsam, int nl, const double* c,
+		double* z1, double* z2)
+{
+	const double b0 = c[0], b1 = c[1], b2 = c[2], a1 = c[3], a2 = c[4];
+
+	for (int id = 0; id < nsam; ++id){
+		double* xx = x + id*nl;
+		for (int k = 0; k < nl; ++k){
+			double xi = xx[k];
+			double yy = b0*xi + z1[k];
+			z1[k] = b1*xi - a1*yy + z2[k];
+			z2[k] = b2*xi - a2*yy;
+			xx[k] = yy;
+		}
+	}
+}
+
+/** FIR of ntaps: x holds ntaps-1 rows of history then nsam new rows, y gets nsam rows.
+ *  y[id] = sum h[j]*x[id + ntaps-1 - j] */
+static inline void fir_lanes(double* y, const double* x, int nsam, int nl,
+		const double* h, int ntaps)
+{
+	for (int id = 0; id < nsam; ++id){
+		double* yy = y + id*nl;
+		for (int k = 0; k < nl; ++k){
+			yy[k] = 0;
+		}
+		for (int j = 0; j < ntaps; ++j){
+			const double hj = h[j];
+			const double* xx = x + (id + ntaps-1 - j)*nl;
+			for (int k = 0; k < nl; ++k){
+				yy[k] += hj*xx[k];
+			}
+		}
+	}
+}
+
+#endif /* ACQ164KERNELS_H_ */
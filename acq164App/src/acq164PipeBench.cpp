@@ -0,0 +1,391 @@
+/* ------------------------------------------------------------------------- */
+/* acq164PipeBench.cpp
+ * Project: ACQ164_IOC
+ * ------------------------------------------------------------------------- *
+ *   Copyright (C) 2020/2021 Peter Milne, D-TACQ Solutions Ltd         *
+ *                      <peter dot milne at D hyphen TACQ dot com>           *
+ *                                                                           *
+ *  This program is free software; you can redistribute it and/or modify     *
+ *  it under the terms of Version 2 of the GNU General Public License        *
+ *  as published by the Free Software Foundation;                            *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU General Public License for more details.                             *
+ *                                                                           *
+ *  You should have received a copy of the GNU General Public License        *
+ *  along with this program; if not, write to the Free Software              *
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                *
+\* ------------------------------------------------------------------------- */
+
+/*
+ * Pipeline benchmark: the onFrame() stages, scalar and stats windows,
+ * calibration, decimation and the block handoff to a publisher thread,
+ * over synthetic frames for each nchan x maxPoints, alone and together.
+ * The publisher copies each channel out, as an array callback into a
+ * waveform record does. Where the driver would drop a block with no free
+ * buffer, the bench waits and counts it, so the rate is the sustainable one.
+ * Allocations are C++ new calls in the timed loop, which should stay 0.
+ *
+ * usage: acq164PipeBench [nframes=2000] [nchan=4,8,16,32] [maxPoints=1024,4096,16384]
+ *                        [csv=acq164PipeBench.csv] [rate_khz=20]
+ * Every result is also a line in csv, with a header, for tracking between releases.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <new>
+
+#include <epicsTime.h>
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsAtomic.h>
+
+#include "acq164Kernels.h"
+#include "BufferPool.h"
+#include "Stats.h"
+#include "Decimator.h"
+#include "RawFrame.h"
+
+/* C++ allocations, counted while a stage runs */
+static int nalloc;
+
+void* operator new(size_t size)
+{
+	epicsAtomicIncrIntT(&nalloc);
+	void* mem = malloc(size? size: 1);
+	if (mem == 0){
+		throw std::bad_alloc();
+	}
+	return mem;
+}
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+void operator delete(void* mem) throw()
+{
+	free(mem);
+}
+void operator delete[](void* mem) throw()
+{
+	free(mem);
+}
+void operator delete(void* mem, size_t) throw()
+{
+	free(mem);
+}
+void operator delete[](void* mem, size_t) throw()
+{
+	free(mem);
+}
+
+/* stages, run alone then all together as in onFrame() */
+#define ST_STATS	0x1	/* raw_stats, scalar and stats bank windows */
+#define ST_CAL		0x2	/* raw to volts into the block */
+#define ST_DEC		0x4	/* decimation of the block */
+#define ST_PUB		0x8	/* block handoff and the publisher's copy */
+#define ST_ALL		0xf
+
+#define NUM_FRAMES_SYNTH	16	/* distinct frames, more than the caches hold at 32 channels */
+#define NUM_BUFFERS		4
+#define SCALAR_WINDOW		2000	/* 10 Hz at 20 kHz */
+#define BANK_WINDOW		20000	/* 1 Hz */
+#define DEC_FACTOR		10
+
+/* volatile sink stops the compiler discarding the work */
+static volatile double sink;
+
+static void publisher_runner(void* pvt);
+
+class PipeBench {
+	const int nchan;
+	const int maxPoints;
+	int* frames;
+	const int** chan;
+	double* eslo;
+	double* eoff;
+
+	Stats<double> acc;
+	StatsBank<double> bank;
+	Decimator<double> dec;
+
+	BufferPool pool;
+	double* blocks;
+	double* record;		/* the clients' copy of each channel */
+	int fill_ib;
+	int cursor;
+	epicsEventId wake;
+	epicsEventId exited;
+	int stop;
+
+	double* block(int ib) {
+		return blocks + (size_t)ib*nchan*maxPoints;
+	}
+	void publish();
+	void frame(const RawFrame* cf, int stages);
+public:
+	int waits;		/* blocks that waited for the publisher */
+	int published;
+
+	PipeBench(int nchan, int maxPoints);
+	~PipeBench();
+	/** nframes through stages. returns ns per channel sample */
+	double run(int stages, int nframes, int* allocs);
+	void publisher();
+};
+
+PipeBench::PipeBench(int _nchan, int _maxPoints):
+	nchan(_nchan), maxPoints(_maxPoints),
+	acc(_nchan), bank(_nchan, NUM_BUFFERS), dec(_nchan, _maxPoints/DEC_FACTOR, NUM_BUFFERS),
+	pool(NUM_BUFFERS), cursor(0), stop(0), waits(0), published(0)
+{
+	frames = new int[(size_t)NUM_FRAMES_SYNTH*nchan*FRAME_SAMPLES];
+	chan = new const int*[nchan];
+	eslo = new double[nchan];
+	eoff = new double[nchan];
+	blocks = new double[(size_t)pool.size()*nchan*maxPoints]();
+	record = new double[(size_t)nchan*maxPoints]();
+
+	srand(1);
+	for (size_t ii = 0; ii < (size_t)NUM_FRAMES_SYNTH*nchan*FRAME_SAMPLES; ++ii){
+		frames[ii] = ((rand() & 0xffffff) - (1<<23)) | 1;
+	}
+	for (int ic = 0; ic < nchan; ++ic){
+		eslo[ic] = 20.0/(1<<24);
+		eoff[ic] = 1e-4*ic;
+	}
+	acc.setWindow(SCALAR_WINDOW);
+	bank.stats.setWindow(BANK_WINDOW);
+	dec.configure(DEC_FACTOR, DEC_MODE_MEAN);
+	fill_ib = pool.acquire(-1);
+
+	wake = epicsEventMustCreate(epicsEventEmpty);
+	exited = epicsEventMustCreate(epicsEventEmpty);
+	epicsThreadCreate("pipeBench.pub", epicsThreadPriorityMedium,
+			epicsThreadGetStackSize(epicsThreadStackMedium),
+			(EPICSTHREADFUNC)::publisher_runner, this);
+}
+
+PipeBench::~PipeBench()
+{
+	epicsAtomicSetIntT(&stop, 1);
+	epicsEventSignal(wake);
+	epicsEventWait(exited);
+	epicsEventDestroy(wake);
+	epicsEventDestroy(exited);
+	delete [] frames;
+	delete [] chan;
+	delete [] eslo;
+	delete [] eoff;
+	delete [] blocks;
+	delete [] record;
+}
+
+static void publisher_runner(void* pvt)
+{
+	((PipeBench *)pvt)->publisher();
+}
+
+/** publisher thread: copy each channel out and give the buffer back */
+void PipeBench::publisher()
+{
+	while (!epicsAtomicGetIntT(&stop)){
+		epicsEventWaitWithTimeout(wake, 0.1);
+		int ib;
+		while ((ib = pool.take()) >= 0){
+			const double* bb = block(ib);
+			for (int k = 0; k < nchan; ++k){
+				memcpy(record + (size_t)k*maxPoints, bb + (size_t)k*maxPoints, maxPoints*sizeof(double));
+			}
+			pool.release(ib);
+			epicsAtomicIncrIntT(&published);
+		}
+	}
+	epicsEventSignal(exited);
+}
+
+void PipeBench::publish()
+{
+	int next = pool.acquire(fill_ib);
+	if (next < 0){
+		++waits;
+		while ((next = pool.acquire(fill_ib)) < 0){
+			epicsThreadSleep(0);
+		}
+	}
+	pool.post(fill_ib);
+	epicsEventSignal(wake);
+	fill_ib = next;
+}
+
+/** as Acq164Device::processFrame(), all channels active */
+void PipeBench::frame(const RawFrame* cf, int stages)
+{
+	const long long sample = cf->getStartSampleNumber();
+
+	for (int r0 = 0; r0 < FRAME_SAMPLES; ){
+		int n = FRAME_SAMPLES - r0;
+		if (n > maxPoints - cursor){
+			n = maxPoints - cursor;
+		}
+		if (stages & ST_STATS){
+			if (acc.remaining(sample + r0) <= 0){
+				sink = acc.get(0);
+				acc.clear();
+			}
+			if (bank.stats.remaining(sample + r0) <= 0 && bank.complete(sample + r0, 0)){
+				int ib = bank.take();
+				sink = bank.result(ib)[0];
+				bank.release(ib);
+			}
+			long long left = acc.remaining(sample + r0);
+			if (bank.stats.remaining(sample + r0) < left){
+				left = bank.stats.remaining(sample + r0);
+			}
+			if (n > left){
+				n = left;
+			}
+			for (int ic = 0; ic < nchan; ++ic){
+				long long rsum;
+				double rsumsq;
+				int rmin, rmax;
+				raw_stats(cf->getChannel(ic+1) + r0, n, &rsum, &rsumsq, &rmin, &rmax);
+				acc.add_raw(ic, eslo[ic], eoff[ic], n, rsum, rsumsq, rmin, rmax);
+				bank.stats.add_raw(ic, eslo[ic], eoff[ic], n, rsum, rsumsq, rmin, rmax);
+			}
+			acc.count(n);
+			bank.stats.count(n);
+		}
+		double* data = block(fill_ib);
+		for (int ic = 0; ic < nchan; ++ic){
+			double* yy = data + (size_t)ic*maxPoints + cursor;
+			if (stages & ST_CAL){
+				calibrate_channel(yy, cf->getChannel(ic+1) + r0, n, eslo[ic], eoff[ic]);
+			}
+			if (stages & ST_DEC){
+				dec.decimate(ic, yy, n);
+			}
+		}
+		if ((stages & ST_DEC) && dec.commit(n, sample + r0)){
+			int ib = dec.take();
+			sink = dec.lo(ib, 0)[0];
+			dec.release(ib);
+		}
+		cursor += n;
+		r0 += n;
+		if (cursor >= maxPoints){
+			cursor = 0;
+			if (stages & ST_PUB){
+				publish();
+			}
+		}
+	}
+}
+
+double PipeBench::run(int stages, int nframes, int* allocs)
+{
+	const int pub0 = epicsAtomicGetIntT(&published);
+	const int alloc0 = epicsAtomicGetIntT(&nalloc);
+	const epicsUInt64 t0 = epicsMonotonicGet();
+
+	for (int ii = 0; ii < nframes; ++ii){
+		const int* ff = frames + (size_t)(ii%NUM_FRAMES_SYNTH)*nchan*FRAME_SAMPLES;
+		for (int ic = 0; ic < nchan; ++ic){
+			chan[ic] = ff + (size_t)ic*FRAME_SAMPLES;
+		}
+		const RawFrame rf(chan, (long long)ii*FRAME_SAMPLES);
+		frame(&rf, stages);
+	}
+	/* done when the publisher has copied every block out */
+	if (stages & ST_PUB){
+		while (pool.inUse() > 1){
+			epicsThreadSleep(0);
+		}
+	}
+	const epicsUInt64 t1 = epicsMonotonicGet();
+	*allocs = epicsAtomicGetIntT(&nalloc) - alloc0;
+	sink = record[0] + acc.get(0) + (epicsAtomicGetIntT(&published) - pub0);
+
+	return (double)(t1 - t0)/((double)nframes*nchan*FRAME_SAMPLES);
+}
+
+/** comma separated ints, at most max */
+static int parseList(const char* arg, int* list, int max)
+{
+	int nl = 0;
+	for (const char* cp = arg; cp && *cp && nl < max; ){
+		list[nl++] = atoi(cp);
+		cp = strchr(cp, ',');
+		cp = cp? cp+1: 0;
+	}
+	return nl;
+}
+
+int main(int argc, char* argv[])
+{
+	const int nframes = argc > 1? atoi(argv[1]): 2000;
+	int nchans[16] = { 4, 8, 16, 32 };
+	int npoints[16] = { 1024, 4096, 16384 };
+	const int nnc = argc > 2? parseList(argv[2], nchans, 16): 4;
+	const int nnp = argc > 3? parseList(argv[3], npoints, 16): 3;
+	const char* csv = argc > 4? argv[4]: "acq164PipeBench.csv";
+	const double rate_khz = argc > 5? atof(argv[5]): 20;
+
+	static const struct { const char* name; int stages; } stages[] = {
+		{ "stats",	ST_STATS },
+		{ "calibrate",	ST_CAL },
+		{ "decimate",	ST_DEC },
+		{ "publish",	ST_PUB },
+		{ "pipeline",	ST_ALL },
+	};
+	const int nstages = sizeof(stages)/sizeof(stages[0]);
+
+#if defined(__AVX__)
+	const char* simd = "AVX";
+#elif defined(__SSE2__)
+	const char* simd = "SSE2";
+#else
+	const char* simd = "scalar";
+#endif
+	FILE* fp = fopen(csv, "w");
+	if (fp == 0){
+		perror(csv);
+		return 1;
+	}
+	fprintf(fp, "stage,nchan,max_points,frames,kernel,ns_per_sample,msamples_per_s,headroom,allocs,waits\n");
+	printf("frames:%d kernel:%s headroom at %.0f kHz, csv:%s\n", nframes, simd, rate_khz, csv);
+	printf("%-10s %5s %9s %10s %12s %9s %7s %7s\n",
+			"stage", "nchan", "maxPoints", "ns/sample", "Msamples/s", "headroom", "allocs", "waits");
+
+	for (int ic = 0; ic < nnc; ++ic){
+		for (int ip = 0; ip < nnp; ++ip){
+			if (nchans[ic] < 1 || npoints[ip] < DEC_FACTOR){
+				continue;
+			}
+			PipeBench* pb = new PipeBench(nchans[ic], npoints[ip]);
+			int allocs;
+			/* warm up: fault in the buffers, fill the caches */
+			pb->run(ST_ALL, NUM_FRAMES_SYNTH, &allocs);
+
+			for (int is = 0; is < nstages; ++is){
+				const int waits0 = pb->waits;
+				const double ns = pb->run(stages[is].stages, nframes, &allocs);
+				const double msps = 1e3/ns;
+				const double headroom = msps*1e6/(nchans[ic]*rate_khz*1000);
+				const int waits = pb->waits - waits0;
+
+				printf("%-10s %5d %9d %10.3f %12.2f %9.1f %7d %7d\n",
+						stages[is].name, nchans[ic], npoints[ip], ns, msps, headroom, allocs, waits);
+				fprintf(fp, "%s,%d,%d,%d,%s,%.4f,%.3f,%.2f,%d,%d\n",
+						stages[is].name, nchans[ic], npoints[ip], nframes, simd,
+						ns, msps, headroom, allocs, waits);
+			}
+			delete pb;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
@@ -14,41 +14,71 @@ acq164_registerRecordDeviceDriver pdbbase
 # Turn on asynTraceFlow and asynTraceError for global trace, i.e. no connected asynUser.
 asynSetTraceMask("", 0, 17)
 
+#- optional 4th arg outputs: 1 volts (default), 2 raw int32 only, 3 both, +4 filtered volts
+#- optional 5th, 6th: streaming thread cpumask (0: any) and EPICS priority (0: medium),
+#- realtime (SCHED_FIFO) needs the IOC to run with rtprio permission
+#- optional 7th, hugepages: 1 puts the buffers on 2 MB hugepages (vm.nr_hugepages), else THP
 acq164AsynPortDriverConfigure("${UUT}", ${SIZE}, ${NCHAN})
+#- more cards: one port each, eg pinned to cpus 2 and 3 at priority 80
+#acq164AsynPortDriverConfigure("${UUT2}", ${SIZE}, ${NCHAN}, 1, 0x4, 80, 1)
+#acq164AsynPortDriverConfigure("${UUT3}", ${SIZE}, ${NCHAN}, 1, 0x8, 80, 1)
+#- and load the same templates with P=${UUT2}:,PORT=${UUT2} etc
+#- no card: replay a recording through the same pipeline in place of acq164AsynPortDriverConfigure,
+#- Recorder .raw or dirfile, or plain int32 [sample][nchan]; speed 1: real time at SAMPLE_RATE,
+#- N: N x real time, 0: as fast as possible (see the INST: rates); loop 1: for ever
+#acq164ReplayConfigure("${UUT}", ${SIZE}, ${NCHAN}, 1, 0, 0, 0, "/data/acq164/20210301-120000.000.raw", 0, 1)
+#- merge cards by sample number as one port: cards, points per block, skew window frames
+#acq164MergeConfigure("MERGE", "${UUT} ${UUT2} ${UUT3}", ${SIZE}, 4)
+#dbLoadRecords("db/asynMerge.db","P=${UUT}:,R=M,PORT=MERGE,TIMEOUT=1")
+#dbLoadRecords("db/asynMergeCard.db","P=${UUT}:,R=M,PORT=MERGE,TIMEOUT=1,CARD=0")
+#dbLoadRecords("db/asynMergeWaveform.db","P=${UUT}:,R=M,PORT=MERGE,CH=001,ADDR=0,TIMEOUT=1,NPOINTS=${SIZE}")
+
+#- PVA: all channels as one NTNDArray per update, needs QSRV
+#epicsEnvSet("EPICS_PVAS_PROVIDER_NAMES", "local acq164")
+#acq164PvaConfigure("${UUT}", "${UUT}:1:AI:NDARRAY")
+#- PVA:LAYOUT "Sample major" serves it interleaved, [maxPoints][nchan]
 
 dbLoadRecords("db/testAsynPortDriver.db","P=${UUT}:,R=1,PORT=${UUT},ADDR=0,TIMEOUT=1,NPOINTS=${SIZE},NCHAN=${NCHAN}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=01,ADDR=0,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=02,ADDR=1,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=03,ADDR=2,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=04,ADDR=3,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=05,ADDR=4,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=06,ADDR=5,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=07,ADDR=6,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=08,ADDR=7,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=09,ADDR=8,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=10,ADDR=9,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=11,ADDR=10,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=12,ADDR=11,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=13,ADDR=12,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=14,ADDR=13,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=15,ADDR=14,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=16,ADDR=15,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=17,ADDR=16,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=18,ADDR=17,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=19,ADDR=18,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=20,ADDR=19,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=21,ADDR=20,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=22,ADDR=21,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=23,ADDR=22,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=24,ADDR=23,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=25,ADDR=24,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=26,ADDR=25,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=27,ADDR=26,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=28,ADDR=27,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=29,ADDR=28,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=30,ADDR=29,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=31,ADDR=30,TIMEOUT=1,NPOINTS=${SIZE}")
-dbLoadRecords("db/asynWaveform.db","P=${UUT}:,R=1,PORT=${UUT},CH=32,ADDR=31,TIMEOUT=1,NPOINTS=${SIZE}")
+#- per channel records: each template once per channel, CH=01.. ADDR=0.. follow NCHAN
+acq164LoadChannelRecords("${UUT}", "db/asynWaveform.db", "P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1,NPOINTS=${SIZE}")
+#- or every channel in one record, NELM is SIZE*NCHAN, in place of most per channel waveforms:
+#dbLoadRecords("db/asynWaveformAll.db","P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1,NELM=32768")
+#- with outputs 2 or 3, per channel raw waveform and ESLO/EOFF:
+#acq164LoadChannelRecords("${UUT}", "db/asynWaveformRaw.db", "P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1,NPOINTS=${SIZE}")
+#- with DEC:FACTOR > 1, per channel decimated waveforms:
+#acq164LoadChannelRecords("${UUT}", "db/asynWaveformDec.db", "P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1,NPOINTS=${SIZE}")
+#- with outputs 4, per channel filtered waveform, and the filter settings:
+#acq164LoadChannelRecords("${UUT}", "db/asynWaveformFilt.db", "P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1,NPOINTS=${SIZE}")
+#dbLoadRecords("db/asynFilter.db","P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1")
+#- per channel power spectra, here 4096 point on 2 worker threads: NBINS is nfft/2+1
+#acq164SpectrumConfigure("${UUT}", 4096, 2)
+#dbLoadRecords("db/asynSpectrum.db","P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1,NBINS=2049")
+#acq164LoadChannelRecords("${UUT}", "db/asynSpectrumChannel.db", "P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1,NBINS=2049")
+#- software trigger, events up to 8192 samples PRE + POST, 8 queued for the publisher:
+#acq164TriggerConfigure("${UUT}", 8192, 8)
+#dbLoadRecords("db/asynTrigger.db","P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1,NELM=8192")
+#acq164LoadChannelRecords("${UUT}", "db/asynTriggerChannel.db", "P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1,NELM=8192")
+#- compressed raw blocks for remote clients, with outputs 2 or 3, COMP:CODEC turns it on:
+#- NELM bytes, worst case 4.1*SIZE*NCHAN + 32
+#acq164CompressConfigure("${UUT}")
+#dbLoadRecords("db/asynCompress.db","P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1,NELM=134400")
+#- stats banks 1..3, default 1, 10, 100 Hz. NELM is 5*NCHAN
+dbLoadRecords("db/asynStatsBank.db","P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1,BANK=1,NELM=160")
+dbLoadRecords("db/asynStatsBank.db","P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1,BANK=2,NELM=160")
+dbLoadRecords("db/asynStatsBank.db","P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1,BANK=3,NELM=160")
+#- per channel stats scalars:
+#acq164LoadChannelRecords("${UUT}", "db/asynStats.db", "P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1,BANK=1")
+dbLoadRecords("db/asynCardHealth.db","P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1")
+dbLoadRecords("db/asynIntegrity.db","P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1")
+#- per channel integrity bits:
+#acq164LoadChannelRecords("${UUT}", "db/asynIntegrityChannel.db", "P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1")
+dbLoadRecords("db/asynInstrument.db","P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1")
+#- fast path for feedback: FAST:MASK channels published every frame, FAST:LATENCY_US
+#dbLoadRecords("db/asynFast.db","P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1")
+#acq164LoadChannelRecords("${UUT}", "db/asynFastChannel.db", "P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1")
+#- raw recording to disk, REC:ENABLE starts it, or from here: root, 0:dirfile 1:raw, rotate MB, O_DIRECT
+dbLoadRecords("db/asynRecorder.db","P=${UUT}:,R=1,PORT=${UUT},TIMEOUT=1")
+#acq164RecorderConfigure("${UUT}", "/data/acq164", 0, 1000, 1)
 dbLoadRecords("db/asynRecord.db","P=${UUT}:,R=asyn1,PORT=${UUT},ADDR=0,OMAX=80,IMAX=80")
 
 